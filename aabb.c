@@ -3,6 +3,22 @@
 
 #include "aabb.h"
 
+/*!
+  The array checks test four boxes at a time with SSE2 or NEON when the
+  compiler targets either; define QTREE_NO_SIMD to use the plain C loop.
+*/
+#if !defined(QTREE_NO_SIMD) && defined(__SSE2__)
+ #include <emmintrin.h>
+ #define AABB_SIMD_SSE2 1
+#elif !defined(QTREE_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+ #include <arm_neon.h>
+ #define AABB_SIMD_NEON 1
+#endif
+
+/* External definitions of the inline functions in aabb.h */
+extern inline int aabb_contains(const aabb *a, float x, float y);
+extern inline int aabb_intersects(const aabb *a, const aabb *b);
+
 aabb*
 aabb_new(float x, float y, float hW, float hH) {
 	aabb* a = malloc(sizeof(aabb));
@@ -18,17 +34,75 @@ aabb_free(aabb *a) {
 	free(a);
 }
 
-int
-aabb_contains(aabb *a, float x, float y) {
-	return (x >= a->center.x-a->dims.w &&
-			x <= a->center.x+a->dims.w) &&
-		   (y >= a->center.y-a->dims.h &&
-			y <= a->center.y+a->dims.h);
+#if defined(AABB_SIMD_SSE2) || defined(AABB_SIMD_NEON)
+/// Tests q against boxes b[0..3], as aabb_intersects() would; returns a bit per box
+/*!
+  The boxes are transposed into center and half-size lanes, so the test
+  is the same sums and comparisons the scalar one does, four at once.
+*/
+static inline uint32_t
+aabb_intersects4(const aabb *q, const aabb *b) {
+#if defined(AABB_SIMD_SSE2)
+	__m128 cx = _mm_loadu_ps(&b[0].center.x), cy = _mm_loadu_ps(&b[1].center.x);
+	__m128 w = _mm_loadu_ps(&b[2].center.x), h = _mm_loadu_ps(&b[3].center.x);
+	_MM_TRANSPOSE4_PS(cx, cy, w, h);
+
+	__m128 sign = _mm_set1_ps(-0.0f);
+	__m128 dx = _mm_andnot_ps(sign, _mm_sub_ps(_mm_set1_ps(q->center.x), cx));
+	__m128 dy = _mm_andnot_ps(sign, _mm_sub_ps(_mm_set1_ps(q->center.y), cy));
+	__m128 c = _mm_and_ps(_mm_cmple_ps(dx, _mm_add_ps(_mm_set1_ps(q->dims.w), w)),
+						  _mm_cmple_ps(dy, _mm_add_ps(_mm_set1_ps(q->dims.h), h)));
+	return (uint32_t)_mm_movemask_ps(c);
+#else
+	static const uint32_t bits[4] = { 1, 2, 4, 8 };
+	float32x4x4_t v = vld4q_f32(&b[0].center.x);
+
+	float32x4_t dx = vabdq_f32(vdupq_n_f32(q->center.x), v.val[0]);
+	float32x4_t dy = vabdq_f32(vdupq_n_f32(q->center.y), v.val[1]);
+	uint32x4_t c = vandq_u32(vcleq_f32(dx, vaddq_f32(vdupq_n_f32(q->dims.w), v.val[2])),
+							 vcleq_f32(dy, vaddq_f32(vdupq_n_f32(q->dims.h), v.val[3])));
+	return vaddvq_u32(vandq_u32(c, vld1q_u32(bits)));
+#endif
 }
+#endif
+
+void
+aabb_intersects_mask(const aabb *q, const aabb *boxes, uint32_t n, uint64_t *mask) {
+	for(uint32_t w=0; w*64 < n; w++) {
+		uint32_t end = n - w*64 < 64 ? n - w*64 : 64;
+		const aabb *b = boxes + w*64;
+		uint64_t m = 0;
+		uint32_t i = 0;
+
+#if defined(AABB_SIMD_SSE2) || defined(AABB_SIMD_NEON)
+		for(; i+4 <= end; i+=4)
+			m |= (uint64_t)aabb_intersects4(q, &b[i]) << i;
+#endif
+		for(; i<end; i++)
+			m |= (uint64_t)aabb_intersects(q, &b[i]) << i;
 
-int
-aabb_intersects(aabb *a, aabb *b) {
-	return (abs(a->center.x - b->center.x) < (a->dims.w + b->dims.w)) &&
-		   (abs(a->center.y - b->center.y) < (a->dims.h + b->dims.h));
+		mask[w] = m;
+	}
 }
 
+uint32_t
+aabb_intersects_list(const aabb *q, const aabb *boxes, uint32_t n, uint32_t *idx) {
+	uint32_t k = 0, i = 0;
+
+	// Always store, only advance on a hit, so the loop has no branch
+#if defined(AABB_SIMD_SSE2) || defined(AABB_SIMD_NEON)
+	for(; i+4 <= n; i+=4) {
+		uint32_t m = aabb_intersects4(q, &boxes[i]);
+		for(uint32_t j=0; j<4; j++) {
+			idx[k] = i+j;
+			k += (m >> j) & 1;
+		}
+	}
+#endif
+	for(; i<n; i++) {
+		idx[k] = i;
+		k += aabb_intersects(q, &boxes[i]);
+	}
+
+	return k;
+}
@@ -10,6 +10,13 @@
 #ifndef _AABB_H
  #define _AABB_H
 
+#include <stdint.h>
+#include <math.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /** \brief axis-aligned bounding box
 
 	Simple struct of four floats, divided into two sub-structs.
@@ -40,9 +47,45 @@ aabb* aabb_new(float x, float y, float hW, float hH);
 void aabb_free(aabb *a);
 
 /// Checks if the point x,y lies within the passed aabb
-int aabb_contains(aabb *a, float x, float y);
+/*!
+  Points on the edge of the box count as inside.
+*/
+inline int
+aabb_contains(const aabb *a, float x, float y) {
+	return (fabsf(x - a->center.x) <= a->dims.w) &
+		   (fabsf(y - a->center.y) <= a->dims.h);
+}
 
 /// Checks if the two passed aabb's intersect
-int aabb_intersects(aabb *a, aabb *b);
+/*!
+  Boxes that only touch along an edge count as intersecting.
+*/
+inline int
+aabb_intersects(const aabb *a, const aabb *b) {
+	return (fabsf(a->center.x - b->center.x) <= a->dims.w + b->dims.w) &
+		   (fabsf(a->center.y - b->center.y) <= a->dims.h + b->dims.h);
+}
+
+/// Checks one aabb against an array of them, returning a bitmask
+/*!
+  Tests q against the n boxes in boxes, as aabb_intersects() would,
+  and sets bit i%64 of mask[i/64] for each box i that intersects it.
+  mask must have room for (n+63)/64 words.
+*/
+void aabb_intersects_mask(const aabb *q, const aabb *boxes, uint32_t n, uint64_t *mask);
+
+/// Checks one aabb against an array of them, returning matching indices
+/*!
+  Tests q against the n boxes in boxes, as aabb_intersects() would,
+  and writes the index of each box that intersects it to idx, in
+  order. idx must have room for n entries.
+
+  Returns the number of indices written.
+*/
+uint32_t aabb_intersects_list(const aabb *q, const aabb *boxes, uint32_t n, uint32_t *idx);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
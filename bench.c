@@ -0,0 +1,616 @@
+/*
+  bench.c
+  2014 JSK (kutani@projectkutani.com)
+
+  Benchmarks for the quadtree library. Part of the Panic Panic project.
+  Build and run with `make bench`.
+
+  Every workload prints one line of JSON to stdout:
+  {"bench":..., "dist":..., "n":..., "unit":..., "ops":...,
+   "ops_per_sec":..., "p50_ns":..., "p99_ns":..., "peak_rss_kb":...}
+  unit is what ops counts: "element" inserted, removed or updated,
+  "query" run, or "tree" cleared. Latencies are per operation, except
+  for "build", "build_aabb" and "insert_aabb_loop", which time a whole
+  tree of n elements at a time. Each workload runs in its own forked
+  process, so peak_rss_kb is the peak of that workload alone, on top
+  of the entity array and sample buffer every workload starts with.
+
+  Released to the public domain. See LICENSE for details.
+*/
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/// Lock backends as quadtree.c numbers them, so LOCK can be tested here
+#define QTREE_LOCK_NONE 0
+#define QTREE_LOCK_ATOMIC 1
+#define QTREE_LOCK_PTHREAD 2
+#define QTREE_LOCK_HOOKS 3
+
+/// Whether the library was built with tree locking, as quadtree.c decides it
+#if defined(NO_THREAD_SAFETY) || (defined(QTREE_LOCK) && QTREE_LOCK == QTREE_LOCK_NONE)
+ #define BENCH_THREADS 0
+#else
+ #define BENCH_THREADS 1
+ #include <pthread.h>
+#endif
+
+#include "quadtree.h"
+
+/// Width and height of the area every workload uses
+#define BENCH_WORLD 10000.0f
+
+/// Half-width and half-height of an entity
+#define BENCH_HALF 0.5f
+
+/// Seed for all generated data, so runs are comparable
+#define BENCH_SEED 0x9e3779b97f4a7c15ull
+
+/// Number of clusters in the clustered distribution
+#define BENCH_CLUSTERS 32
+
+/// Times the build and clear workloads are repeated
+#define BENCH_REPEAT 10
+
+/// Frames the moving workload runs for
+#define BENCH_FRAMES 20
+
+/// Queries run per selectivity
+#define BENCH_QUERIES 10000
+
+/// Entity placed in the tree
+typedef struct bent {
+	float x, y;   ///< Center
+	float vx, vy; ///< Velocity per frame, for the moving workload
+	qhandle h;    ///< Handle, for workloads that insert by handle
+} bent;
+
+/// Latency samples for one workload
+typedef struct bsamples {
+	double *ns;   ///< Sample latencies in nanoseconds
+	uint32_t n;   ///< Number of samples
+	uint32_t cap; ///< Number of samples allocated
+} bsamples;
+
+static uint64_t rng = BENCH_SEED;
+
+/// xorshift64*; returns a float in [0, 1)
+static float
+brand(void) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (float)((rng * 0x2545f4914f6cdd1dull) >> 40) / (float)(1 << 24);
+}
+
+static double
+bnow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static long
+bpeak_kb(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+/// Forks a process for one workload; returns 1 in it, 0 once it has finished
+/*!
+  The workload must exit() when done. Output is flushed first, so
+  nothing buffered is printed twice.
+*/
+static int
+bchild(void) {
+	fflush(stdout);
+	pid_t p = fork();
+	if(p < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if(! p)
+		return 1;
+	waitpid(p, NULL, 0);
+	return 0;
+}
+
+static int
+bench_cmp(void *ptr, aabb *range) {
+	bent *e = ptr;
+	return aabb_contains(range, e->x, e->y);
+}
+
+static aabb
+bent_box(const bent *e) {
+	aabb b = { { e->x, e->y }, { BENCH_HALF, BENCH_HALF } };
+	return b;
+}
+
+static float
+bclamp(float v) {
+	if(v < BENCH_HALF)
+		return BENCH_HALF;
+	if(v > BENCH_WORLD - BENCH_HALF)
+		return BENCH_WORLD - BENCH_HALF;
+	return v;
+}
+
+/// Fills es with n entities spread by the named distribution
+static void
+bent_fill(bent *es, uint32_t n, const char *dist) {
+	float cx[BENCH_CLUSTERS], cy[BENCH_CLUSTERS];
+
+	rng = BENCH_SEED;
+	for(int i=0; i<BENCH_CLUSTERS; i++) {
+		cx[i] = brand()*BENCH_WORLD;
+		cy[i] = brand()*BENCH_WORLD;
+	}
+
+	for(uint32_t i=0; i<n; i++) {
+		if(! strcmp(dist, "clustered")) {
+			// Box-Muller, around a random cluster center
+			int c = (int)(brand()*BENCH_CLUSTERS);
+			float r = sqrtf(-2*logf(1 - brand())) * BENCH_WORLD/100;
+			float a = brand() * 6.2831853f;
+			es[i].x = bclamp(cx[c] + r*cosf(a));
+			es[i].y = bclamp(cy[c] + r*sinf(a));
+		} else {
+			es[i].x = bclamp(brand()*BENCH_WORLD);
+			es[i].y = bclamp(brand()*BENCH_WORLD);
+		}
+		es[i].vx = (brand() - 0.5f) * 20;
+		es[i].vy = (brand() - 0.5f) * 20;
+		es[i].h = 0;
+	}
+}
+
+static void
+bsamples_init(bsamples *s, uint32_t cap) {
+	s->ns = malloc(sizeof(double)*cap);
+	s->n = 0;
+	s->cap = cap;
+}
+
+static inline void
+bsamples_add(bsamples *s, double ns) {
+	if(s->n < s->cap)
+		s->ns[s->n++] = ns;
+}
+
+static int
+bsamples_cmp(const void *a, const void *b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/// Prints one result line; the samples are sorted and then discarded
+static void
+breport(const char *bench, const char *dist, uint32_t n, const char *unit,
+		uint64_t ops, double total_ns, bsamples *s) {
+	double p50 = 0, p99 = 0;
+
+	if(s->n) {
+		qsort(s->ns, s->n, sizeof(double), bsamples_cmp);
+		p50 = s->ns[s->n/2];
+		p99 = s->ns[(uint32_t)(s->n*0.99)];
+	}
+
+	printf("{\"bench\":\"%s\",\"dist\":\"%s\",\"n\":%u,\"unit\":\"%s\",\"ops\":%llu,"
+		   "\"ops_per_sec\":%.0f,\"p50_ns\":%.0f,\"p99_ns\":%.0f,\"peak_rss_kb\":%ld}\n",
+		   bench, dist, n, unit, (unsigned long long)ops,
+		   total_ns > 0 ? ops / (total_ns/1e9) : 0, p50, p99, bpeak_kb());
+	fflush(stdout);
+
+	s->n = 0;
+}
+
+static qtree
+bench_tree(void) {
+	return qtree_new(0, 0, BENCH_WORLD, BENCH_WORLD, bench_cmp);
+}
+
+/// Builds whole trees with qtree_insert_batch()
+static void
+bench_build(bent *es, uint32_t n, const char *dist, bsamples *s) {
+	void **ptrs = malloc(sizeof(void*)*n);
+	double total = 0;
+
+	for(uint32_t i=0; i<n; i++)
+		ptrs[i] = &es[i];
+
+	for(int r=0; r<BENCH_REPEAT; r++) {
+		qtree q = bench_tree();
+		double t = bnow();
+		qtree_insert_batch(q, ptrs, n);
+		t = bnow() - t;
+		total += t;
+		bsamples_add(s, t);
+		qtree_free(q);
+	}
+
+	breport("build", dist, n, "element", (uint64_t)n*BENCH_REPEAT, total, s);
+	free(ptrs);
+}
+
+/// Builds whole trees of boxes, with qtree_insert_aabb_batch() and one call at a time
+static void
+bench_build_aabb(bent *es, uint32_t n, const char *dist, bsamples *s) {
+	void **ptrs = malloc(sizeof(void*)*n);
+	aabb *bounds = malloc(sizeof(aabb)*n);
+	double total = 0;
+
+	for(uint32_t i=0; i<n; i++) {
+		ptrs[i] = &es[i];
+		bounds[i] = bent_box(&es[i]);
+	}
+
+	for(int r=0; r<BENCH_REPEAT; r++) {
+		qtree q = bench_tree();
+		double t = bnow();
+		for(uint32_t i=0; i<n; i++)
+			qtree_insert_aabb(q, ptrs[i], &bounds[i]);
+		t = bnow() - t;
+		total += t;
+		bsamples_add(s, t);
+		qtree_free(q);
+	}
+	breport("insert_aabb_loop", dist, n, "element", (uint64_t)n*BENCH_REPEAT, total, s);
+
+	total = 0;
+	for(int r=0; r<BENCH_REPEAT; r++) {
+		qtree q = bench_tree();
+		double t = bnow();
+		qtree_insert_aabb_batch(q, ptrs, bounds, n);
+		t = bnow() - t;
+		total += t;
+		bsamples_add(s, t);
+		qtree_free(q);
+	}
+	breport("build_aabb", dist, n, "element", (uint64_t)n*BENCH_REPEAT, total, s);
+
+	free(bounds);
+	free(ptrs);
+}
+
+/// Inserts one at a time, then runs range queries and removes everything
+static void
+bench_single(bent *es, uint32_t n, const char *dist, bsamples *s) {
+	static const float sel[] = { 0.0001f, 0.001f, 0.01f, 0.1f };
+	static const char *selname[] = { "query_0.01pct", "query_0.1pct",
+									 "query_1pct", "query_10pct" };
+	void **buf = malloc(sizeof(void*)*n);
+	uint32_t *order = malloc(sizeof(uint32_t)*n);
+	qtree q = bench_tree();
+	double total = 0;
+
+	for(uint32_t i=0; i<n; i++) {
+		double t = bnow();
+		qtree_insert(q, &es[i]);
+		t = bnow() - t;
+		total += t;
+		bsamples_add(s, t);
+	}
+	breport("insert", dist, n, "element", n, total, s);
+
+	for(int k=0; k<4; k++) {
+		float side = sqrtf(sel[k]) * BENCH_WORLD;
+		uint32_t nq = k == 3 ? BENCH_QUERIES/10 : BENCH_QUERIES;
+		uint64_t found = 0;
+
+		total = 0;
+		for(uint32_t i=0; i<nq; i++) {
+			float x = brand()*(BENCH_WORLD - side);
+			float y = brand()*(BENCH_WORLD - side);
+			uint32_t cnt;
+			double t = bnow();
+			qtree_findInAreaBuf(q, x, y, side, side, buf, n, &cnt);
+			t = bnow() - t;
+			total += t;
+			found += cnt;
+			bsamples_add(s, t);
+		}
+
+		// Keep the results live so the searches cannot be dropped
+		if(found == UINT64_MAX)
+			puts("");
+		breport(selname[k], dist, n, "query", nq, total, s);
+	}
+
+	// Remove in a shuffled order, not the order of insertion
+	for(uint32_t i=0; i<n; i++)
+		order[i] = i;
+	for(uint32_t i=n; i>1; i--) {
+		uint32_t j = (uint32_t)(brand()*i);
+		uint32_t t = order[i-1];
+		order[i-1] = order[j];
+		order[j] = t;
+	}
+
+	total = 0;
+	for(uint32_t i=0; i<n; i++) {
+		double t = bnow();
+		qtree_remove(q, &es[order[i]]);
+		t = bnow() - t;
+		total += t;
+		bsamples_add(s, t);
+	}
+	breport("remove", dist, n, "element", n, total, s);
+
+	qtree_free(q);
+	free(order);
+	free(buf);
+}
+
+/// Clears full trees
+static void
+bench_clear(bent *es, uint32_t n, const char *dist, bsamples *s) {
+	void **ptrs = malloc(sizeof(void*)*n);
+	qtree q = bench_tree();
+	double total = 0;
+
+	for(uint32_t i=0; i<n; i++)
+		ptrs[i] = &es[i];
+
+	for(int r=0; r<BENCH_REPEAT; r++) {
+		qtree_insert_batch(q, ptrs, n);
+		double t = bnow();
+		qtree_clear(q);
+		t = bnow() - t;
+		total += t;
+		bsamples_add(s, t);
+	}
+
+	breport("clear", dist, n, "tree", BENCH_REPEAT, total, s);
+	qtree_free(q);
+	free(ptrs);
+}
+
+/// Moves every entity each frame and updates it through its handle
+static void
+bench_moving(bent *es, uint32_t n, bsamples *s) {
+	qtree q = bench_tree();
+	double total = 0;
+
+	for(uint32_t i=0; i<n; i++) {
+		aabb b = bent_box(&es[i]);
+		es[i].h = qtree_insert_handle(q, &es[i], &b);
+	}
+
+	for(int f=0; f<BENCH_FRAMES; f++) {
+		for(uint32_t i=0; i<n; i++) {
+			bent *e = &es[i];
+			e->x += e->vx;
+			e->y += e->vy;
+			if(e->x != bclamp(e->x)) {
+				e->vx = -e->vx;
+				e->x = bclamp(e->x);
+			}
+			if(e->y != bclamp(e->y)) {
+				e->vy = -e->vy;
+				e->y = bclamp(e->y);
+			}
+
+			aabb b = bent_box(e);
+			double t = bnow();
+			qtree_update(q, e->h, &b);
+			t = bnow() - t;
+			total += t;
+			bsamples_add(s, t);
+		}
+	}
+
+	breport("update", "moving", n, "element", (uint64_t)n*BENCH_FRAMES, total, s);
+	qtree_free(q);
+}
+
+#if BENCH_THREADS
+static void*
+bmutex_new(void) {
+	pthread_mutex_t *m = malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(m, NULL);
+	return m;
+}
+
+static int
+bmutex_lock(void *m) {
+	return pthread_mutex_lock(m);
+}
+
+static int
+bmutex_unlock(void *m) {
+	return pthread_mutex_unlock(m);
+}
+
+static int
+bmutex_free(void *m) {
+	pthread_mutex_destroy(m);
+	free(m);
+	return 0;
+}
+
+/// One thread of the reader/writer mix
+typedef struct bthread {
+	pthread_t t;
+	qtree q;
+	bent *es;      ///< Entities this thread moves, if a writer
+	uint32_t n;    ///< Number of entities in es, or 0 for a reader
+	uint32_t ops;  ///< Operations to run
+	uint64_t seed; ///< Private random state
+	bsamples s;    ///< Latencies of this thread's operations
+} bthread;
+
+static float
+bthread_rand(bthread *b) {
+	b->seed ^= b->seed >> 12;
+	b->seed ^= b->seed << 25;
+	b->seed ^= b->seed >> 27;
+	return (float)((b->seed * 0x2545f4914f6cdd1dull) >> 40) / (float)(1 << 24);
+}
+
+static void*
+bthread_run(void *arg) {
+	bthread *b = arg;
+	float side = sqrtf(0.001f) * BENCH_WORLD;
+	void *buf[4096];
+
+	for(uint32_t i=0; i<b->ops; i++) {
+		double t;
+
+		if(b->n) {
+			// Only this writer touches e; the tree works from the bound
+			bent *e = &b->es[(uint32_t)(bthread_rand(b)*b->n)];
+			bent m = *e;
+			m.x = bclamp(m.x + (bthread_rand(b) - 0.5f)*20);
+			m.y = bclamp(m.y + (bthread_rand(b) - 0.5f)*20);
+			aabb bx = bent_box(&m);
+			t = bnow();
+			if(qtree_update(b->q, e->h, &bx))
+				*e = m;
+		} else {
+			float x = bthread_rand(b)*(BENCH_WORLD - side);
+			float y = bthread_rand(b)*(BENCH_WORLD - side);
+			uint32_t cnt;
+			t = bnow();
+			qtree_findInAreaBuf(b->q, x, y, side, side, buf, 4096, &cnt);
+		}
+
+		bsamples_add(&b->s, bnow() - t);
+	}
+
+	return NULL;
+}
+
+/// Runs readers and writers against one tree that has the mutex hooks set
+/*!
+  Every element goes in with a bound, so the tree has no compare
+  function that readers could call on an entity a writer is moving.
+  Each writer moves its own slice of es.
+*/
+static void
+bench_mix(bent *es, uint32_t n, int nr, int nw) {
+	bthread th[16];
+	bsamples all;
+	char name[32];
+	qtree q = qtree_new(0, 0, BENCH_WORLD, BENCH_WORLD, NULL);
+	uint32_t per = nw ? n/nw : 0;
+
+	qtree_set_mutex(q, (void*)bmutex_new, (void*)bmutex_lock,
+					(void*)bmutex_unlock, (void*)bmutex_free);
+
+	for(uint32_t i=0; i<n; i++) {
+		aabb b = bent_box(&es[i]);
+		es[i].h = qtree_insert_handle(q, &es[i], &b);
+	}
+
+	for(int i=0; i<nr+nw; i++) {
+		th[i].q = q;
+		th[i].es = i < nr ? NULL : es + (i-nr)*per;
+		th[i].n = i < nr ? 0 : per;
+		th[i].ops = i < nr ? BENCH_QUERIES : BENCH_QUERIES*10;
+		th[i].seed = BENCH_SEED + i;
+		bsamples_init(&th[i].s, th[i].ops);
+	}
+
+	double t = bnow();
+	for(int i=0; i<nr+nw; i++)
+		pthread_create(&th[i].t, NULL, bthread_run, &th[i]);
+	for(int i=0; i<nr+nw; i++)
+		pthread_join(th[i].t, NULL);
+	t = bnow() - t;
+
+	// Readers and writers report separately, over the same wall time
+	for(int w=0; w<2; w++) {
+		int from = w ? nr : 0, to = w ? nr+nw : nr;
+		uint64_t ops = 0;
+
+		if(from == to)
+			continue;
+
+		bsamples_init(&all, (uint32_t)(to-from)*th[from].ops);
+		for(int i=from; i<to; i++) {
+			memcpy(all.ns + all.n, th[i].s.ns, sizeof(double)*th[i].s.n);
+			all.n += th[i].s.n;
+			ops += th[i].ops;
+		}
+
+		snprintf(name, sizeof(name), "mix_r%d_w%d_%s", nr, nw, w ? "write" : "read");
+		breport(name, "uniform", n, w ? "element" : "query", ops, t, &all);
+		free(all.ns);
+	}
+
+	for(int i=0; i<nr+nw; i++)
+		free(th[i].s.ns);
+	qtree_free(q);
+}
+#endif
+
+int
+main(int argc, char **argv) {
+	static const char *dists[] = { "uniform", "clustered" };
+	uint32_t n = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) : 100000;
+	bent *es = malloc(sizeof(bent)*n);
+	bsamples s;
+
+	if(! n) {
+		fprintf(stderr, "usage: %s [entities]\n", argv[0]);
+		return 1;
+	}
+
+	// Room for the moving workload's samples, the most any workload takes;
+	// bsamples_add() drops the rest if that is more than a uint32_t counts
+	uint64_t ns = (uint64_t)n*BENCH_FRAMES;
+	if(ns < BENCH_QUERIES)
+		ns = BENCH_QUERIES;
+	bsamples_init(&s, ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns);
+
+	for(int d=0; d<2; d++) {
+		bent_fill(es, n, dists[d]);
+		if(bchild()) {
+			bench_build(es, n, dists[d], &s);
+			exit(0);
+		}
+		if(bchild()) {
+			bench_build_aabb(es, n, dists[d], &s);
+			exit(0);
+		}
+		if(bchild()) {
+			bench_single(es, n, dists[d], &s);
+			exit(0);
+		}
+		if(bchild()) {
+			bench_clear(es, n, dists[d], &s);
+			exit(0);
+		}
+	}
+
+	bent_fill(es, n, "moving");
+	if(bchild()) {
+		bench_moving(es, n, &s);
+		exit(0);
+	}
+
+#if BENCH_THREADS
+	static const int mix[][2] = { { 4, 0 }, { 4, 1 }, { 2, 2 } };
+	for(int i=0; i<3; i++) {
+		bent_fill(es, n, "uniform");
+		if(bchild()) {
+			bench_mix(es, n, mix[i][0], mix[i][1]);
+			exit(0);
+		}
+	}
+#endif
+
+	free(s.ns);
+	free(es);
+	return 0;
+}
@@ -0,0 +1,1659 @@
+/*
+  check.c
+  2014 JSK (kutani@projectkutani.com)
+
+  Consistency checks for the quadtree library. Part of the Panic Panic
+  project. Build and run with `make check`.
+
+  Each check puts random elements in a tree and compares what the
+  library returns with a brute-force pass over the same elements.
+  Checks that cover the whole tree run once in every mode listed in
+  main(). Coordinates sit on a grid of quarter units so the brute-force
+  tests are exact; only tests that need a division or a square root
+  allow a float-sized band.
+
+  Failures are reported on stderr, and the exit status is 1 if there
+  were any. `make check` builds with sanitizers; see config.mk.
+
+  Released to the public domain. See LICENSE for details.
+*/
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "quadtree.h"
+
+/// Lock backends as quadtree.c numbers them, so LOCK can be tested here
+#define QTREE_LOCK_NONE 0
+#define QTREE_LOCK_ATOMIC 1
+#define QTREE_LOCK_PTHREAD 2
+#define QTREE_LOCK_HOOKS 3
+
+/// Whether the library was built with tree locking, as quadtree.c decides it
+#if defined(NO_THREAD_SAFETY) || (defined(QTREE_LOCK) && QTREE_LOCK == QTREE_LOCK_NONE)
+ #define CHECK_THREADS 0
+#else
+ #define CHECK_THREADS 1
+ #include <pthread.h>
+ #include <stdatomic.h>
+#endif
+
+/// Number of elements each check uses
+#define CHECK_N 2000
+
+/// Width and height of the area elements are spread over
+#define CHECK_WORLD 256.0f
+
+/// Seed for all generated data, so failures can be reproduced
+#define CHECK_SEED 0x9e3779b97f4a7c15ull
+
+/// First root of autogrow trees, as qtree_new() arguments; its center and
+/// half-extents are not dyadic, so wrapping it rounds
+#define CHECK_GROWROOT 0.3f, 0.7f, 50.1f, 49.3f
+
+/// Queries of each kind run per round
+#define CHECK_QUERIES 40
+
+/// Band around an exact edge where a float test may go either way
+#define CHECK_EPS 1e-3f
+
+/// Failures reported in full before the rest are only counted
+#define CHECK_REPORTS 20
+
+/// Writer operations in the concurrent check
+#define CHECK_RACEOPS 20000
+
+/// Elements churned in and out of the tree in the collapse check; at most 64
+#define CHECK_CHURN 32
+
+/// Expected outcomes of a search for one element
+enum { CNOT = 0, CMUST = 1, CMAY = 2 };
+
+/// Element placed in the trees
+typedef struct cobj {
+	aabb b;          ///< Bound, or position with zero size if not bounded
+	qhandle h;       ///< Handle, if inserted with one
+	uint8_t in;      ///< Currently in the tree
+	uint8_t bounded; ///< Inserted with its bound, rather than through the compare function
+} cobj;
+
+/// A tree mode to run the checks in
+typedef struct cmode {
+	const char *name;
+	int cmp;      ///< Give the tree a compare function and insert some elements through it
+	float loose;  ///< Looseness; 1 for none
+	int deferred; ///< Deferred maintenance
+	int snapshot; ///< Snapshot reads
+	int flat;     ///< Limit the depth so leaves hold many elements
+	int autogrow; ///< Start with a small root and let it grow
+} cmode;
+
+static cobj O[CHECK_N];
+static void *Optr[CHECK_N];
+static uint8_t want[CHECK_N];
+static uint32_t seen[CHECK_N];
+static const char *where = "";
+static uint32_t fails;
+static uint64_t rng = CHECK_SEED;
+
+/// xorshift64*; returns a float in [0, 1)
+static float
+crand(void) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (float)((rng * 0x2545f4914f6cdd1dull) >> 40) / (float)(1 << 24);
+}
+
+/// Returns a random multiple of 1/4 in [0, max)
+static float
+cgrid(float max) {
+	return floorf(crand()*max*4) / 4;
+}
+
+/// Returns a random index below n
+static uint32_t
+cpick(uint32_t n) {
+	return (uint32_t)(crand()*n) % n;
+}
+
+static void
+cfail(const char *what) {
+	if(fails++ < CHECK_REPORTS)
+		fprintf(stderr, "check: %s: %s failed\n", where, what);
+}
+
+static void
+cexpect(int ok, const char *what) {
+	if(! ok)
+		cfail(what);
+}
+
+/// Returns the index of element p, or -1 if p is not an element
+static int
+cid(const void *p) {
+	const cobj *o = p;
+	if(o < O || o >= O + CHECK_N || (const char*)p != (const char*)&O[o - O])
+		return -1;
+	return (int)(o - O);
+}
+
+static float cx0(const cobj *o) { return o->b.center.x - o->b.dims.w; }
+static float cy0(const cobj *o) { return o->b.center.y - o->b.dims.h; }
+static float cx1(const cobj *o) { return o->b.center.x + o->b.dims.w; }
+static float cy1(const cobj *o) { return o->b.center.y + o->b.dims.h; }
+
+/// Compare function: elements are tested by their box, points included
+static int
+ccmp(void *ptr, aabb *range) {
+	return aabb_intersects(&((cobj*)ptr)->b, range);
+}
+
+/// Distance from x,y to the element's box
+static float
+cdist(void *ptr, float x, float y) {
+	const cobj *o = ptr;
+	float dx = fmaxf(fmaxf(cx0(o) - x, x - cx1(o)), 0);
+	float dy = fmaxf(fmaxf(cy0(o) - y, y - cy1(o)), 0);
+	return sqrtf(dx*dx + dy*dy);
+}
+
+/// Checks a result list against want; each element must appear at most once
+static void
+cresult(void **l, uint32_t cnt, const char *what) {
+	int bad = 0;
+
+	memset(seen, 0, sizeof(seen));
+	for(uint32_t i=0; i<cnt; i++) {
+		int id = cid(l[i]);
+		if(id < 0 || ! O[id].in || want[id] == CNOT || seen[id]++)
+			bad = 1;
+	}
+	for(uint32_t i=0; i<CHECK_N; i++)
+		if(want[i] == CMUST && ! seen[i])
+			bad = 1;
+
+	cexpect(! bad, what);
+}
+
+/// Checks that two result lists hold the same elements in the same order
+static void
+csame(void **a, uint32_t na, void **b, uint32_t nb, const char *what) {
+	cexpect(na == nb && (! na || ! memcmp(a, b, sizeof(void*)*na)), what);
+}
+
+/// Sets want for the rectangle x,y + w,h
+static void
+cwant_rect(float x, float y, float w, float h) {
+	for(uint32_t i=0; i<CHECK_N; i++) {
+		const cobj *o = &O[i];
+		want[i] = o->in && cx0(o) <= x+w && cx1(o) >= x && cy0(o) <= y+h && cy1(o) >= y;
+	}
+}
+
+/// Sets want for the circle of radius r around x,y
+static void
+cwant_circle(float x, float y, float r) {
+	for(uint32_t i=0; i<CHECK_N; i++) {
+		const cobj *o = &O[i];
+		float dx = fmaxf(fmaxf(cx0(o) - x, x - cx1(o)), 0);
+		float dy = fmaxf(fmaxf(cy0(o) - y, y - cy1(o)), 0);
+
+		if(! o->in) {
+			want[i] = CNOT;
+		} else if(dx*dx + dy*dy <= r*r) {
+			want[i] = CMUST;
+		} else if(! o->bounded && fabsf(o->b.center.x - x) <= r &&
+				  fabsf(o->b.center.y - y) <= r) {
+			// Only tested against the circle's box
+			want[i] = CMAY;
+		} else {
+			want[i] = CNOT;
+		}
+	}
+}
+
+/// Returns the largest gap between o's box and the convex polygon xy along their edge normals
+static float
+cpoly_gap(const cobj *o, const float *xy, uint32_t n) {
+	float x0 = cx0(o), y0 = cy0(o), x1 = cx1(o), y1 = cy1(o);
+	float px0 = INFINITY, py0 = INFINITY, px1 = -INFINITY, py1 = -INFINITY;
+	float area = 0;
+
+	for(uint32_t i=0; i<n; i++) {
+		uint32_t j = (i+1) % n;
+		px0 = fminf(px0, xy[2*i]);
+		px1 = fmaxf(px1, xy[2*i]);
+		py0 = fminf(py0, xy[2*i+1]);
+		py1 = fmaxf(py1, xy[2*i+1]);
+		area += xy[2*i]*xy[2*j+1] - xy[2*j]*xy[2*i+1];
+	}
+
+	float gap = fmaxf(fmaxf(px0 - x1, x0 - px1), fmaxf(py0 - y1, y0 - py1));
+	float cx[4] = { x0, x1, x1, x0 }, cy[4] = { y0, y0, y1, y1 };
+
+	for(uint32_t i=0; i<n; i++) {
+		uint32_t j = (i+1) % n;
+		float nx = xy[2*j+1] - xy[2*i+1], ny = xy[2*i] - xy[2*j];
+		float len = sqrtf(nx*nx + ny*ny);
+		if(area < 0)
+			len = -len;
+		nx /= len;
+		ny /= len;
+
+		// nx,ny points out of the polygon; the box is past the edge
+		// by as much as its nearest corner is
+		float g = INFINITY;
+		for(int k=0; k<4; k++)
+			g = fminf(g, nx*(cx[k] - xy[2*i]) + ny*(cy[k] - xy[2*i+1]));
+		gap = fmaxf(gap, g);
+	}
+
+	return gap;
+}
+
+/// Sets want for the convex polygon xy of n vertices
+static void
+cwant_poly(const float *xy, uint32_t n) {
+	float px0 = INFINITY, py0 = INFINITY, px1 = -INFINITY, py1 = -INFINITY;
+
+	for(uint32_t i=0; i<n; i++) {
+		px0 = fminf(px0, xy[2*i]);
+		px1 = fmaxf(px1, xy[2*i]);
+		py0 = fminf(py0, xy[2*i+1]);
+		py1 = fmaxf(py1, xy[2*i+1]);
+	}
+
+	for(uint32_t i=0; i<CHECK_N; i++) {
+		const cobj *o = &O[i];
+		float g = cpoly_gap(o, xy, n);
+
+		if(! o->in)
+			want[i] = CNOT;
+		else if(g < -CHECK_EPS)
+			want[i] = CMUST;
+		else if(g <= CHECK_EPS)
+			want[i] = CMAY;
+		else if(! o->bounded && o->b.center.x >= px0 && o->b.center.x <= px1 &&
+				o->b.center.y >= py0 && o->b.center.y <= py1)
+			want[i] = CMAY;
+		else
+			want[i] = CNOT;
+	}
+}
+
+/// Returns where the segment x0,y0 to x1,y1 enters o's box, or INFINITY if it misses by more than CHECK_EPS
+static float
+cseg_enter(const cobj *o, float x0, float y0, float x1, float y1, float *exit) {
+	float t0 = 0, t1 = 1;
+	float dx = x1 - x0, dy = y1 - y0;
+
+	if(dx) {
+		float a = (cx0(o) - x0)/dx, b = (cx1(o) - x0)/dx;
+		t0 = fmaxf(t0, fminf(a, b));
+		t1 = fminf(t1, fmaxf(a, b));
+	} else if(x0 < cx0(o) || x0 > cx1(o)) {
+		t0 = INFINITY;
+	}
+	if(dy) {
+		float a = (cy0(o) - y0)/dy, b = (cy1(o) - y0)/dy;
+		t0 = fmaxf(t0, fminf(a, b));
+		t1 = fminf(t1, fmaxf(a, b));
+	} else if(y0 < cy0(o) || y0 > cy1(o)) {
+		t0 = INFINITY;
+	}
+
+	*exit = t1;
+	return t0;
+}
+
+/// Sets want for the segment x0,y0 to x1,y1
+static void
+cwant_seg(float x0, float y0, float x1, float y1) {
+	for(uint32_t i=0; i<CHECK_N; i++) {
+		const cobj *o = &O[i];
+		float t1, t0 = cseg_enter(o, x0, y0, x1, y1, &t1);
+
+		if(! o->in)
+			want[i] = CNOT;
+		else if(! o->bounded)
+			want[i] = o->b.center.x >= fminf(x0, x1) && o->b.center.x <= fmaxf(x0, x1) &&
+					  o->b.center.y >= fminf(y0, y1) && o->b.center.y <= fmaxf(y0, y1) ?
+					  CMAY : CNOT;
+		else if(t0 < t1 - CHECK_EPS)
+			want[i] = CMUST;
+		else if(t0 <= t1 + CHECK_EPS)
+			want[i] = CMAY;
+		else
+			want[i] = CNOT;
+	}
+}
+
+/// Visitor that collects into a result list
+typedef struct cvisit {
+	void **l;       ///< Elements visited
+	uint32_t n;     ///< Number of elements visited
+	uint32_t stop;  ///< Stop after this many; 0 for never
+	float x0, y0;   ///< Segment start, for segment order checks
+	float x1, y1;   ///< Segment end
+	float last;     ///< Entry point of the last bounded element on the segment
+	int order;      ///< Set if the segment order was broken
+} cvisit;
+
+static int
+cvisit_fn(void *ptr, void *userdata) {
+	cvisit *v = userdata;
+	v->l[v->n++] = ptr;
+	return v->stop && v->n >= v->stop;
+}
+
+/// Segment visitor; bounded elements must come by entry point
+static int
+cvisit_seg(void *ptr, void *userdata) {
+	cvisit *v = userdata;
+	int id = cid(ptr);
+
+	// Unbounded elements come when their node is entered, and are not ordered
+	if(id >= 0 && O[id].bounded) {
+		float t1, t0 = fmaxf(cseg_enter(&O[id], v->x0, v->y0, v->x1, v->y1, &t1), 0);
+		if(t0 < v->last - CHECK_EPS)
+			v->order = 1;
+		v->last = fmaxf(v->last, t0);
+	}
+	return cvisit_fn(ptr, userdata);
+}
+
+/// Sorts floats ascending
+static int
+cfloat_cmp(const void *a, const void *b) {
+	float x = *(const float*)a, y = *(const float*)b;
+	return (x > y) - (x < y);
+}
+
+#if CHECK_THREADS
+/// Task started by the task hook
+typedef struct ctask {
+	void (*fn)(void *arg);
+	void *arg;
+} ctask;
+
+static void*
+ctask_run(void *arg) {
+	ctask t = *(ctask*)arg;
+	free(arg);
+	t.fn(t.arg);
+	return NULL;
+}
+
+/// Task hook that starts each task on a thread of its own
+static void
+ctask_start(void (*fn)(void *arg), void *arg, void *userdata) {
+	(void)userdata;
+	pthread_t t;
+	ctask *c = malloc(sizeof(ctask));
+	c->fn = fn;
+	c->arg = arg;
+	pthread_create(&t, NULL, ctask_run, c);
+	pthread_detach(t);
+}
+#endif
+
+/// Pair matrix for qtree_findAllPairs(), which may report from several threads
+#if CHECK_THREADS
+static atomic_uchar *pairs;
+ #define CPAIR_ADD(I) atomic_fetch_add(&pairs[I], 1)
+#else
+static uint8_t *pairs;
+ #define CPAIR_ADD(I) (pairs[I]++)
+#endif
+
+static void
+cpair_fn(void *a, void *b, void *userdata) {
+	(void)userdata;
+	int i = cid(a), j = cid(b);
+	if(i < 0 || j < 0 || i == j) {
+		pairs[0] = 2;
+		return;
+	}
+	if(i > j) {
+		int t = i;
+		i = j;
+		j = t;
+	}
+	CPAIR_ADD((size_t)i*CHECK_N + j);
+}
+
+/// Checks qtree_findAllPairs() against every pair of bounded elements
+static void
+check_pairs(qtree q) {
+	size_t nn = (size_t)CHECK_N*CHECK_N;
+	pairs = calloc(nn, 1);
+
+	uint32_t found = qtree_findAllPairs(q, cpair_fn, NULL), exp = 0;
+	int bad = pairs[0] > 1;
+
+	for(uint32_t i=0; i<CHECK_N && ! bad; i++) {
+		const cobj *a = &O[i];
+		for(uint32_t j=i+1; j<CHECK_N; j++) {
+			const cobj *b = &O[j];
+			int e = a->in && b->in && a->bounded && b->bounded &&
+				cx0(a) <= cx1(b) && cx0(b) <= cx1(a) && cy0(a) <= cy1(b) && cy0(b) <= cy1(a);
+			exp += e;
+			if(pairs[(size_t)i*CHECK_N + j] != e)
+				bad = 1;
+		}
+	}
+
+	cexpect(! bad && found == exp, "qtree_findAllPairs");
+	free((void*)pairs);
+}
+
+/// Checks qtree_findNearest() against a sort of every element's distance
+static void
+check_nearest(qtree q, int cmp) {
+	float *d = malloc(sizeof(float)*CHECK_N);
+	void *out[16];
+
+	for(int t=0; t<CHECK_QUERIES; t++) {
+		float x = cgrid(CHECK_WORLD), y = cgrid(CHECK_WORLD);
+		uint32_t k = 1 + cpick(16), nd = 0, lo = 0, hi = 0;
+		float maxdist = t % 3 ? INFINITY : cgrid(40);
+		int bad = 0;
+
+		for(uint32_t i=0; i<CHECK_N; i++)
+			if(O[i].in)
+				d[nd++] = cdist(&O[i], x, y);
+		qsort(d, nd, sizeof(float), cfloat_cmp);
+		while(lo < nd && d[lo] <= maxdist - CHECK_EPS)
+			lo++;
+		while(hi < nd && d[hi] <= maxdist + CHECK_EPS)
+			hi++;
+
+		// Unbounded elements are at distance 0 without a distance function
+		uint32_t n = qtree_findNearest(q, x, y, k, maxdist, out, cmp || t % 2 ? cdist : NULL);
+		if(n < (lo < k ? lo : k) || n > (hi < k ? hi : k))
+			bad = 1;
+
+		memset(seen, 0, sizeof(seen));
+		for(uint32_t i=0; i<n && ! bad; i++) {
+			int id = cid(out[i]);
+			if(id < 0 || ! O[id].in || seen[id]++ ||
+			   fabsf(cdist(out[i], x, y) - d[i]) > CHECK_EPS)
+				bad = 1;
+		}
+
+		cexpect(! bad, "qtree_findNearest");
+	}
+
+	free(d);
+}
+
+/// Checks every query against brute force on the tree's current contents
+static void
+check_queries(qtree q, const cmode *m) {
+	void **buf = malloc(sizeof(void*)*CHECK_N);
+	cvisit v = { buf, 0, 0, 0, 0, 0, 0, 0, 0 };
+	qquery c = qquery_new();
+	qpack p = qtree_pack(q);
+	uint32_t cnt, n;
+
+	for(int t=0; t<CHECK_QUERIES; t++) {
+		float x = cgrid(CHECK_WORLD) - 16, y = cgrid(CHECK_WORLD) - 16;
+		float w = cgrid(t % 4 ? 40 : 200), h = cgrid(t % 4 ? 40 : 200);
+		cwant_rect(x, y, w, h);
+
+		void **l = qtree_findInArea(q, x, y, w, h, &cnt);
+		cresult(l, cnt, "qtree_findInArea");
+
+		uint32_t cap = cnt/2 ? cnt/2 : 1, bcnt;
+		int over = qtree_findInAreaBuf(q, x, y, w, h, buf, cap, &bcnt);
+		csame(buf, bcnt < cap ? bcnt : cap, l, cnt < cap ? cnt : cap, "qtree_findInAreaBuf");
+		cexpect(bcnt == cnt && over == (cnt > cap), "qtree_findInAreaBuf count");
+
+		v.n = 0;
+		v.stop = 0;
+		n = qtree_visitInArea(q, x, y, w, h, cvisit_fn, &v);
+		cexpect(n == v.n, "qtree_visitInArea count");
+		cresult(buf, v.n, "qtree_visitInArea");
+		v.n = 0;
+		v.stop = 1;
+		n = qtree_visitInArea(q, x, y, w, h, cvisit_fn, &v);
+		cexpect(n == (cnt ? 1u : 0u) && v.n == n, "qtree_visitInArea stop");
+
+		cexpect(qtree_countInArea(q, x, y, w, h) == cnt, "qtree_countInArea");
+		cexpect(qtree_anyInArea(q, x, y, w, h) == (cnt > 0), "qtree_anyInArea");
+
+		uint32_t ccnt;
+		void **cl = qtree_findInAreaCtx(q, c, x, y, w, h, &ccnt);
+		csame(cl, ccnt, l, cnt, "qtree_findInAreaCtx");
+
+		uint32_t pcnt;
+		void **pl = qtree_findInAreaPar(q, x, y, w, h, &pcnt);
+		csame(pl, pcnt, l, cnt, "qtree_findInAreaPar");
+		free(pl);
+
+		pl = qpack_findInArea(p, x, y, w, h, &pcnt);
+		cresult(pl, pcnt, "qpack_findInArea");
+		free(pl);
+
+		free(l);
+	}
+
+	// Each box of a batch gives what its own search gives, in the same order
+	aabb boxes[8];
+	uint32_t off[9];
+	for(int i=0; i<8; i++) {
+		boxes[i].center.x = cgrid(CHECK_WORLD);
+		boxes[i].center.y = cgrid(CHECK_WORLD);
+		boxes[i].dims.w = cgrid(i % 3 ? 20 : 100);
+		boxes[i].dims.h = cgrid(i % 3 ? 20 : 100);
+	}
+	void **bl = qtree_findInAreaBatch(q, boxes, 8, off);
+	for(int i=0; i<8; i++) {
+		const aabb *b = &boxes[i];
+		void **l = qtree_findInArea(q, b->center.x - b->dims.w, b->center.y - b->dims.h,
+									b->dims.w*2, b->dims.h*2, &cnt);
+		csame(bl ? bl + off[i] : NULL, off[i+1] - off[i], l, cnt, "qtree_findInAreaBatch");
+		free(l);
+	}
+	free(bl);
+
+	for(int t=0; t<CHECK_QUERIES; t++) {
+		float x = cgrid(CHECK_WORLD), y = cgrid(CHECK_WORLD), r = cgrid(t % 4 ? 30 : 120);
+		cwant_circle(x, y, r);
+
+		void **l = qtree_findInRadius(q, x, y, r, &cnt);
+		cresult(l, cnt, "qtree_findInRadius");
+		free(l);
+
+		uint32_t bcnt;
+		int over = qtree_findInRadiusBuf(q, x, y, r, buf, 4, &bcnt);
+		cexpect(bcnt == cnt && over == (cnt > 4), "qtree_findInRadiusBuf");
+
+		v.n = 0;
+		v.stop = 0;
+		n = qtree_visitInRadius(q, x, y, r, cvisit_fn, &v);
+		cexpect(n == cnt, "qtree_visitInRadius count");
+		cresult(buf, v.n, "qtree_visitInRadius");
+	}
+
+	for(int t=0; t<CHECK_QUERIES; t++) {
+		float xy[16];
+		float cx = cgrid(CHECK_WORLD), cy = cgrid(CHECK_WORLD), r = 5 + cgrid(t % 4 ? 30 : 100);
+		float ph = crand()*6.2831853f, dir = t & 1 ? 1 : -1;
+		uint32_t nv = 3 + cpick(6);
+		for(uint32_t i=0; i<nv; i++) {
+			float a = ph + dir*i*6.2831853f/nv;
+			xy[2*i] = cx + r*cosf(a);
+			xy[2*i+1] = cy + r*sinf(a);
+		}
+		cwant_poly(xy, nv);
+
+		void **l = qtree_findInPolygon(q, xy, nv, &cnt);
+		cresult(l, cnt, "qtree_findInPolygon");
+		free(l);
+
+		uint32_t bcnt;
+		int over = qtree_findInPolygonBuf(q, xy, nv, buf, 4, &bcnt);
+		cexpect(bcnt == cnt && over == (cnt > 4), "qtree_findInPolygonBuf");
+
+		v.n = 0;
+		v.stop = 0;
+		n = qtree_visitInPolygon(q, xy, nv, cvisit_fn, &v);
+		cexpect(n == cnt, "qtree_visitInPolygon count");
+		cresult(buf, v.n, "qtree_visitInPolygon");
+	}
+
+	for(int t=0; t<CHECK_QUERIES; t++) {
+		v.x0 = cgrid(CHECK_WORLD);
+		v.y0 = cgrid(CHECK_WORLD);
+		v.x1 = t % 5 ? cgrid(CHECK_WORLD) : v.x0;
+		v.y1 = t % 7 ? cgrid(CHECK_WORLD) : v.y0 + 30;
+		v.last = -INFINITY;
+		v.order = 0;
+		v.n = 0;
+		v.stop = 0;
+		cwant_seg(v.x0, v.y0, v.x1, v.y1);
+
+		n = qtree_visitOnSegment(q, v.x0, v.y0, v.x1, v.y1, cvisit_seg, &v);
+		cexpect(n == v.n && ! v.order, "qtree_visitOnSegment order");
+		cresult(buf, v.n, "qtree_visitOnSegment");
+
+		uint32_t bcnt;
+		void *sb[4];
+		int over = qtree_findOnSegmentBuf(q, v.x0, v.y0, v.x1, v.y1, sb, 4, &bcnt);
+		cexpect(bcnt == v.n && over == (v.n > 4), "qtree_findOnSegmentBuf");
+		cexpect(! memcmp(sb, buf, sizeof(void*)*(v.n < 4 ? v.n : 4)),
+				"qtree_findOnSegmentBuf order");
+	}
+
+	check_nearest(q, m->cmp);
+	check_pairs(q);
+
+	// Every element is held exactly once
+	qtree_stats s;
+	uint32_t in = 0;
+	for(uint32_t i=0; i<CHECK_N; i++)
+		in += O[i].in;
+	qtree_get_stats(q, &s);
+	cexpect(s.leafelems + s.innerelems == in, "qtree_get_stats element count");
+
+	qpack_free(p);
+	qquery_free(c);
+	free(buf);
+}
+
+/// Returns the id qtree_save() stores for an element: its index in O
+static uint32_t
+cobj_id(void *ptr, void *userdata) {
+	(void)userdata;
+	return (uint32_t)cid(ptr);
+}
+
+/// Writes q to a new temporary file; returns its path, or NULL on failure
+static char*
+csave(qtree q, char *path) {
+	strcpy(path, "/tmp/qtcheckXXXXXX");
+	int fd = mkstemp(path);
+	if(fd < 0)
+		return NULL;
+	close(fd);
+
+	if(! qtree_save(q, path, cobj_id, NULL)) {
+		unlink(path);
+		return NULL;
+	}
+	return path;
+}
+
+/// Checks rectangle searches of packed trees p against want
+static void
+check_packed(qpack p, const char *what) {
+	for(int t=0; t<CHECK_QUERIES; t++) {
+		float x = cgrid(CHECK_WORLD) - 16, y = cgrid(CHECK_WORLD) - 16;
+		float w = cgrid(t % 4 ? 40 : 200), h = cgrid(t % 4 ? 40 : 200);
+		uint32_t cnt;
+
+		cwant_rect(x, y, w, h);
+		void **l = qpack_findInArea(p, x, y, w, h, &cnt);
+		cresult(l, cnt, what);
+		free(l);
+	}
+}
+
+/// Saves q to a file and maps it back with compare function fnc; returns NULL on failure
+static qpack
+cmap(qtree q, qtree_fnc fnc) {
+	char buf[32], *path = csave(q, buf);
+	cexpect(path != NULL, "qtree_save");
+	if(! path)
+		return NULL;
+
+	qpack p = qtree_mmap(path, Optr, fnc);
+	unlink(path);
+	cexpect(p != NULL, "qtree_mmap");
+	return p;
+}
+
+/// Checks a packed copy of q, and one saved to a file and mapped back
+static void
+check_saved(qtree q, const cmode *m) {
+	qpack p = qtree_pack(q);
+	check_packed(p, "qtree_pack");
+	qpack_free(p);
+
+	p = cmap(q, m->cmp ? ccmp : NULL);
+	if(p) {
+		check_packed(p, "qtree_mmap");
+		qpack_free(p);
+	}
+}
+
+/// Gives o a new random box, or a random point if point is set
+static void
+cobj_place(cobj *o, int point) {
+	int big = cpick(50) == 0;
+	o->b.center.x = cgrid(CHECK_WORLD);
+	o->b.center.y = cgrid(CHECK_WORLD);
+	o->b.dims.w = point ? 0 : cgrid(big ? 40 : 8);
+	o->b.dims.h = point ? 0 : cgrid(big ? 40 : 8);
+}
+
+/// Inserts element i by whichever path it is meant to use
+static void
+cobj_insert(qtree q, const cmode *m, uint32_t i) {
+	cobj *o = &O[i];
+
+	o->h = 0;
+	o->bounded = ! (m->cmp && i % 4 == 0);
+	cobj_place(o, ! o->bounded);
+
+	if(! o->bounded) {
+		o->in = qtree_insert(q, o);
+	} else if(i % 3 == 0) {
+		o->in = qtree_insert_aabb(q, o, &o->b);
+	} else {
+		o->h = qtree_insert_handle(q, o, &o->b);
+		o->in = o->h != 0;
+	}
+}
+
+/// Checks if b fits the tree's bound as qtree_update() must test it
+static int
+cfits(const cmode *m, const aabb *b) {
+	float half = CHECK_WORLD/2 * m->loose;
+	return fabsf(b->center.x - CHECK_WORLD/2) + b->dims.w <= half &&
+		   fabsf(b->center.y - CHECK_WORLD/2) + b->dims.h <= half;
+}
+
+/// Moves, removes and reinserts elements at random
+static void
+check_mutate(qtree q, const cmode *m, uint32_t ops) {
+	for(uint32_t r=0; r<ops; r++) {
+		uint32_t i = cpick(CHECK_N);
+		cobj *o = &O[i];
+
+		if(! o->in) {
+			cobj_insert(q, m, i);
+		} else if(o->h && r % 3) {
+			cobj old = *o;
+			cobj_place(o, 0);
+			int ok = qtree_update(q, o->h, &o->b);
+			cexpect(m->autogrow ? ok : ok == cfits(m, &o->b), "qtree_update result");
+			if(! ok)
+				*o = old;
+		} else if(o->h) {
+			cexpect(qtree_remove_handle(q, o->h) == 1, "qtree_remove_handle");
+			cexpect(qtree_remove_handle(q, o->h) == 0, "qtree_remove_handle twice");
+			cexpect(qtree_update(q, o->h, &o->b) == 0, "qtree_update removed");
+			o->in = 0;
+			o->h = 0;
+		} else {
+			qtree_remove(q, o);
+			o->in = 0;
+		}
+
+		if(m->deferred && r % 997 == 0)
+			qtree_maintain(q, r % 2 ? 0 : 1);
+	}
+
+	cexpect(qtree_remove_handle(q, 0) == 0 && qtree_update(q, 0, &O[0].b) == 0,
+			"zero handle");
+	cexpect(qtree_remove_handle(q, CHECK_N*4) == 0, "out of range handle");
+}
+
+static qtree
+ctree_new(const cmode *m) {
+	// Halving the grown root's bound does not give this one back exactly
+	qtree q = m->autogrow ? qtree_new(CHECK_GROWROOT, m->cmp ? ccmp : NULL) :
+		qtree_new(0, 0, CHECK_WORLD, CHECK_WORLD, m->cmp ? ccmp : NULL);
+
+	qtree_setMaxNodeCnt(q, 6);
+	if(m->loose > 1)
+		qtree_set_loose(q, m->loose);
+	if(m->flat)
+		qtree_set_limits(q, 2, 0);
+	if(m->autogrow)
+		qtree_set_autogrow(q, 1);
+	if(m->snapshot)
+		qtree_set_snapshot(q, 1);
+	if(m->deferred)
+		qtree_set_deferred(q, 1);
+#if CHECK_THREADS
+	qtree_set_tasks(q, ctask_start, NULL, 3);
+#endif
+	return q;
+}
+
+/// Checks that a loose tree's shape does not depend on the order of inserts
+/*!
+  The same elements go into two loose trees, forwards into one and
+  backwards into the other, and the shape qtree_get_stats() reports
+  must match: every element sits in the node its center and size pick.
+*/
+static void
+check_loose_order(void) {
+	static const cmode m = { "loose order", 0, 2, 0, 0, 0, 0 };
+	qtree a = ctree_new(&m), b = ctree_new(&m);
+	qtree_stats sa, sb;
+
+	where = m.name;
+	for(uint32_t i=0; i<CHECK_N; i++)
+		cobj_place(&O[i], cpick(3) == 0);
+	for(uint32_t i=0; i<CHECK_N; i++) {
+		qtree_insert_aabb(a, &O[i], &O[i].b);
+		qtree_insert_aabb(b, &O[CHECK_N-1-i], &O[CHECK_N-1-i].b);
+	}
+
+	qtree_get_stats(a, &sa);
+	qtree_get_stats(b, &sb);
+	cexpect(! memcmp(&sa, &sb, offsetof(qtree_stats, allocs)), "loose shape after inserts");
+
+	// Removing half and putting it back must give the same shape again
+	for(uint32_t i=0; i<CHECK_N; i+=2)
+		qtree_remove(a, &O[i]);
+	for(uint32_t i=0; i<CHECK_N; i+=2)
+		qtree_insert_aabb(a, &O[i], &O[i].b);
+	qtree_get_stats(a, &sa);
+	cexpect(! memcmp(&sa, &sb, offsetof(qtree_stats, allocs)), "loose shape after reinserts");
+
+	for(uint32_t i=0; i<CHECK_N; i++)
+		O[i].in = 0;
+	qtree_free(a);
+	qtree_free(b);
+}
+
+/// Checks searches right on the first root's edges once autogrow has wrapped it
+/*!
+  Elements sit on the corners and edge midpoints of the first root, and
+  each is searched for with a zero-sized box on it, so a node bound off
+  by a rounding error is enough to lose one.
+*/
+static void
+check_grown(void) {
+	static const cmode m = { "grown", 0, 1, 0, 0, 0, 1 };
+	static const float root[4] = { CHECK_GROWROOT };
+	static const float ex[8] = { -1, 1, -1, 1, 0, 0, -1, 1 };
+	static const float ey[8] = { -1, -1, 1, 1, -1, 1, 0, 0 };
+	float hw = root[2]/2, hh = root[3]/2;
+	float cx = root[0] + hw, cy = root[1] + hh;
+
+	where = m.name;
+	qtree q = ctree_new(&m);
+
+	for(uint32_t i=0; i<CHECK_N; i++)
+		O[i].in = 0;
+	for(uint32_t i=0; i<8; i++) {
+		cobj *o = &O[i];
+		o->b.center.x = cx + ex[i]*hw;
+		o->b.center.y = cy + ey[i]*hh;
+		o->b.dims.w = o->b.dims.h = 0;
+		o->h = 0;
+		o->bounded = 1;
+		o->in = qtree_insert_aabb(q, o, &o->b);
+		cexpect(o->in, "qtree_insert_aabb on the root edge");
+	}
+	for(uint32_t i=8; i<CHECK_N; i++)
+		cobj_insert(q, &m, i);
+
+	qpack p = qtree_pack(q), f = cmap(q, NULL);
+	for(uint32_t i=0; i<8; i++) {
+		float x = O[i].b.center.x, y = O[i].b.center.y;
+		uint32_t cnt;
+		void **l;
+
+		cwant_rect(x, y, 0, 0);
+		l = qtree_findInArea(q, x, y, 0, 0, &cnt);
+		cresult(l, cnt, "qtree_findInArea on the root edge");
+		free(l);
+		l = qpack_findInArea(p, x, y, 0, 0, &cnt);
+		cresult(l, cnt, "qtree_pack on the root edge");
+		free(l);
+		if(f) {
+			l = qpack_findInArea(f, x, y, 0, 0, &cnt);
+			cresult(l, cnt, "qtree_mmap on the root edge");
+			free(l);
+		}
+	}
+
+	qpack_free(p);
+	if(f)
+		qpack_free(f);
+	check_saved(q, &m);
+	qtree_free(q);
+}
+
+/// Writes len bytes of data to a new temporary file; returns its path, or NULL on failure
+static char*
+cwrite(const void *data, size_t len, char *path) {
+	strcpy(path, "/tmp/qtcheckXXXXXX");
+	int fd = mkstemp(path);
+	if(fd < 0)
+		return NULL;
+
+	int ok = write(fd, data, len) == (ssize_t)len;
+	if(close(fd) || ! ok) {
+		unlink(path);
+		return NULL;
+	}
+	return path;
+}
+
+/// Checks that qtree_mmap() refuses len bytes of data
+static void
+cmap_bad(const void *data, size_t len, const char *what) {
+	char buf[32], *path = cwrite(data, len, buf);
+	cexpect(path != NULL, "writing a test file");
+	if(! path)
+		return;
+
+	qpack p = qtree_mmap(path, Optr, NULL);
+	unlink(path);
+	cexpect(p == NULL, what);
+	if(p)
+		qpack_free(p);
+}
+
+/// Sets or clears bit i of the 32-bit words at w, which need not be aligned
+static void
+cbit_set(uint8_t *w, uint32_t i, int on) {
+	uint32_t v;
+	memcpy(&v, w + i/32*4, 4);
+	v = on ? v | 1u << i%32 : v & ~(1u << i%32);
+	memcpy(w + i/32*4, &v, 4);
+}
+
+/// Checks that qtree_mmap() refuses damaged and mismatched files
+/*!
+  The file is patched at the offsets quadtree.c lays it out at. The
+  header holds the magic, the version, the root bound and looseness,
+  then the node, element and exact bound counts. The node table ends
+  the file: each node's first element, one more for the end of the
+  last run, one inner bit per node, a rank word per 32 nodes, and the
+  exact bounds.
+*/
+static void
+check_files(void) {
+	static const cmode m = { "files", 0, 1, 0, 0, 0, 0 };
+	char buf[32];
+
+	where = m.name;
+	qtree q = ctree_new(&m);
+	for(uint32_t i=0; i<CHECK_N; i++)
+		O[i].in = 0;
+	for(uint32_t i=0; i<CHECK_N/4; i++)
+		cobj_insert(q, &m, i);
+
+	cexpect(! qtree_save(q, "/nonexistent/qtcheck", cobj_id, NULL), "qtree_save to a bad path");
+	cexpect(qtree_mmap("/nonexistent/qtcheck", Optr, NULL) == NULL, "qtree_mmap of a missing file");
+
+	char *path = csave(q, buf);
+	cexpect(path != NULL, "qtree_save");
+	if(! path) {
+		qtree_free(q);
+		return;
+	}
+
+	FILE *f = fopen(path, "rb");
+	fseek(f, 0, SEEK_END);
+	size_t len = ftell(f);
+	uint8_t *data = malloc(len + 4), *bad = malloc(len + 4);
+	rewind(f);
+	cexpect(fread(data, 1, len, f) == len, "reading a saved file");
+	fclose(f);
+
+	// Ids come back as pointers when no element array is given
+	qpack p = qtree_mmap(path, NULL, NULL);
+	unlink(path);
+	cexpect(p != NULL, "qtree_mmap without elements");
+	if(p) {
+		uint32_t cnt, ok = 1;
+		void **l = qpack_findInArea(p, -1, -1, CHECK_WORLD+2, CHECK_WORLD+2, &cnt);
+		cwant_rect(-1, -1, CHECK_WORLD+2, CHECK_WORLD+2);
+		for(uint32_t i=0; i<cnt; i++)
+			if((uintptr_t)l[i] >= CHECK_N || want[(uintptr_t)l[i]] != CMUST)
+				ok = 0;
+		cexpect(ok && cnt == qtree_countInArea(q, -1, -1, CHECK_WORLD+2, CHECK_WORLD+2),
+				"qtree_mmap ids");
+		free(l);
+		qpack_free(p);
+	}
+
+	uint32_t nn, ne, nx, v;
+	memcpy(&nn, data + 28, 4);
+	memcpy(&ne, data + 32, 4);
+	memcpy(&nx, data + 36, 4);
+	size_t nw = (nn + 31)/32;
+	uint8_t *first = bad + 40 + ne*5*sizeof(float);
+	uint8_t *inner = first + (nn+1)*4, *rank = inner + nw*4;
+	cexpect(nn > 5 && ne > 0 && ! nx && 40 + ne*5*sizeof(float) + (nn+1+2*nw)*4 == len,
+			"saved file layout");
+
+	cmap_bad(data, 0, "qtree_mmap of an empty file");
+	cmap_bad(data, 20, "qtree_mmap of a short header");
+	cmap_bad(data, len-1, "qtree_mmap of a truncated file");
+
+	memcpy(bad, data, len);
+	memset(bad + len, 0, 4);
+	cmap_bad(bad, len+4, "qtree_mmap of a file with trailing bytes");
+
+	memcpy(bad, data, len);
+	bad[0] ^= 0xff;
+	cmap_bad(bad, len, "qtree_mmap with a bad magic");
+
+	memcpy(bad, data, len);
+	memcpy(&v, bad + 4, 4);
+	v++;
+	memcpy(bad + 4, &v, 4);
+	cmap_bad(bad, len, "qtree_mmap with a bad version");
+
+	memcpy(bad, data, len);
+	v = ne+1;
+	memcpy(bad + 32, &v, 4);
+	cmap_bad(bad, len, "qtree_mmap with a bad element count");
+
+	memcpy(bad, data, len);
+	v = 0;
+	memcpy(bad + 28, &v, 4);
+	cmap_bad(bad, len, "qtree_mmap with no nodes");
+
+	// The last node is always a leaf; giving it children makes one too many inner nodes
+	memcpy(bad, data, len);
+	cbit_set(inner, nn-1, 1);
+	cmap_bad(bad, len, "qtree_mmap with an inner node count that does not match");
+
+	memcpy(bad, data, len);
+	v = 1;
+	memcpy(rank, &v, 4);
+	cmap_bad(bad, len, "qtree_mmap with a rank that does not match");
+
+	// The root's inner bit moved to the last node, with the ranks redone,
+	// so the last node's children come before it
+	memcpy(bad, data, len);
+	cbit_set(inner, 0, 0);
+	cbit_set(inner, nn-1, 1);
+	for(uint32_t w=0, r=0; w<nw; w++) {
+		memcpy(rank + w*4, &r, 4);
+		memcpy(&v, inner + w*4, 4);
+		r += __builtin_popcount(v);
+	}
+	cmap_bad(bad, len, "qtree_mmap with a child index pointing back");
+
+	// The last run going past the end of the element arrays
+	memcpy(bad, data, len);
+	v = ne+1;
+	memcpy(first + nn*4, &v, 4);
+	cmap_bad(bad, len, "qtree_mmap with an element index out of range");
+
+	// The root's run ending after the next node's does
+	memcpy(bad, data, len);
+	v = ne;
+	memcpy(first + 4, &v, 4);
+	cmap_bad(bad, len, "qtree_mmap with an element run out of order");
+
+	free(data);
+	free(bad);
+	qtree_free(q);
+}
+
+/// Runs every tree check in mode m
+static void
+check_mode(const cmode *m) {
+	where = m->name;
+	qtree q = ctree_new(m);
+
+	for(uint32_t i=0; i<CHECK_N; i++)
+		cobj_insert(q, m, i);
+	check_queries(q, m);
+
+	check_mutate(q, m, CHECK_N*4);
+	check_queries(q, m);
+	check_saved(q, m);
+
+	if(m->deferred) {
+		qtree_set_deferred(q, 0);
+		check_queries(q, m);
+		qtree_set_deferred(q, 1);
+	}
+
+	qtree_clear(q);
+	for(uint32_t i=0; i<CHECK_N; i++)
+		O[i].in = 0;
+	cexpect(qtree_countInArea(q, -CHECK_WORLD, -CHECK_WORLD, CHECK_WORLD*3, CHECK_WORLD*3) == 0,
+			"qtree_clear");
+	check_saved(q, m);
+	check_mutate(q, m, CHECK_N*2);
+	check_queries(q, m);
+
+	qtree_free(q);
+}
+
+/// Checks that building rev, in reverse, gives the tree fwd already has
+static void
+cbatch_order(qtree fwd, qtree rev, void **ptrs, const aabb *bounds, const char *what) {
+	void **rp = malloc(sizeof(void*)*CHECK_N);
+	aabb *rb = malloc(sizeof(aabb)*CHECK_N);
+	qtree_stats sa, sb;
+
+	for(uint32_t i=0; i<CHECK_N; i++) {
+		rp[i] = ptrs[CHECK_N-1-i];
+		if(bounds)
+			rb[i] = bounds[CHECK_N-1-i];
+	}
+	if(bounds)
+		qtree_insert_aabb_batch(rev, rp, rb, CHECK_N);
+	else
+		qtree_insert_batch(rev, rp, CHECK_N);
+
+	qtree_get_stats(fwd, &sa);
+	qtree_get_stats(rev, &sb);
+	cexpect(! memcmp(&sa, &sb, offsetof(qtree_stats, allocs)), what);
+
+	free(rb);
+	free(rp);
+}
+
+/// Checks qtree_insert_batch() against one-at-a-time inserts
+/*!
+  A batch builds its own shape, so only the results are compared with
+  the one-at-a-time tree; the shape must not depend on the batch order.
+*/
+static void
+check_batch(void) {
+	static const cmode m = { "batch", 1, 1, 0, 0, 0, 0 };
+	void **ptrs = malloc(sizeof(void*)*CHECK_N);
+	qtree a = ctree_new(&m), b = ctree_new(&m), r = ctree_new(&m);
+	uint32_t cnt, bcnt, ins = 0;
+
+	where = m.name;
+	for(uint32_t i=0; i<CHECK_N; i++) {
+		cobj_place(&O[i], 1);
+		O[i].bounded = 0;
+		O[i].h = 0;
+		ptrs[i] = &O[i];
+		O[i].in = qtree_insert(a, &O[i]);
+		ins += O[i].in;
+	}
+	cexpect(qtree_insert_batch(b, ptrs, CHECK_N) == ins, "qtree_insert_batch count");
+	cbatch_order(b, r, ptrs, NULL, "qtree_insert_batch shape in reverse");
+
+	for(int t=0; t<CHECK_QUERIES; t++) {
+		float x = cgrid(CHECK_WORLD), y = cgrid(CHECK_WORLD), w = cgrid(60), h = cgrid(60);
+		void **la = qtree_findInArea(a, x, y, w, h, &cnt);
+		void **lb = qtree_findInArea(b, x, y, w, h, &bcnt);
+		cwant_rect(x, y, w, h);
+		cresult(lb, bcnt, "qtree_insert_batch results");
+		free(la);
+		free(lb);
+	}
+
+	qtree_free(a);
+	qtree_free(b);
+	qtree_free(r);
+	free(ptrs);
+}
+
+/// Checks qtree_insert_aabb_batch() against one-at-a-time qtree_insert_aabb() calls
+/*!
+  A loose tree places by center and size alone, so there the batch must
+  also put every element where the single inserts did.
+*/
+static void
+check_aabb_batch(const cmode *m) {
+	void **ptrs = malloc(sizeof(void*)*CHECK_N);
+	aabb *bounds = malloc(sizeof(aabb)*CHECK_N);
+	qtree a = ctree_new(m), b = ctree_new(m), r = ctree_new(m);
+	uint32_t cnt, bcnt, ins = 0;
+
+	where = m->name;
+	for(uint32_t i=0; i<CHECK_N; i++) {
+		cobj_place(&O[i], cpick(3) == 0);
+		O[i].bounded = 1;
+		O[i].h = 0;
+		ptrs[i] = &O[i];
+		bounds[i] = O[i].b;
+		O[i].in = qtree_insert_aabb(a, &O[i], &O[i].b);
+		ins += O[i].in;
+	}
+	cexpect(qtree_insert_aabb_batch(b, ptrs, bounds, CHECK_N) == ins,
+			"qtree_insert_aabb_batch count");
+	// A grown tree grows one element at a time, in batch order
+	if(! m->autogrow)
+		cbatch_order(b, r, ptrs, bounds, "qtree_insert_aabb_batch shape in reverse");
+
+	for(int t=0; t<CHECK_QUERIES; t++) {
+		float x = cgrid(CHECK_WORLD), y = cgrid(CHECK_WORLD), w = cgrid(60), h = cgrid(60);
+		if(t == 0) {
+			x = y = -CHECK_WORLD;
+			w = h = CHECK_WORLD*3;
+		}
+		void **la = qtree_findInArea(a, x, y, w, h, &cnt);
+		void **lb = qtree_findInArea(b, x, y, w, h, &bcnt);
+		cwant_rect(x, y, w, h);
+		cresult(lb, bcnt, "qtree_insert_aabb_batch results");
+		if(m->loose > 1 && ! m->autogrow)
+			csame(lb, bcnt, la, cnt, "qtree_insert_aabb_batch placement");
+		free(la);
+		free(lb);
+	}
+
+	qtree_free(a);
+	qtree_free(b);
+	qtree_free(r);
+	free(bounds);
+	free(ptrs);
+}
+
+/// Checks point trees, exact and quantized
+static void
+check_points(void) {
+	int tally = 0;
+
+	for(int quant=0; quant<2; quant++) {
+		qptree p = qptree_new(0, 0, CHECK_WORLD, CHECK_WORLD, quant);
+		float tol = quant ? CHECK_WORLD/65536*1.01f : 0;
+		void **buf = malloc(sizeof(void*)*CHECK_N);
+		cvisit v = { buf, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+		where = quant ? "quantized points" : "points";
+		for(uint32_t i=0; i<CHECK_N; i++) {
+			cobj_place(&O[i], 1);
+			// Repeated positions, and points along split lines
+			if(i % 5 == 0 && i)
+				O[i].b.center = O[i-1].b.center;
+			if(i % 11 == 0)
+				O[i].b.center.x = CHECK_WORLD/2;
+			O[i].bounded = 1;
+			O[i].in = qptree_insert(p, O[i].b.center.x, O[i].b.center.y, &O[i]);
+			cexpect(O[i].in, "qptree_insert");
+		}
+		cexpect(! qptree_insert(p, CHECK_WORLD + 1, 0, &O[0]), "qptree_insert outside");
+
+		for(int round=0; round<2; round++) {
+			for(int t=0; t<CHECK_QUERIES*2; t++) {
+				float x = cgrid(CHECK_WORLD), y = cgrid(CHECK_WORLD);
+				float w = cgrid(t % 4 ? 40 : 200), h = cgrid(t % 4 ? 40 : 200);
+				uint32_t cnt;
+
+				if(t % 10 == 0) {
+					x = CHECK_WORLD/2;
+					w = 0;
+				}
+				for(uint32_t i=0; i<CHECK_N; i++) {
+					float px = O[i].b.center.x, py = O[i].b.center.y;
+					if(! O[i].in)
+						want[i] = CNOT;
+					else if(px >= x+tol && px <= x+w-tol && py >= y+tol && py <= y+h-tol)
+						want[i] = CMUST;
+					else if(px >= x-tol && px <= x+w+tol && py >= y-tol && py <= y+h+tol)
+						want[i] = CMAY;
+					else
+						want[i] = CNOT;
+				}
+
+				void **l = qptree_findInArea(p, x, y, w, h, &cnt);
+				cresult(l, cnt, "qptree_findInArea");
+				free(l);
+
+				v.n = 0;
+				uint32_t n = qptree_visitInArea(p, x, y, w, h, cvisit_fn, &v);
+				cexpect(n == cnt && v.n == cnt, "qptree_visitInArea count");
+				cresult(buf, v.n, "qptree_visitInArea");
+				cexpect(qptree_countInArea(p, x, y, w, h) == cnt, "qptree_countInArea");
+			}
+
+			if(round)
+				break;
+			for(uint32_t i=0; i<CHECK_N; i++) {
+				if(i % 3)
+					continue;
+				cexpect(qptree_remove(p, O[i].b.center.x, O[i].b.center.y, &O[i]) == 1,
+						"qptree_remove");
+				cexpect(qptree_remove(p, O[i].b.center.x, O[i].b.center.y, &O[i]) == 0,
+						"qptree_remove twice");
+				O[i].in = 0;
+			}
+		}
+
+		qptree_clear(p);
+		tally += qptree_countInArea(p, 0, 0, CHECK_WORLD, CHECK_WORLD);
+		free(buf);
+		qptree_free(p);
+	}
+
+	cexpect(! tally, "qptree_clear");
+}
+
+/// Counts calls to it in the uint32_t at userdata
+static void
+cpair_count(void *a, void *b, void *userdata) {
+	(void)a;
+	(void)b;
+	(*(uint32_t*)userdata)++;
+}
+
+/// Checks that a NULL element is found like any other
+static void
+check_null(void) {
+	aabb b = { { 10, 10 }, { 1, 1 } }, o = { { 11, 11 }, { 1, 1 } };
+	qtree q = qtree_new(0, 0, CHECK_WORLD, CHECK_WORLD, NULL);
+	uint32_t cnt, off[2], npairs = 0;
+	void *out[2];
+
+	where = "null";
+	cexpect(qtree_insert_aabb(q, NULL, &b) == 1, "qtree_insert_aabb of NULL");
+	cexpect(qtree_insert_aabb(q, &O[0], &o) == 1, "qtree_insert_aabb");
+
+	void **l = qtree_findInArea(q, 8, 8, 4, 4, &cnt);
+	cexpect(cnt == 2 && (! l[0] || ! l[1]), "qtree_findInArea of NULL");
+	free(l);
+	cexpect(qtree_countInArea(q, 8, 8, 4, 4) == 2, "qtree_countInArea of NULL");
+
+	cnt = qtree_findNearest(q, 10, 10, 2, INFINITY, out, NULL);
+	cexpect(cnt == 2 && (! out[0] || ! out[1]), "qtree_findNearest of NULL");
+
+	l = qtree_findInAreaBatch(q, &b, 1, off);
+	cexpect(off[1] == 2, "qtree_findInAreaBatch of NULL");
+	free(l);
+
+	cexpect(qtree_findAllPairs(q, cpair_count, &npairs) == 1 && npairs == 1,
+			"qtree_findAllPairs of NULL");
+
+	qpack p = qtree_pack(q);
+	l = qpack_findInArea(p, 8, 8, 4, 4, &cnt);
+	cexpect(cnt == 2, "qtree_pack of NULL");
+	free(l);
+	qpack_free(p);
+
+	qtree_remove(q, NULL);
+	cexpect(qtree_countInArea(q, 8, 8, 4, 4) == 1, "qtree_remove of NULL");
+	qtree_free(q);
+}
+
+/// Checks aabb_intersects_mask() and aabb_intersects_list() against aabb_intersects()
+static void
+check_aabb(void) {
+	aabb *b = malloc(sizeof(aabb)*200);
+	uint64_t mask[4];
+	uint32_t idx[200];
+
+	where = "aabb";
+	for(int t=0; t<500; t++) {
+		uint32_t n = cpick(200), e = 0;
+		aabb q = { { cgrid(64), cgrid(64) }, { cgrid(16), cgrid(16) } };
+		int bad = 0;
+
+		for(uint32_t i=0; i<n; i++) {
+			b[i].center.x = cgrid(64);
+			b[i].center.y = cgrid(64);
+			b[i].dims.w = cgrid(8);
+			b[i].dims.h = cgrid(8);
+		}
+		aabb_intersects_mask(&q, b, n, mask);
+		uint32_t k = aabb_intersects_list(&q, b, n, idx);
+
+		for(uint32_t i=0; i<n; i++) {
+			int hit = aabb_intersects(&q, &b[i]);
+			if(hit != (int)((mask[i/64] >> (i%64)) & 1))
+				bad = 1;
+			if(hit && (e >= k || idx[e++] != i))
+				bad = 1;
+		}
+		cexpect(! bad && e == k, "aabb_intersects_mask and aabb_intersects_list");
+	}
+
+	free(b);
+}
+
+#if CHECK_THREADS
+static void*
+cmutex_new(void) {
+	pthread_mutex_t *m = malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(m, NULL);
+	return m;
+}
+
+static int
+cmutex_lock(void *m) {
+	return pthread_mutex_lock(m);
+}
+
+static int
+cmutex_unlock(void *m) {
+	return pthread_mutex_unlock(m);
+}
+
+static int
+cmutex_free(void *m) {
+	pthread_mutex_destroy(m);
+	free(m);
+	return 0;
+}
+
+/// Shared state of the concurrent check
+typedef struct crace {
+	qtree q;
+	const cmode *m;
+	atomic_int done;
+	atomic_uint bad;
+} crace;
+
+static void*
+crace_writer(void *arg) {
+	crace *c = arg;
+
+	for(uint32_t r=0; r<CHECK_RACEOPS; r++) {
+		check_mutate(c->q, c->m, 1);
+		if(r % 1000 == 0)
+			qtree_set_deferred(c->q, (r/1000) % 2);
+	}
+	qtree_set_deferred(c->q, 0);
+
+	atomic_store(&c->done, 1);
+	return NULL;
+}
+
+static void*
+crace_reader(void *arg) {
+	crace *c = arg;
+	uint64_t s = (uint64_t)(uintptr_t)arg | 1;
+	void *out[8];
+
+	while(! atomic_load(&c->done)) {
+		s ^= s >> 12;
+		s ^= s << 25;
+		s ^= s >> 27;
+		float x = (float)(s % 256), y = (float)((s >> 8) % 256);
+		uint32_t cnt;
+
+		// Elements may be seen twice while moving, but never a stray pointer
+		void **l = qtree_findInArea(c->q, x, y, 40, 40, &cnt);
+		for(uint32_t i=0; i<cnt; i++)
+			if(cid(l[i]) < 0)
+				atomic_fetch_add(&c->bad, 1);
+		free(l);
+
+		uint32_t n = qtree_findNearest(c->q, x, y, 8, INFINITY, out, NULL);
+		for(uint32_t i=0; i<n; i++)
+			if(cid(out[i]) < 0)
+				atomic_fetch_add(&c->bad, 1);
+	}
+	return NULL;
+}
+
+/// Runs a writer against readers, then checks the tree it leaves
+/*!
+  The tree gets the mutex hooks, which QTREE_LOCK_HOOKS builds need to
+  lock it at all.
+*/
+static void
+check_race(const cmode *m) {
+	crace c;
+	pthread_t t[3];
+
+	where = m->name;
+	c.q = ctree_new(m);
+	qtree_set_mutex(c.q, (void*)cmutex_new, (void*)cmutex_lock,
+					(void*)cmutex_unlock, (void*)cmutex_free);
+	c.m = m;
+	atomic_init(&c.done, 0);
+	atomic_init(&c.bad, 0);
+
+	for(uint32_t i=0; i<CHECK_N; i++)
+		cobj_insert(c.q, m, i);
+
+	pthread_create(&t[0], NULL, crace_writer, &c);
+	pthread_create(&t[1], NULL, crace_reader, &c);
+	pthread_create(&t[2], NULL, crace_reader, &c);
+	for(int i=0; i<3; i++)
+		pthread_join(t[i], NULL);
+
+	cexpect(! atomic_load(&c.bad), "concurrent readers");
+	check_queries(c.q, m);
+	qtree_free(c.q);
+}
+
+/// Shared state of the collapse check
+/*!
+  ver[i] is odd while element i is in the tree, and changes each time
+  it goes in or out.
+*/
+typedef struct ccollapse {
+	qtree q;
+	aabb b[CHECK_CHURN];
+	atomic_uint ver[CHECK_CHURN];
+	atomic_uint searches;
+	atomic_uint missed;
+} ccollapse;
+
+static void*
+ccollapse_writer(void *arg) {
+	ccollapse *c = arg;
+	qhandle h[CHECK_CHURN] = { 0 };
+
+	// Until the readers have had their turn, however the threads are scheduled
+	while(atomic_load(&c->searches) < CHECK_RACEOPS) {
+		uint32_t i = cpick(CHECK_CHURN);
+		if(h[i]) {
+			atomic_fetch_add(&c->ver[i], 1);
+			qtree_remove_handle(c->q, h[i]);
+			h[i] = 0;
+		} else {
+			c->b[i].center.x = 0.5f + cgrid(31);
+			c->b[i].center.y = 0.5f + cgrid(31);
+			c->b[i].dims.w = c->b[i].dims.h = 0.25f;
+			h[i] = qtree_insert_handle(c->q, &c->b[i], &c->b[i]);
+			if(h[i])
+				atomic_fetch_add(&c->ver[i], 1);
+		}
+	}
+
+	for(uint32_t i=0; i<CHECK_CHURN; i++) {
+		if(h[i]) {
+			atomic_fetch_add(&c->ver[i], 1);
+			qtree_remove_handle(c->q, h[i]);
+		}
+	}
+	return NULL;
+}
+
+static void*
+ccollapse_reader(void *arg) {
+	ccollapse *c = arg;
+
+	while(atomic_load(&c->searches) < CHECK_RACEOPS) {
+		unsigned ver[CHECK_CHURN];
+		uint32_t cnt;
+		uint64_t found = 0;
+
+		for(uint32_t i=0; i<CHECK_CHURN; i++)
+			ver[i] = atomic_load(&c->ver[i]);
+
+		void **l = qtree_findInArea(c->q, -1, -1, 34, 34, &cnt);
+		for(uint32_t i=0; i<cnt; i++)
+			found |= 1ull << ((aabb*)l[i] - c->b);
+		free(l);
+
+		// In the tree for the whole search, so it must have been found
+		for(uint32_t i=0; i<CHECK_CHURN; i++)
+			if(ver[i] % 2 && ver[i] == atomic_load(&c->ver[i]) && ! (found >> i & 1))
+				atomic_fetch_add(&c->missed, 1);
+
+		atomic_fetch_add(&c->searches, 1);
+	}
+	return NULL;
+}
+
+/// Churns elements through splits and collapses while snapshot readers search
+/*!
+  The tree is small enough that removals keep folding nodes back into
+  their parents, moving elements up while the readers search.
+*/
+static void
+check_collapse(void) {
+	ccollapse c;
+	pthread_t t[3];
+
+	where = "race collapse";
+	c.q = qtree_new(0, 0, 32, 32, NULL);
+	qtree_setMaxNodeCnt(c.q, 4);
+	qtree_set_snapshot(c.q, 1);
+	qtree_set_mutex(c.q, (void*)cmutex_new, (void*)cmutex_lock,
+					(void*)cmutex_unlock, (void*)cmutex_free);
+	for(uint32_t i=0; i<CHECK_CHURN; i++)
+		atomic_init(&c.ver[i], 0);
+	atomic_init(&c.searches, 0);
+	atomic_init(&c.missed, 0);
+
+	pthread_create(&t[0], NULL, ccollapse_writer, &c);
+	pthread_create(&t[1], NULL, ccollapse_reader, &c);
+	pthread_create(&t[2], NULL, ccollapse_reader, &c);
+	for(int i=0; i<3; i++)
+		pthread_join(t[i], NULL);
+
+	cexpect(! atomic_load(&c.missed), "snapshot readers during collapses");
+	cexpect(qtree_countInArea(c.q, -1, -1, 34, 34) == 0, "collapse churn left elements");
+	qtree_free(c.q);
+}
+#endif
+
+int
+main(void) {
+	static const cmode modes[] = {
+		{ "plain", 0, 1, 0, 0, 0, 0 },
+		{ "compare", 1, 1, 0, 0, 0, 0 },
+		{ "loose", 0, 2, 0, 0, 0, 0 },
+		{ "deferred", 1, 1, 1, 0, 0, 0 },
+		{ "snapshot", 1, 1, 0, 1, 0, 0 },
+		{ "snapshot deferred loose", 0, 2, 1, 1, 0, 0 },
+		{ "flat", 1, 1, 0, 0, 1, 0 },
+		{ "autogrow", 0, 1, 0, 0, 0, 1 },
+	};
+
+	for(uint32_t i=0; i<CHECK_N; i++)
+		Optr[i] = &O[i];
+
+	for(size_t i=0; i<sizeof(modes)/sizeof(modes[0]); i++)
+		check_mode(&modes[i]);
+	check_loose_order();
+	check_grown();
+	check_files();
+	check_batch();
+
+	static const cmode boxes[] = {
+		{ "aabb batch", 0, 1, 0, 0, 0, 0 },
+		{ "aabb batch loose", 0, 2, 0, 0, 0, 0 },
+		{ "aabb batch flat", 0, 1, 0, 0, 1, 0 },
+		{ "aabb batch autogrow", 0, 1, 0, 0, 0, 1 },
+	};
+	for(size_t i=0; i<sizeof(boxes)/sizeof(boxes[0]); i++)
+		check_aabb_batch(&boxes[i]);
+
+	check_points();
+	check_null();
+	check_aabb();
+
+#if CHECK_THREADS
+	static const cmode race[] = {
+		{ "race", 0, 1, 0, 0, 0, 0 },
+		{ "race snapshot", 0, 1, 0, 1, 0, 0 },
+		{ "race snapshot loose", 0, 2, 0, 1, 0, 0 },
+	};
+	for(size_t i=0; i<sizeof(race)/sizeof(race[0]); i++)
+		check_race(&race[i]);
+	check_collapse();
+#endif
+
+	if(fails) {
+		fprintf(stderr, "check: %u failures\n", fails);
+		return 1;
+	}
+	puts("check: all passed");
+	return 0;
+}
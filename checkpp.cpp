@@ -0,0 +1,326 @@
+/*
+  checkpp.cpp
+  2014 JSK (kutani@projectkutani.com)
+
+  Consistency checks for quadtree.hpp. Part of the Panic Panic
+  project. Build and run with `make check`.
+
+  Works as check.c does for the C tree: random elements go into typed
+  trees of several shapes, and every search, removal and clear is
+  compared with a brute-force pass over the same elements. Elements
+  are move-only, and coordinates sit on a grid of quarter units so the
+  brute-force tests are exact.
+
+  Failures are reported on stderr, and the exit status is 1 if there
+  were any.
+
+  Released to the public domain. See LICENSE for details.
+*/
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "quadtree.hpp"
+
+/// Number of elements each check uses
+#define CHECK_N 3000
+
+/// Width and height of the area elements are spread over
+#define CHECK_WORLD 256.0f
+
+/// Seed for all generated data, so failures can be reproduced
+#define CHECK_SEED 0x9e3779b97f4a7c15ull
+
+/// Queries of each kind run per round
+#define CHECK_QUERIES 60
+
+/// Failures reported in full before the rest are only counted
+#define CHECK_REPORTS 20
+
+/// Element placed in the trees; move-only, and points at its index
+typedef std::unique_ptr<uint32_t> celem;
+
+static aabb B[CHECK_N];
+static uint8_t in[CHECK_N];
+static uint8_t want[CHECK_N];
+static uint32_t seen[CHECK_N];
+static const char *where = "";
+static uint32_t fails;
+static uint64_t rng = CHECK_SEED;
+
+/// Bound of an element, as the trees take it
+struct cbounds {
+	aabb operator()(const celem &e) const {
+		return B[*e];
+	}
+};
+
+/// xorshift64*; returns a float in [0, 1)
+static float
+crand() {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (float)((rng * 0x2545f4914f6cdd1dull) >> 40) / (float)(1 << 24);
+}
+
+/// Returns a random multiple of 1/4 in [0, max)
+static float
+cgrid(float max) {
+	return std::floor(crand()*max*4) / 4;
+}
+
+/// Returns a random index below n
+static uint32_t
+cpick(uint32_t n) {
+	return (uint32_t)(crand()*n) % n;
+}
+
+static void
+cfail(const char *what) {
+	if(fails++ < CHECK_REPORTS)
+		fprintf(stderr, "checkpp: %s: %s failed\n", where, what);
+}
+
+static void
+cexpect(bool ok, const char *what) {
+	if(! ok)
+		cfail(what);
+}
+
+/// Gives element i a new random box, a point, or with cluster set, a point near one corner
+static void
+cplace(uint32_t i, bool cluster) {
+	int kind = cpick(20);
+	aabb &b = B[i];
+
+	if(cluster) {
+		b.center.x = 1 + cgrid(1);
+		b.center.y = 1 + cgrid(1);
+		b.dims.w = b.dims.h = 0;
+		return;
+	}
+	b.center.x = cgrid(CHECK_WORLD);
+	b.center.y = cgrid(CHECK_WORLD);
+	b.dims.w = kind < 8 ? 0 : cgrid(kind == 19 ? 40 : 4);
+	b.dims.h = kind < 8 ? 0 : cgrid(kind == 19 ? 40 : 4);
+}
+
+/// Checks if element i's bound lies in the tree's bound
+static bool
+cfits(uint32_t i) {
+	const aabb &b = B[i];
+	return b.center.x - b.dims.w >= 0 && b.center.x + b.dims.w <= CHECK_WORLD &&
+		   b.center.y - b.dims.h >= 0 && b.center.y + b.dims.h <= CHECK_WORLD;
+}
+
+/// Checks if element i's bound overlaps the x,y + w,h bound, edges included
+static bool
+chits(uint32_t i, float x, float y, float w, float h) {
+	const aabb &b = B[i];
+	return b.center.x - b.dims.w <= x+w && b.center.x + b.dims.w >= x &&
+		   b.center.y - b.dims.h <= y+h && b.center.y + b.dims.h >= y;
+}
+
+/// Sets want for the x,y + w,h bound; returns how many elements it holds
+static uint32_t
+cwant_rect(float x, float y, float w, float h) {
+	uint32_t n = 0;
+	for(uint32_t i=0; i<CHECK_N; i++) {
+		want[i] = in[i] && chits(i, x, y, w, h);
+		n += want[i];
+	}
+	return n;
+}
+
+/// Checks that ids holds each wanted element exactly once
+static void
+cresult(const std::vector<uint32_t> &ids, const char *what) {
+	bool bad = false;
+
+	memset(seen, 0, sizeof(seen));
+	for(uint32_t id : ids)
+		if(id >= CHECK_N || ! want[id] || seen[id]++)
+			bad = true;
+	for(uint32_t i=0; i<CHECK_N; i++)
+		if(want[i] && ! seen[i])
+			bad = true;
+
+	cexpect(! bad, what);
+}
+
+/// Checks every search of t against brute force on its current contents
+template<typename Tree>
+static void
+check_queries(Tree &t) {
+	uint32_t total = 0;
+	for(uint32_t i=0; i<CHECK_N; i++)
+		total += in[i];
+	cexpect(t.size() == total, "size");
+
+	for(int q=0; q<CHECK_QUERIES; q++) {
+		float x = cgrid(CHECK_WORLD) - 16, y = cgrid(CHECK_WORLD) - 16;
+		float w = cgrid(q % 4 ? 40 : 200), h = cgrid(q % 4 ? 40 : 200);
+		if(q == 0) {
+			x = y = -1;
+			w = h = CHECK_WORLD + 2;
+		}
+		uint32_t exp = cwant_rect(x, y, w, h);
+
+		std::vector<uint32_t> ids;
+		std::vector<celem*> ptrs;
+		for(celem &e : t.findInArea(x, y, w, h)) {
+			ids.push_back(*e);
+			ptrs.push_back(&e);
+		}
+		cresult(ids, "findInArea");
+
+		size_t cap = ptrs.size()/2 ? ptrs.size()/2 : 1;
+		std::vector<celem*> buf(cap);
+		size_t n = t.findInArea(x, y, w, h, buf.data(), cap);
+		cexpect(n == exp && (! n || ! memcmp(buf.data(), ptrs.data(),
+											  sizeof(celem*)*(n < cap ? n : cap))),
+				"findInArea into a buffer");
+
+		ids.clear();
+		n = t.visitInArea(x, y, w, h, [&](celem &e) { ids.push_back(*e); return false; });
+		cexpect(n == exp, "visitInArea count");
+		cresult(ids, "visitInArea");
+		n = t.visitInArea(x, y, w, h, [](celem&) { return true; });
+		cexpect(n == (exp ? 1u : 0u), "visitInArea stop");
+
+		cexpect(t.countInArea(x, y, w, h) == exp, "countInArea");
+
+		// The same searches through a const tree, in the same order
+		const Tree &ct = t;
+		std::vector<const celem*> cptrs;
+		for(const celem &e : ct.findInArea(x, y, w, h))
+			cptrs.push_back(&e);
+		cexpect(cptrs.size() == ptrs.size() &&
+				(ptrs.empty() || ! memcmp(cptrs.data(), ptrs.data(), sizeof(celem*)*ptrs.size())),
+				"const findInArea");
+
+		std::vector<const celem*> cbuf(cap);
+		n = ct.findInArea(x, y, w, h, cbuf.data(), cap);
+		cexpect(n == exp && (! n || ! memcmp(cbuf.data(), ptrs.data(),
+											  sizeof(celem*)*(n < cap ? n : cap))),
+				"const findInArea into a buffer");
+
+		ids.clear();
+		n = ct.visitInArea(x, y, w, h, [&](const celem &e) { ids.push_back(*e); return false; });
+		cexpect(n == exp, "const visitInArea count");
+		cresult(ids, "const visitInArea");
+
+		typename Tree::const_iterator it = t.findInArea(x, y, w, h).begin();
+		cexpect(exp ? it != typename Tree::const_iterator() && &*it == ptrs[0] :
+				it == typename Tree::const_iterator(), "iterator to const_iterator");
+	}
+}
+
+/// Removes elements at random with remove_if() and checks what it took
+template<typename Tree>
+static void
+check_remove(Tree &t, uint32_t rounds) {
+	for(uint32_t r=0; r<rounds; r++) {
+		float x = cgrid(CHECK_WORLD) - 16, y = cgrid(CHECK_WORLD) - 16;
+		float w = cgrid(r % 4 ? 60 : 300), h = cgrid(r % 4 ? 60 : 300);
+		uint32_t mod = 1 + cpick(3), exp = 0;
+
+		for(uint32_t i=0; i<CHECK_N; i++) {
+			if(in[i] && i % mod == 0 && chits(i, x, y, w, h)) {
+				in[i] = 0;
+				exp++;
+			}
+		}
+
+		size_t n = t.remove_if(x, y, w, h, [&](const celem &e) { return *e % mod == 0; });
+		cexpect(n == exp, "remove_if count");
+	}
+}
+
+/// Inserts every element not in t, clustered at one corner if cluster is set
+template<typename Tree>
+static void
+cfill(Tree &t, bool cluster) {
+	for(uint32_t i=0; i<CHECK_N; i++) {
+		if(in[i])
+			continue;
+		cplace(i, cluster && i % 2 == 0);
+		bool ok = i % 3 ? t.insert(celem(new uint32_t(i))) : t.emplace(new uint32_t(i));
+		cexpect(ok == cfits(i), "insert result");
+		in[i] = ok;
+	}
+}
+
+/// Runs every check on a tree of the given node capacity and depth limit
+template<unsigned NodeCap, unsigned MaxDepth>
+static void
+check_tree(const char *name) {
+	typedef qt::quadtree<celem, cbounds, NodeCap, MaxDepth> tree;
+	tree t(0, 0, CHECK_WORLD, CHECK_WORLD);
+
+	where = name;
+	memset(in, 0, sizeof(in));
+
+	// Half the elements on a spot small enough to reach MaxDepth
+	cfill(t, true);
+	check_queries(t);
+
+	check_remove(t, CHECK_QUERIES);
+	check_queries(t);
+
+	// Freed sibling blocks are reused as the tree fills back up
+	cfill(t, false);
+	check_queries(t);
+
+	// Emptying the tree collapses it to the root, which must still work
+	t.remove_if(-1, -1, CHECK_WORLD+2, CHECK_WORLD+2, [](const celem&) { return true; });
+	memset(in, 0, sizeof(in));
+	check_queries(t);
+	cfill(t, false);
+	check_queries(t);
+
+	tree m(std::move(t));
+	check_queries(m);
+
+	// A moved-from tree is empty but still usable
+	memset(in, 0, sizeof(in));
+	check_queries(t);
+	cfill(t, false);
+	check_queries(t);
+
+	// Moving onto a full tree drops what it held
+	m = std::move(t);
+	check_queries(m);
+	memset(in, 0, sizeof(in));
+	check_queries(t);
+	cfill(t, true);
+	check_queries(t);
+
+	m.clear();
+	memset(in, 0, sizeof(in));
+	check_queries(m);
+	cfill(m, true);
+	check_queries(m);
+}
+
+int
+main() {
+	// A node capacity of 1 with a uniform fill makes a full tree, so a
+	// whole-world search fills the iterator stack to 3*MaxDepth+1
+	check_tree<1, 5>("cap 1 depth 5");
+	check_tree<4, 3>("cap 4 depth 3");
+	check_tree<4, 24>("cap 4 depth 24");
+	check_tree<16, 8>("cap 16 depth 8");
+
+	if(fails) {
+		fprintf(stderr, "checkpp: %u failures\n", fails);
+		return 1;
+	}
+	puts("checkpp: all passed");
+	return 0;
+}
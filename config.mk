@@ -8,13 +8,38 @@ MAINOBJS = quadtree.o aabb.o
 ## Uncomment this line to build without thread safety
 #NO_THREAD_SAFETY=-DNO_THREAD_SAFETY
 
+## Uncomment this line to keep the counters qtree_get_stats() reports
+#STATS=-DQTREE_STATS
+
+## Uncomment one of these to pick the tree lock backend; C11 atomics
+## are used otherwise. The pthread backend needs -pthread when linking
+#LOCK=-DQTREE_LOCK=QTREE_LOCK_PTHREAD
+#LOCK=-DQTREE_LOCK=QTREE_LOCK_HOOKS
+
+## Uncomment this line to let the compiler use the widest SIMD range
+## tests the build machine supports (AVX, AVX-512); otherwise SSE2 or
+## NEON is used where the target has it
+#SIMD=-march=native
+
 ## Set BITS to 64 to install to lib64/
 BITS=
 CC=clang
+CXX=clang++
 LINK=cc
 OPTIM=-O0
 DEBUG=-g -Wall -Wextra
-CFLAGS=-std=c99 $(NO_THREAD_SAFETY) $(OPTIM) $(DEBUG)
+CFLAGS=-std=c11 $(NO_THREAD_SAFETY) $(LOCK) $(STATS) $(SIMD) $(OPTIM) $(DEBUG)
+# The variants target picks its own lock backends
+VARIANTCFLAGS=-std=c11 $(STATS) $(SIMD) $(OPTIM) $(DEBUG)
+# The bench target always builds optimized
+BENCHCFLAGS=-std=c11 $(NO_THREAD_SAFETY) $(LOCK) $(STATS) $(SIMD) -O2 -g
+## Number of entities the benchmarks use
+BENCHN=100000
+# The check target always builds with sanitizers; set CHECKSAN to
+# -fsanitize=thread to look for data races instead
+CHECKSAN=-fsanitize=address,undefined -fno-sanitize-recover=undefined
+CHECKCFLAGS=-std=c11 $(NO_THREAD_SAFETY) $(LOCK) $(STATS) $(SIMD) -O1 -g -Wall -Wextra $(CHECKSAN)
+CHECKCXXFLAGS=-std=c++11 -O1 -g -Wall -Wextra $(CHECKSAN)
 LFLAGS=$(OPTIM) $(DEBUG)
 
 PREFIX=.
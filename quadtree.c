@@ -6,37 +6,158 @@
 
   Released to the public domain. See LICENSE for details.
 */
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "aabb.h"
 
+/*!
+  Leaf scans test element bounds several at a time with whatever SIMD
+  instruction set the compiler targets: AVX-512, AVX, SSE2 or NEON, in
+  that order of preference. Build with e.g. -march=native to get the
+  wider ones, or define QTREE_NO_SIMD to use the plain C loop.
+*/
+#if !defined(QTREE_NO_SIMD) && defined(__AVX512F__)
+ #include <immintrin.h>
+ #define QTREE_SIMD_AVX512 1
+#elif !defined(QTREE_NO_SIMD) && defined(__AVX__)
+ #include <immintrin.h>
+ #define QTREE_SIMD_AVX 1
+#elif !defined(QTREE_NO_SIMD) && defined(__SSE2__)
+ #include <emmintrin.h>
+ #define QTREE_SIMD_SSE2 1
+#elif !defined(QTREE_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+ #include <arm_neon.h>
+ #define QTREE_SIMD_NEON 1
+#endif
+
 /// Default node size cap
 #define QTREE_STDCAP 4
 
+/// Default depth below which nodes are never split
+#define QTREE_MAXDEPTH 24
+
+/// Number of sibling blocks allocated per node pool chunk
+#define QTREE_POOLCHUNK 128
+
+/// Number of concurrent snapshot readers a tree can track
+#define QTREE_EPOCHSLOTS 64
+
+/// Smallest batch slice handed to another worker in a parallel build
+#define QTREE_PARGRAIN 2048
+
+/// Number of pending subtree builds each parallel build worker can queue
+#define QTREE_DEQUECAP 64
+
+/// Most times the root is doubled in size to take in a single element
+#define QTREE_MAXGROW 16
+
+/// First bytes of a file written by qtree_save()
+#define QTREE_FILEMAGIC "QTPK"
+
+/// Layout version of files written by qtree_save()
+#define QTREE_FILEVERSION 1
+
+/// Number of pieces per thread a parallel search is split into
+#define QTREE_PARSPLIT 8
+
+/// Number of traversal stack entries held without allocating
+/*!
+  A depth-first walk needs at most three entries per level plus one,
+  so this covers trees down to the default QTREE_MAXDEPTH.
+*/
+#define QTREE_STACKFIXED 80
+
+/// Number of per-thread counter slots each tree keeps with QTREE_STATS
+#define QTREE_STATSLOTS 16
+
+/// Number of points a point tree leaf holds before it is split
+#define QTREE_POINTCAP 16
+
+/// Number of bins in qtree_stats histograms
+#define QTREE_STATBINS 32
+
+/// Tree lock backends, chosen with QTREE_LOCK
+#define QTREE_LOCK_NONE 0    ///< No locking at all; same as NO_THREAD_SAFETY
+#define QTREE_LOCK_ATOMIC 1  ///< Reader-writer spinlock on C11 atomics
+#define QTREE_LOCK_PTHREAD 2 ///< pthread_rwlock_t
+#define QTREE_LOCK_HOOKS 3   ///< Only the qtree_set_mutex() mutex, for everything
+
 /*!
   Thread safety has a performance overhead penalty, even when not using
-  it. Define NO_THREAD_SAFETY to remove all thread safety features at
-  build time.
+  it. Define QTREE_LOCK to one of the backends above to pick how trees
+  are locked; it defaults to QTREE_LOCK_ATOMIC. Defining NO_THREAD_SAFETY
+  is the same as QTREE_LOCK_NONE and removes all thread safety features
+  at build time.
 */
-#ifndef NO_THREAD_SAFETY
+#ifdef NO_THREAD_SAFETY
+ #undef QTREE_LOCK
+ #define QTREE_LOCK QTREE_LOCK_NONE
+#elif ! defined(QTREE_LOCK)
+ #define QTREE_LOCK QTREE_LOCK_ATOMIC
+#endif
+
+#if QTREE_LOCK != QTREE_LOCK_NONE
  #define QTREE_THREADSAFE 1
 #else
  #define QTREE_THREADSAFE 0
 #endif
 
 #if QTREE_THREADSAFE == 1
- #define QTNEWMUTEX(X) (q->newfn)(X)
- #define QTLOCK(X) (q->lockfn)(X)
- #define QTUNLOCK(X) (q->unlockfn)(X)
- #define QTFREE(X) (q->freefn)(X)
+ #include <stdatomic.h>
+ #include <sched.h>
+ #if QTREE_LOCK == QTREE_LOCK_PTHREAD
+  #include <pthread.h>
+ #endif
+
+ #define QTLOCK(Q) do { if((Q)->lock) ((Q)->lockfn)((Q)->lock); } while(0)
+ #define QTUNLOCK(Q) do { if((Q)->lock) ((Q)->unlockfn)((Q)->lock); } while(0)
+ #define QTRDLOCK(Q) int _qt_rdslot = qtree_rdlock(Q)
+ #define QTRDUNLOCK(Q) qtree_rdunlock(Q, _qt_rdslot)
+ #define QTWRLOCK(Q) qtree_wrlock(Q)
+ #define QTWRUNLOCK(Q) qtree_wrunlock(Q)
+ #define QTSNAPSHOT(Q) ((Q)->snapshot)
+ #define QTPOOLLOCK(Q) do { if((Q)->par) qspin_lock(&(Q)->poollock); } while(0)
+ #define QTPOOLUNLOCK(Q) do { if((Q)->par) qspin_unlock(&(Q)->poollock); } while(0)
+ #define QTPUBLISH(X,V) __atomic_store_n(&(X), (V), __ATOMIC_RELEASE)
+ #define QTACQUIRE(X) __atomic_load_n(&(X), __ATOMIC_ACQUIRE)
+ #if QTREE_LOCK == QTREE_LOCK_HOOKS
+  #define QPRDLOCK(P)
+  #define QPRDUNLOCK(P)
+  #define QPWRLOCK(P)
+  #define QPWRUNLOCK(P)
+ #else
+  #define QPRDLOCK(P) (void)qrw_rdlock(&(P)->rw)
+  #define QPRDUNLOCK(P) qrw_rdunlock(&(P)->rw)
+  #define QPWRLOCK(P) (void)qrw_wrlock(&(P)->rw)
+  #define QPWRUNLOCK(P) qrw_wrunlock(&(P)->rw)
+ #endif
 #else
- #define QTNEWMUTEX(X)
- #define QTLOCK(X)
- #define QTUNLOCK(X)
- #define QTFREE(X)
+ #define QTLOCK(Q)
+ #define QTUNLOCK(Q)
+ #define QTRDLOCK(Q)
+ #define QTRDUNLOCK(Q)
+ #define QTWRLOCK(Q)
+ #define QTWRUNLOCK(Q)
+ #define QTSNAPSHOT(Q) 0
+ #define QTPOOLLOCK(Q)
+ #define QTPOOLUNLOCK(Q)
+ #define QTPUBLISH(X,V) ((X) = (V))
+ #define QTACQUIRE(X) (X)
+ #define QPRDLOCK(P)
+ #define QPRDUNLOCK(P)
+ #define QPWRLOCK(P)
+ #define QPWRUNLOCK(P)
 #endif
 
 /// A function pointer def for determining if an element exists in a range
@@ -47,487 +168,4621 @@ typedef int (*mutex_fnc)(void *ptr);
 
 typedef void* (*new_mutex_fnc)();
 
-/// A no-op dummy function for non-threadsafe quadtrees
-static inline int _lock_dummy() {
-	return 0;
-}
+/// A function pointer def for handing a task to another thread
+typedef void (*qtree_task_fnc)(void (*fn)(void *arg), void *arg, void *userdata);
 
-/// Quadtree node
-typedef struct qnode {
-	int8_t wrlockval; ///< -1 read-only; 1 write-only; 0 free
-	uint16_t cnt;     ///< Number of elements in this node
-	aabb bound;       ///< Area this node covers
-	void **elist;     ///< List of element pointers
-	struct qnode *nw; ///< NW quadrant of this node
-	struct qnode *ne; ///< NE quadrant of this node
-	struct qnode *sw; ///< SW quadrant of this node
-	struct qnode *se; ///< SE quadrant of this node
-#if QTREE_THREADSAFE == 1
-	void *lock;       ///< Mutex for locking this node
-	void *atomlock;   ///< Mutex for atomic wrlockval access
-#endif
-} qnode;
+/// A function pointer def for visiting found elements
+typedef int (*qtree_visit_fnc)(void *ptr, void *userdata);
 
-/// Quadtree container
-typedef struct _qtree {
-	int8_t wrlockval;    ///< -1 read/insert only; 1 remove only, 0 free
-	uint16_t maxnodecap; ///< Maximum element count per node
-#if QTREE_THREADSAFE == 1
-	void *lock;          ///< Mutex pointer for thread safety
-	new_mutex_fnc newfn; ///< Mutex create function pointer
-	mutex_fnc lockfn;    ///< Mutex lock function pointer
-	mutex_fnc unlockfn;  ///< Mutex unlock function pointer
-	mutex_fnc freefn;    ///< Mutex free function pointer
-#endif
-	qnode *root;         ///< Root node
-	qtree_fnc cmpfnc;    ///< Element range compare function pointer
-} _qtree;
+/// Distance function pointer def for nearest neighbour searches
+typedef float (*qtree_dist_fnc)(void *ptr, float x, float y);
 
-typedef struct _qtree* qtree;
+/// Callback pointer def for overlapping pairs
+typedef void (*qtree_pair_fnc)(void *a, void *b, void *userdata);
 
-/// Simple container for returning found elements
-typedef struct retlist {
-	uint32_t cnt; ///< Number of elements found
-	aabb range;   ///< Range to use for searching
-	void **list;  ///< Array of pointers to found elements
-} retlist;
+/// Id function pointer def for saving trees
+typedef uint32_t (*qtree_id_fnc)(void *ptr, void *userdata);
 
-static void
-retlist_add(retlist *r, void *p) {
-	r->list = realloc(r->list, sizeof(void*)*(r->cnt+1));
-	r->list[r->cnt] = p;
-	r->cnt++;
+#if QTREE_THREADSAFE == 1
+/// Backs off a waiting thread; spins briefly, then yields the CPU
+static inline void
+qrw_relax(unsigned *spins) {
+	if(++(*spins) > 64)
+		sched_yield();
 }
 
-static uint16_t
-qtree_getMaxNodeCnt(qtree q) {
-	uint16_t r;
-	QTLOCK(q->lock);
-	r = q->maxnodecap;
-	QTUNLOCK(q->lock);
-	return r;
+/// Minimal spinlock for short critical sections
+static inline void
+qspin_lock(atomic_flag *f) {
+	unsigned spins = 0;
+	while(atomic_flag_test_and_set_explicit(f, memory_order_acquire))
+		qrw_relax(&spins);
 }
 
-static qnode*
-qnode_new(qtree p, float x, float y, float hW, float hH) {
-	qnode *q = malloc(sizeof(qnode));
-	memset(q, 0, sizeof(qnode));
-	q->bound.center.x = x;
-	q->bound.center.y = y;
-	q->bound.dims.w = hW;
-	q->bound.dims.h = hH;
-
-#if QTREE_THREADSAFE == 1
-	q->lock = (p->newfn)();
-	q->atomlock = (p->newfn)();
-#endif
-	return q;
+static inline void
+qspin_unlock(atomic_flag *f) {
+	atomic_flag_clear_explicit(f, memory_order_release);
 }
 
-static void
-qnode_free(qtree q, qnode *qn) {
-	QTLOCK(qn->lock);
-
-	if(qn->cnt)
-		free(qn->elist);
-
-	qn->cnt = 0;
-
-	if(qn->nw) {
-		qnode_free(q, qn->nw);
-		qnode_free(q, qn->ne);
-		qnode_free(q, qn->sw);
-		qnode_free(q, qn->se);
-	}
-
-	QTUNLOCK(qn->lock);
-	QTFREE(qn->lock);
-	QTFREE(qn->atomlock);
+#if QTREE_LOCK == QTREE_LOCK_PTHREAD
+/// Reader-writer lock on pthreads
+/*!
+  Waiting threads sleep in the kernel instead of spinning. Whether
+  waiting writers hold back new readers is up to the platform.
+*/
+typedef struct qrwlock {
+	pthread_rwlock_t l;
+} qrwlock;
 
-	free(qn);
+static inline void
+qrw_init(qrwlock *l) {
+	pthread_rwlock_init(&l->l, NULL);
 }
 
-#if QTREE_THREADSAFE == 1
-static void
-qnode_set_lock(qtree p, qnode *q) {
-	if(q->lock)
-		(p->freefn)(q->lock);
-	if(q->atomlock)
-		(p->freefn)(q->atomlock);
-
-	q->lock = (p->newfn)();
-	q->atomlock = (p->newfn)();
-
-	if(q->nw) {
-		qnode_set_lock(p, q->nw);
-		qnode_set_lock(p, q->ne);
-		qnode_set_lock(p, q->sw);
-		qnode_set_lock(p, q->se);
-	}
+static inline void
+qrw_destroy(qrwlock *l) {
+	pthread_rwlock_destroy(&l->l);
 }
-#endif
 
-static void
-add(qnode *q, void *p) {
-	q->elist = realloc(q->elist, sizeof(void*)*(q->cnt+1));
-	q->elist[q->cnt] = p;
-	q->cnt++;
+static inline unsigned
+qrw_rdlock(qrwlock *l) {
+	pthread_rwlock_rdlock(&l->l);
+	return 0;
 }
 
-static void
-drop(qnode *q, uint16_t idx) {
-	void **narry = malloc(sizeof(void*)*(q->cnt-1));
-	
-	// This is a little (lot) ugly; a pair of memcpy's would be
-	// better, but I had some problems with it
-	for(uint16_t i=0,skip=0; i<q->cnt; i++) {
-		if(i == idx) { skip++; continue; }
-		narry[i-skip] = q->elist[i];
-	}
-	
-	void **old = q->elist;
-	q->elist = narry;
-	free(old);
-	q->cnt--;
+static inline void
+qrw_rdunlock(qrwlock *l) {
+	pthread_rwlock_unlock(&l->l);
 }
 
-static void
-subdivide(qtree p, qnode *q) {
-	float cx = q->bound.center.x;
-	float cy = q->bound.center.y;
-	float hw = q->bound.dims.w/2;
-	float hh = q->bound.dims.h/2;
+static inline unsigned
+qrw_wrlock(qrwlock *l) {
+	pthread_rwlock_wrlock(&l->l);
+	return 0;
+}
 
-	q->nw = qnode_new(p, cx-hw, cy-hh, hw, hh);
-	q->ne = qnode_new(p, cx+hw, cy-hh, hw, hh);
-	q->sw = qnode_new(p, cx-hw, cy+hh, hw, hh);
-	q->se = qnode_new(p, cx+hw, cy+hh, hw, hh);
+static inline void
+qrw_wrunlock(qrwlock *l) {
+	pthread_rwlock_unlock(&l->l);
 }
+#elif QTREE_LOCK == QTREE_LOCK_ATOMIC
+/// Writer bit of qrwlock.state; the remaining bits count active readers
+#define QRW_WRITER 0x80000000u
 
-#if QTREE_THREADSAFE == 1
-#define ATOM_INCRLOCK(X,Y) _atomic_incrlock(X,Y)
-#define ATOM_DECRLOCK(X,Y) _atomic_decrlock(X,Y)
-#define ATOM_VAL(X,Y) _atomic_val(X,Y)
-#define ATOM_SPIN(W,X,Y,Z) while(_atomic_val(W,X) Y Z) {}
-#define ATOM_WRSPIN(X,Y,Z)							\
-	for(;;) {										\
-		QTLOCK(q->lock);							\
-		if(X Y Z) {									\
-			QTUNLOCK(q->lock);						\
-			break;									\
-		}											\
-		QTUNLOCK(q->lock);							\
-	}												\
+/// Reader-writer lock built on C11 atomics
+/*!
+  Readers only ever touch the reader count, so concurrent queries do
+  not serialize on each other and traverse the tree without any
+  per-node locking. New readers hold back while a writer is waiting,
+  so a steady stream of queries cannot starve inserts and removes.
+*/
+typedef struct qrwlock {
+	atomic_uint state; ///< QRW_WRITER bit plus the active reader count
+	atomic_uint wwait; ///< Number of writers waiting or holding the lock
+} qrwlock;
 
-/// Inline function for code-cleanliness
 static inline void
-_atomic_incrlock(qtree q, qnode *qn) {
-	QTLOCK(qn->atomlock);
-	qn->wrlockval++;
-	QTUNLOCK(qn->atomlock);
+qrw_init(qrwlock *l) {
+	atomic_init(&l->state, 0);
+	atomic_init(&l->wwait, 0);
 }
 
-/// Inline function for code-cleanliness
 static inline void
-_atomic_decrlock(qtree q, qnode *qn) {
-	QTLOCK(qn->atomlock);
-	qn->wrlockval--;
-	QTUNLOCK(qn->atomlock);
+qrw_destroy(qrwlock *l) {
+	(void)l;
 }
 
-/// Lookup function for code-cleanliness
-static int
-_atomic_val(qtree q, qnode *qn) {
-	QTLOCK(qn->atomlock);
-	int r = qn->wrlockval;
-	QTUNLOCK(qn->atomlock);
-	return r;
+/// Takes l shared; returns the number of times it had to wait
+static unsigned
+qrw_rdlock(qrwlock *l) {
+	unsigned spins = 0;
+
+	for(;;) {
+		while(atomic_load_explicit(&l->wwait, memory_order_relaxed))
+			qrw_relax(&spins);
+
+		unsigned s = atomic_fetch_add_explicit(&l->state, 1, memory_order_acquire);
+		if(! (s & QRW_WRITER))
+			return spins;
+
+		// A writer got in first; back out and wait for it
+		atomic_fetch_sub_explicit(&l->state, 1, memory_order_relaxed);
+		qrw_relax(&spins);
+	}
 }
-#else
-#define ATOM_INCRLOCK(X,Y)
-#define ATOM_DECRLOCK(X,Y)
-#define ATOM_VAL(X,Y)
-#define ATOM_SPIN(W,X,Y,Z)
-#define ATOM_WRSPIN(X,Y,Z)
-#endif
 
-static int
-qnode_insert(qtree q, qnode *qn, void *ptr) {
-	QTLOCK(qn->lock);
+static inline void
+qrw_rdunlock(qrwlock *l) {
+	atomic_fetch_sub_explicit(&l->state, 1, memory_order_release);
+}
 
-	ATOM_INCRLOCK(q, qn);
-	ATOM_SPIN(q, qn, !=, 1);
+/// Takes l exclusively; returns the number of times it had to wait
+static unsigned
+qrw_wrlock(qrwlock *l) {
+	unsigned spins = 0;
 
-	QTUNLOCK(qn->lock);
-	
-	int ret = 0;
-	
-	if(! (q->cmpfnc)(ptr, &qn->bound))
-		goto QN_INS_EXIT;
+	atomic_fetch_add_explicit(&l->wwait, 1, memory_order_relaxed);
 
-	if(qn->cnt < qtree_getMaxNodeCnt(q)) {
-		add(qn, ptr);
-		ret = 1;
-		goto QN_INS_EXIT;
+	for(;;) {
+		unsigned z = 0;
+		if(atomic_compare_exchange_weak_explicit(&l->state, &z, QRW_WRITER,
+												 memory_order_acquire,
+												 memory_order_relaxed))
+			return spins;
+		qrw_relax(&spins);
 	}
+}
 
-	if(! qn->nw)
-		subdivide(q, qn);
+static inline void
+qrw_wrunlock(qrwlock *l) {
+	// Readers that raced us may still hold transient counts; keep them
+	atomic_fetch_and_explicit(&l->state, ~QRW_WRITER, memory_order_release);
+	atomic_fetch_sub_explicit(&l->wwait, 1, memory_order_relaxed);
+}
+#endif
 
+/// Memory retired by a snapshot-mode writer, waiting for readers to leave
+typedef struct qretired {
+	void *ptr;      ///< Element list, or sibling block if isblock is set
+	uint64_t epoch; ///< Global epoch when ptr was unlinked
+	int isblock;    ///< ptr is a pool block rather than a malloc'd list
+} qretired;
 
-	ATOM_DECRLOCK(q, qn);
+/// Reader epoch slot, padded to its own cache line
+typedef struct qepoch_slot {
+	atomic_uint_fast64_t e; ///< Epoch the reader entered at; 0 if free
+	char pad[64 - sizeof(atomic_uint_fast64_t)];
+} qepoch_slot;
 
-	if(qnode_insert(q,qn->nw,ptr))
-		return 1;
-	else if(qnode_insert(q,qn->ne,ptr))
-		return 1;
-	else if(qnode_insert(q,qn->sw,ptr))
-		return 1;
-	else if(qnode_insert(q,qn->se,ptr))
-		return 1;
+/// Epoch-based reclamation state for snapshot mode
+/*!
+  A reader claims a slot and publishes the global epoch it started in.
+  Anything a writer unlinks is tagged with the epoch at that time, and
+  the epoch is bumped once the write is done. Tagged memory is only
+  reused once every active reader started in a later epoch, since
+  those readers cannot have seen it.
+*/
+typedef struct qepoch {
+	atomic_uint_fast64_t global;          ///< Current epoch; starts at 1
+	qepoch_slot slot[QTREE_EPOCHSLOTS];   ///< Active reader epochs
+	qretired *list;                       ///< Retired memory, oldest first
+	uint32_t cnt;                         ///< Number of entries in list
+	uint32_t cap;                         ///< Allocated size of list
+	uint32_t pending;                     ///< Entries retired by the current write
+} qepoch;
 
-	return ret;
+/// Registers a snapshot reader; returns the claimed slot
+static int
+qepoch_enter(qepoch *ep) {
+	unsigned spins = 0;
 
-	QN_INS_EXIT:
-	ATOM_DECRLOCK(q, qn);
-	return ret;
-}
+	for(;;) {
+		uint_fast64_t e = atomic_load(&ep->global);
 
-static void* 
-qnode_remove(qtree q, qnode *qn, void *ptr) {
-	QTLOCK(qn->lock);
-
-	ATOM_INCRLOCK(q, qn);
-	ATOM_SPIN(q, qn, !=, 1);
-
-	QTUNLOCK(qn->lock);
-    
-	if(qn->cnt) {
-		for(uint16_t i=0; i<qn->cnt; i++) {
-			if(qn->elist[i] == ptr) {
-				drop(qn, i);
-				ptr = NULL;
-				goto QN_REM_EXIT;
+		for(int i=0; i<QTREE_EPOCHSLOTS; i++) {
+			uint_fast64_t z = 0;
+			if(atomic_load_explicit(&ep->slot[i].e, memory_order_relaxed))
+				continue;
+			if(! atomic_compare_exchange_strong(&ep->slot[i].e, &z, e))
+				continue;
+
+			// Re-check so a writer scanning slots cannot have missed us
+			uint_fast64_t n;
+			while((n = atomic_load(&ep->global)) != e) {
+				e = n;
+				atomic_store(&ep->slot[i].e, e);
 			}
+			return i;
 		}
+
+		// More than QTREE_EPOCHSLOTS readers; wait for one to leave
+		qrw_relax(&spins);
 	}
+}
 
-	ATOM_DECRLOCK(q, qn);
-	
-	if(! qn->nw)
-		return NULL;
+static inline void
+qepoch_exit(qepoch *ep, int slot) {
+	atomic_store_explicit(&ep->slot[slot].e, 0, memory_order_release);
+}
+#endif
 
-	if(qnode_remove(q, qn->nw, ptr)) return ptr;
-	if(qnode_remove(q, qn->ne, ptr)) return ptr;
-	if(qnode_remove(q, qn->sw, ptr)) return ptr;
-	if(qnode_remove(q, qn->se, ptr)) return ptr;
+/*!
+  Define QTREE_STATS to count allocations, compare calls, node visits
+  and lock waits for qtree_get_stats(). Counters are kept per thread,
+  so updating one is a plain load and store on a cache line no other
+  thread writes; without QTREE_STATS they compile to nothing.
+*/
+#ifdef QTREE_STATS
+ #if QTREE_THREADSAFE == 1
+typedef atomic_uint_fast64_t qstat_t;
+ #else
+typedef uint64_t qstat_t;
+ #endif
 
-	return NULL;
+/// One thread's counters, padded to its own cache line
+typedef struct qstatslot {
+	qstat_t allocs;  ///< Heap allocations for tree storage
+	qstat_t cmps;    ///< Compare function calls
+	qstat_t queries; ///< Searches run
+	qstat_t visits;  ///< Nodes searches visited
+	qstat_t spins;   ///< Iterations spent waiting for the tree lock
+	char pad[64 - 5*sizeof(qstat_t)];
+} qstatslot;
 
-	QN_REM_EXIT:
-	ATOM_DECRLOCK(q, qn);
-return ptr;
-}
+ #define QTSTAT(Q,F,N) qstat_add(&qstat_slot(Q)->F, (N))
+#else
+ #define QTSTAT(Q,F,N) ((void)(N))
+#endif
 
-static void
-qnode_getInRange(qtree q, qnode *qn, retlist *r) {
-	QTLOCK(qn->lock);
+/// Child quadrant indices
+enum { QNW = 0, QNE = 1, QSW = 2, QSE = 3 };
 
-	ATOM_DECRLOCK(q, qn);
-	ATOM_SPIN(q, qn, >=, 0);
+/// Element storage of a node
+/*!
+  Allocated as one block: this header, then the pointer array, then
+  the four bound arrays. A snapshot reader that loads the block pointer
+  thus always sees arrays of the size they were allocated with.
 
-	QTUNLOCK(qn->lock);
-    
-	if(qn->cnt) {
-		if(! aabb_intersects(&qn->bound, &r->range))
-			goto QN_GET_EXIT;
+  Each element's bound is kept next to its pointer so that range tests
+  can reject it without calling the compare function or touching the
+  element itself. Bounds are stored as separate min/max arrays so leaf
+  scans can test several elements per instruction. Elements placed by
+  the compare function have an unbounded entry, which every range
+  overlaps.
 
-		for(uint16_t i=0; i<qn->cnt; i++)
-			if((q->cmpfnc)(qn->elist[i], &r->range))
-				retlist_add(r, qn->elist[i]);
-	}
+  Readers look at no more than fill slots, whatever count they paired
+  the block with. In snapshot mode a slot below fill is never written
+  again while the block is reachable; fill only rises, as each slot is
+  completed, and storage that must lose slots is replaced instead.
+*/
+typedef struct qelems {
+	uint32_t cap;  ///< Number of slots in each array
+	uint32_t fill; ///< Number of leading slots readers may look at
+	void **ptr;    ///< Element pointers
+	float *minx;   ///< Element bound left edges
+	float *miny;   ///< Element bound top edges
+	float *maxx;   ///< Element bound right edges
+	float *maxy;   ///< Element bound bottom edges
+	uint32_t *hid; ///< Element handles; 0 if the element has none
+} qelems;
 
-	if(! qn->nw)
-		goto QN_GET_EXIT;
+/// Quadtree node
+typedef struct qnode {
+	uint32_t cnt;         ///< Number of elements in this node
+	uint32_t seq;         ///< Bumped by qnode_collapse() before it unlinks the children
+	uint8_t dirty;        ///< Queued for qtree_maintain()
+	uint16_t depth;       ///< Distance from the root, offset by the root's own depth
+	aabb bound;           ///< Area this node covers
+	qelems *el;           ///< Element storage; NULL until first used
+	struct qnode *child;  ///< Block of four children, indexed by QNW..QSE
+	struct qnode *parent; ///< Parent node; NULL for the root
+} qnode;
 
-	ATOM_INCRLOCK(q, qn);
+/// Element handle table entry
+typedef struct qhslot {
+	qnode *node;  ///< Node holding the element; NULL if the handle is free
+	uint32_t idx; ///< Element slot in node, or the next free handle if free
+} qhslot;
 
-	qnode_getInRange(q, qn->nw, r);
-	qnode_getInRange(q, qn->ne, r);
-	qnode_getInRange(q, qn->sw, r);
-	qnode_getInRange(q, qn->se, r);
+/// Element handle table
+/*!
+  Handle h refers to slot[h-1], so that 0 is never a valid handle.
+  Whenever an element with a handle moves, its entry is updated.
+*/
+typedef struct qhandles {
+	qhslot *slot;      ///< Entries, one per handle ever handed out
+	uint32_t cnt;      ///< Number of entries in use or on the free list
+	uint32_t cap;      ///< Number of entries allocated
+	uint32_t freelist; ///< First free handle; 0 if none
+} qhandles;
 
-	return;
+/// Bound stored for elements inserted through the compare function
+static const aabb qbound_all = { { 0, 0 }, { INFINITY, INFINITY } };
 
-	QN_GET_EXIT:
-	ATOM_INCRLOCK(q, qn);
+/// Checks if box a lies entirely within box o with its half-extents scaled by k
+static inline int
+qbox_inside(const aabb *a, const aabb *o, float k) {
+	return fabsf(a->center.x - o->center.x) + a->dims.w <= o->dims.w*k &&
+		   fabsf(a->center.y - o->center.y) + a->dims.h <= o->dims.h*k;
 }
 
-/* exports */
-
-qtree
-qtree_new(float x, float y, float w, float h, qtree_fnc fnc) {
-	qtree q = malloc(sizeof(_qtree));
-	memset(q, 0, sizeof(_qtree));
-
-#if QTREE_THREADSAFE == 1
-	q->newfn = (void *)_lock_dummy;
-	q->lockfn = _lock_dummy;
-	q->unlockfn = _lock_dummy;
-	q->freefn = _lock_dummy;
-#endif
-	
-	q->maxnodecap = QTREE_STDCAP;
-	q->cmpfnc = fnc;
-	q->root = qnode_new(q, x+(w/2),y+(h/2),w/2,h/2);
+static qelems*
+qelems_new(uint32_t cap) {
+	qelems *e = malloc(sizeof(qelems) +
+					   cap*(sizeof(void*) + 4*sizeof(float) + sizeof(uint32_t)));
+	e->cap = cap;
+	e->fill = 0;
+	e->ptr = (void**)(e+1);
+	e->minx = (float*)(e->ptr + cap);
+	e->miny = e->minx + cap;
+	e->maxx = e->miny + cap;
+	e->maxy = e->maxx + cap;
+	e->hid = (uint32_t*)(e->maxy + cap);
+	return e;
+}
 
-#if QTREE_THREADSAFE == 1
-	q->root->lock = NULL;
-	q->root->atomlock = NULL;
-#endif
-	return q;
+/// Copies the first cnt elements of el into n, which then holds cnt
+static void
+qelems_copy(qelems *n, const qelems *el, uint32_t cnt) {
+	n->fill = cnt;
+	memcpy(n->ptr, el->ptr, sizeof(void*)*cnt);
+	memcpy(n->minx, el->minx, sizeof(float)*cnt);
+	memcpy(n->miny, el->miny, sizeof(float)*cnt);
+	memcpy(n->maxx, el->maxx, sizeof(float)*cnt);
+	memcpy(n->maxy, el->maxy, sizeof(float)*cnt);
+	memcpy(n->hid, el->hid, sizeof(uint32_t)*cnt);
 }
 
-void
-qtree_set_mutex(qtree q, new_mutex_fnc newfn, mutex_fnc lockfn,
-				mutex_fnc unlockfn, mutex_fnc freefn) {
-#if QTREE_THREADSAFE == 1
-	q->newfn = newfn;
-	q->lockfn = lockfn;
-	q->unlockfn = unlockfn;
-	q->freefn = freefn;
+/// Moves element from into slot to within el
+static inline void
+qelems_move(qelems *el, uint32_t to, uint32_t from) {
+	el->ptr[to] = el->ptr[from];
+	el->minx[to] = el->minx[from];
+	el->miny[to] = el->miny[from];
+	el->maxx[to] = el->maxx[from];
+	el->maxy[to] = el->maxy[from];
+	el->hid[to] = el->hid[from];
+}
 
-	q->lock = (newfn)();
+/// Loads qn's storage and stores its count, clamped to the storage's fill, in cnt
+/*!
+  A concurrent snapshot reader may pair the storage with a count from
+  before or after it was replaced; the clamp keeps it to slots that
+  were complete when they were published.
+*/
+static inline qelems*
+qnode_elems(const qnode *qn, uint32_t *cnt) {
+	uint32_t n = QTACQUIRE(qn->cnt);
+	qelems *el = QTACQUIRE(qn->el);
+	uint32_t fill = el ? QTACQUIRE(el->fill) : 0;
+	*cnt = n < fill ? n : fill;
+	return el;
+}
 
-	qnode_set_lock(q, q->root);
-#endif
+/// Loads qn's storage, clamped count and children for a reader
+/*!
+  The children are loaded after the count, so elements a split has
+  just moved down are seen in at least one of the two places. A
+  collapse moves them up instead, and a reader that loaded the count
+  before the elements arrived and the children after they were
+  unlinked would see neither copy, even if a split has linked new
+  children since. The collapse bumps qn->seq in between, so if seq has
+  changed, qn is simply loaded again.
+*/
+static inline qelems*
+qnode_read(const qnode *qn, uint32_t *cnt, qnode **child) {
+	for(;;) {
+		uint32_t seq = QTACQUIRE(qn->seq);
+		qelems *el = qnode_elems(qn, cnt);
+		*child = QTACQUIRE(qn->child);
+		if(QTACQUIRE(qn->seq) == seq)
+			return el;
+	}
 }
 
-void
-qtree_free(qtree q) {
-	void *m;
-	mutex_fnc u, f;
+/// Stores bound b in slot i of el
+static inline void
+qelems_set_bound(qelems *el, uint32_t i, const aabb *b) {
+	el->minx[i] = b->center.x - b->dims.w;
+	el->miny[i] = b->center.y - b->dims.h;
+	el->maxx[i] = b->center.x + b->dims.w;
+	el->maxy[i] = b->center.y + b->dims.h;
+}
 
-	QTLOCK(q->lock);
-#if QTREE_THREADSAFE == 1
-	m = q->lock;
-	u = q->unlockfn;
-	f = q->freefn;
-#endif
-	
-	if(q->root) qnode_free(q, q->root);
-	
-	memset(q, 0, sizeof(_qtree));
+/// Tests n <= 64 bounds given as min/max arrays against rect; returns a bit per overlap
+/*!
+  rect holds the range's min x, min y, max x and max y. Edges count as
+  overlapping, matching aabb_intersects().
+*/
+static uint64_t
+qbounds_scan(const float *x0, const float *y0, const float *x1, const float *y1,
+			 uint32_t n, const float rect[4]) {
+	uint64_t m = 0;
+	uint32_t i = 0;
 
-#if QTREE_THREADSAFE == 1
-	(u)(m);
-	(f)(m);
+#if defined(QTREE_SIMD_AVX512)
+	__m512 rx0 = _mm512_set1_ps(rect[0]), ry0 = _mm512_set1_ps(rect[1]);
+	__m512 rx1 = _mm512_set1_ps(rect[2]), ry1 = _mm512_set1_ps(rect[3]);
+	for(; i+16 <= n; i+=16) {
+		__mmask16 k = _mm512_cmp_ps_mask(_mm512_loadu_ps(x0+i), rx1, _CMP_LE_OQ);
+		k = _mm512_mask_cmp_ps_mask(k, _mm512_loadu_ps(y0+i), ry1, _CMP_LE_OQ);
+		k = _mm512_mask_cmp_ps_mask(k, _mm512_loadu_ps(x1+i), rx0, _CMP_GE_OQ);
+		k = _mm512_mask_cmp_ps_mask(k, _mm512_loadu_ps(y1+i), ry0, _CMP_GE_OQ);
+		m |= (uint64_t)k << i;
+	}
+#elif defined(QTREE_SIMD_AVX)
+	__m256 rx0 = _mm256_set1_ps(rect[0]), ry0 = _mm256_set1_ps(rect[1]);
+	__m256 rx1 = _mm256_set1_ps(rect[2]), ry1 = _mm256_set1_ps(rect[3]);
+	for(; i+8 <= n; i+=8) {
+		__m256 c = _mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(x0+i), rx1, _CMP_LE_OQ),
+						  _mm256_cmp_ps(_mm256_loadu_ps(y0+i), ry1, _CMP_LE_OQ)),
+			_mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(x1+i), rx0, _CMP_GE_OQ),
+						  _mm256_cmp_ps(_mm256_loadu_ps(y1+i), ry0, _CMP_GE_OQ)));
+		m |= (uint64_t)_mm256_movemask_ps(c) << i;
+	}
+#elif defined(QTREE_SIMD_SSE2)
+	__m128 rx0 = _mm_set1_ps(rect[0]), ry0 = _mm_set1_ps(rect[1]);
+	__m128 rx1 = _mm_set1_ps(rect[2]), ry1 = _mm_set1_ps(rect[3]);
+	for(; i+4 <= n; i+=4) {
+		__m128 c = _mm_and_ps(
+			_mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(x0+i), rx1),
+					   _mm_cmple_ps(_mm_loadu_ps(y0+i), ry1)),
+			_mm_and_ps(_mm_cmpge_ps(_mm_loadu_ps(x1+i), rx0),
+					   _mm_cmpge_ps(_mm_loadu_ps(y1+i), ry0)));
+		m |= (uint64_t)_mm_movemask_ps(c) << i;
+	}
+#elif defined(QTREE_SIMD_NEON)
+	static const uint32_t bits[4] = { 1, 2, 4, 8 };
+	uint32x4_t vb = vld1q_u32(bits);
+	float32x4_t rx0 = vdupq_n_f32(rect[0]), ry0 = vdupq_n_f32(rect[1]);
+	float32x4_t rx1 = vdupq_n_f32(rect[2]), ry1 = vdupq_n_f32(rect[3]);
+	for(; i+4 <= n; i+=4) {
+		uint32x4_t c = vandq_u32(
+			vandq_u32(vcleq_f32(vld1q_f32(x0+i), rx1), vcleq_f32(vld1q_f32(y0+i), ry1)),
+			vandq_u32(vcgeq_f32(vld1q_f32(x1+i), rx0), vcgeq_f32(vld1q_f32(y1+i), ry0)));
+		m |= (uint64_t)vaddvq_u32(vandq_u32(c, vb)) << i;
+	}
 #endif
-	
-	free(q);
-}
 
-void
-qtree_insert(qtree q, void *ptr) {
-#if QTREE_THREADSAFE == 1
-	QTLOCK(q->lock);
-	q->wrlockval--;
-	QTUNLOCK(q->lock);
+	for(; i<n; i++)
+		if(x0[i] <= rect[2] && y0[i] <= rect[3] &&
+		   x1[i] >= rect[0] && y1[i] >= rect[1])
+			m |= (uint64_t)1 << i;
 
-	ATOM_WRSPIN(q->wrlockval, <, 0);
-#endif
-    
-	qnode_insert(q, q->root, ptr);
+	return m;
+}
 
-#if QTREE_THREADSAFE == 1
-	QTLOCK(q->lock);
-	q->wrlockval++;
-	QTUNLOCK(q->lock);
-#endif
+/// Tests n <= 64 elements of el from base against rect
+static inline uint64_t
+qelems_scan(const qelems *el, uint32_t base, uint32_t n, const float rect[4]) {
+	return qbounds_scan(el->minx + base, el->miny + base,
+						el->maxx + base, el->maxy + base, n, rect);
 }
 
-void
-qtree_remove(qtree q, void *ptr) {
-#if QTREE_THREADSAFE == 1
-	QTLOCK(q->lock);
-	q->wrlockval--;
-	QTUNLOCK(q->lock);
+/// Chunk of sibling blocks owned by a node pool
+/*!
+  Nodes are always handed out four at a time, since subdivide() always
+  creates all four children together. Element lists stay attached to
+  their slot when a block is recycled, so a reused node does not
+  allocate one again.
+*/
+typedef struct qpool_chunk {
+	struct qpool_chunk *next;       ///< Next chunk in the pool
+	qnode quad[QTREE_POOLCHUNK][4]; ///< Sibling blocks
+} qpool_chunk;
 
-	ATOM_WRSPIN(q->wrlockval, <, 0);
-#endif
-	
-	qnode_remove(q, q->root, ptr);
+/// Node pool
+typedef struct qpool {
+	qpool_chunk *head; ///< First chunk; chunks are never freed until qtree_free()
+	qpool_chunk *cur;  ///< Chunk currently being handed out
+	uint32_t used;     ///< Number of blocks handed out from cur
+	qnode *freelist;   ///< Recycled blocks, linked through [0].child
+} qpool;
 
+/// Quadtree container
+typedef struct _qtree {
+	uint16_t maxnodecap; ///< Maximum element count per node
+	uint8_t maxdepth;    ///< Nodes at this depth are never split
+	float minhalf;       ///< Smallest child half-width or half-height allowed
+	float loose;         ///< Node bound scale for loose placement; 1 when off
+	int defer;           ///< Leave splits and merges to qtree_maintain()
+	int autogrow;        ///< Grow the root to take in elements outside it
+	qnode **dirty;       ///< Nodes queued for qtree_maintain(); may be stale
+	uint32_t ndirty;     ///< Number of entries in dirty
+	uint32_t dirtycap;   ///< Number of entries allocated in dirty
 #if QTREE_THREADSAFE == 1
-	QTLOCK(q->lock);
-	q->wrlockval++;
-	QTUNLOCK(q->lock);
+#if QTREE_LOCK != QTREE_LOCK_HOOKS
+	qrwlock rw;          ///< Reader-writer lock for the whole tree
+	qrwlock wr;          ///< Serializes writers in snapshot mode
 #endif
-}
-
-void
-qtree_setMaxNodeCnt(qtree q, uint16_t cnt) {
-	QTLOCK(q->lock);
-	q->maxnodecap = cnt || 1;
-	QTUNLOCK(q->lock);
-}
+	int snapshot;        ///< Readers use epochs instead of rw
+	qepoch ep;           ///< Snapshot mode reclamation state
+	int par;             ///< A parallel build is running; lock the pool
+	atomic_flag poollock; ///< Guards the pool during parallel builds
+	qtree_task_fnc taskfn; ///< Runs parallel build helpers, if set
+	void *taskud;        ///< User data passed to taskfn
+	uint32_t nworkers;   ///< Number of helpers a parallel build starts
+	void *lock;          ///< Mutex from qtree_set_mutex(), if set
+	mutex_fnc lockfn;    ///< Mutex lock function pointer
+	mutex_fnc unlockfn;  ///< Mutex unlock function pointer
+	mutex_fnc freefn;    ///< Mutex free function pointer
+#endif
+	qpool pool;          ///< Node allocator
+	qhandles hs;         ///< Element handles
+	qnode *root;         ///< Root node
+	qtree_fnc cmpfnc;    ///< Element range compare function pointer
+#ifdef QTREE_STATS
+	qstatslot stats[QTREE_STATSLOTS]; ///< Counters, indexed by thread
+#endif
+} _qtree;
 
-void
-qtree_clear(qtree q) {
-#if QTREE_THREADSAFE == 1
-	QTLOCK(q->lock);
-	q->wrlockval++;
-	QTUNLOCK(q->lock);
+typedef struct _qtree* qtree;
 
-	ATOM_WRSPIN(q->wrlockval, ==, 1);
-#endif
+/// Snapshot of a tree's shape and counters, filled by qtree_get_stats()
+typedef struct qtree_stats {
+	uint32_t nodes;                   ///< Nodes, including the root
+	uint32_t depth;                   ///< Depth of the deepest node; the root is 0
+	uint32_t bydepth[QTREE_STATBINS]; ///< Nodes per depth; the last bin takes deeper ones
+	uint32_t bycnt[QTREE_STATBINS];   ///< Nodes by element count, in powers of two
+	uint32_t leafelems;               ///< Elements held by leaves
+	uint32_t innerelems;              ///< Elements held by nodes with children
+	uint64_t allocs;                  ///< Heap allocations for tree storage
+	uint64_t cmps;                    ///< Compare function calls
+	uint64_t queries;                 ///< Searches run
+	uint64_t visits;                  ///< Nodes searches visited
+	uint64_t spins;                   ///< Iterations spent waiting for the tree lock
+} qtree_stats;
 
-	float x = q->root->bound.center.x;
-	float y = q->root->bound.center.y;
-	float w = q->root->bound.dims.w;
-	float h = q->root->bound.dims.h;
-	qnode *qn = q->root;
-	
-	q->root = qnode_new(q, x, y, w, h);
+#ifdef QTREE_STATS
+/// Returns the calling thread's counter slot in q
+static inline qstatslot*
+qstat_slot(qtree q) {
+ #if QTREE_THREADSAFE == 1
+	static atomic_uint next;
+	static _Thread_local unsigned id;
 
-#if QTREE_THREADSAFE == 1
-	QTLOCK(q->lock);
-	q->wrlockval--;
-	QTUNLOCK(q->lock);
-#endif
+	if(! id)
+		id = atomic_fetch_add_explicit(&next, 1, memory_order_relaxed) + 1;
+	return &q->stats[id % QTREE_STATSLOTS];
+ #else
+	return &q->stats[0];
+ #endif
+}
 
-	qnode_free(q, qn);
+/// Adds n to a counter
+/*!
+  Threads only share a slot once there are more than QTREE_STATSLOTS
+  of them, so a load and a store will do; the odd count may be lost
+  then, but there is no locked instruction on the hot path.
+*/
+static inline void
+qstat_add(qstat_t *c, uint64_t n) {
+ #if QTREE_THREADSAFE == 1
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+						  memory_order_relaxed);
+ #else
+	*c += n;
+ #endif
 }
 
-void**
-qtree_findInArea(qtree q, float x, float y, float w, float h, uint32_t *cnt) {
-#if QTREE_THREADSAFE == 1
-	QTLOCK(q->lock);
-	q->wrlockval--;
-	QTUNLOCK(q->lock);
+static inline void
+qstat_clear(qstat_t *c) {
+ #if QTREE_THREADSAFE == 1
+	atomic_store_explicit(c, 0, memory_order_relaxed);
+ #else
+	*c = 0;
+ #endif
+}
 
-	ATOM_WRSPIN(q->wrlockval, <, 0);
+static inline uint64_t
+qstat_get(qstat_t *c) {
+ #if QTREE_THREADSAFE == 1
+	return atomic_load_explicit(c, memory_order_relaxed);
+ #else
+	return *c;
+ #endif
+}
 #endif
 
-	float hw = w/2;
-	float hh = h/2;
-
-	retlist ret;
-	memset(&ret, 0, sizeof(retlist));
+/// Calls the tree's compare function, counting the call
+#define QTCMP(Q,P,B) (QTSTAT(Q, cmps, 1), ((Q)->cmpfnc)((P), (B)))
 
-	ret.range.center.x = x+hw;
-	ret.range.center.y = y+hh;
-	ret.range.dims.w = hw;
-	ret.range.dims.h = hh;
+typedef uint32_t qhandle;
 
-	qnode_getInRange(q, q->root, &ret);
+/// Query shape kinds
+enum { QSHAPE_CIRCLE, QSHAPE_POLYGON };
 
-#if QTREE_THREADSAFE == 1
-	QTLOCK(q->lock);
-	q->wrlockval++;
-	QTUNLOCK(q->lock);
-#endif
+/// Exact query shape, tested on top of a range search's bounding box
+typedef struct qshape {
+	int kind;         ///< QSHAPE_CIRCLE or QSHAPE_POLYGON
+	float cx, cy, r;  ///< Circle center and radius
+	const float *xy;  ///< Convex polygon vertices as x,y pairs
+	uint32_t n;       ///< Number of polygon vertices
+	float wind;       ///< 1 or -1 by polygon winding, so edge normals face out
+} qshape;
 
-	*cnt = ret.cnt;
-	return ret.list;
+/// Simple container for returning found elements
+typedef struct retlist {
+	uint32_t cnt; ///< Number of elements found
+	uint32_t cap; ///< Number of slots allocated in list
+	int fixed;    ///< If set, list is caller-owned and never grown
+	aabb range;   ///< Range to use for searching
+	float rect[4]; ///< range as min x, min y, max x, max y
+	void **list;  ///< Array of pointers to found elements
+	qtree_visit_fnc visit; ///< If set, called for each element instead of storing it
+	void *ud;     ///< User data passed to visit
+	const qshape *shape; ///< If set, nodes and elements must also touch this
+} retlist;
+
+/// Traversal stack
+/*!
+  Entries live in the fixed array until a traversal outgrows it, and
+  only then move to the heap.
+*/
+typedef struct qstack {
+	qnode **s;     ///< Entries, either fixed or heap allocated
+	uint32_t n;    ///< Number of entries in use
+	uint32_t cap;  ///< Number of entries s can hold
+	qnode *fixed[QTREE_STACKFIXED]; ///< Initial entries
+} qstack;
+
+/// Reusable query context
+/*!
+  Holds a result list whose capacity survives between queries, so
+  queries made through the same context stop allocating once the list
+  has grown to the largest result seen.
+*/
+typedef struct _qquery {
+	retlist r;  ///< Result list reused by every query
+	qstack st;  ///< Traversal stack reused by every query
+} _qquery;
+
+typedef struct _qquery* qquery;
+
+/// Packed tree node bound that halving its parent's does not give back
+/*!
+  A root grown by autogrow keeps the old root's exact bound as its
+  child, which is the only way a node's bound differs from the one
+  subdivide() would give it.
+*/
+typedef struct qpbound {
+	uint32_t node; ///< Node index
+	aabb bound;    ///< The node's bound, before looseness is applied
+} qpbound;
+
+/// Read-only packed quadtree
+/*!
+  Everything lives in the one allocation that holds this header: the
+  element pointers, their bounds as min/max arrays, and the node table,
+  each node's elements being one contiguous run.
+
+  Nodes are numbered breadth-first, so each level is contiguous and,
+  within it, sibling blocks follow each other in Z order. The table
+  stores no child links and no bounds. A node's children are the four
+  consecutive nodes starting at 1 + 4*k, k being the number of nodes
+  with children before it, which inner and rank give with a popcount.
+  Bounds are derived while descending from the root's, one Z-order
+  digit per level, the same way subdivide() derives them, so a node
+  takes a 32-bit element offset and a bit. The few nodes for which
+  that does not hold are listed in exact.
+*/
+typedef struct _qpack {
+	aabb bound;       ///< Root node bound
+	float loose;      ///< Node bound scale of the source tree
+	qtree_fnc cmpfnc; ///< Element range compare function pointer
+	uint32_t nnodes;  ///< Number of nodes
+	uint32_t nelems;  ///< Number of elements
+	uint32_t nexact;  ///< Number of entries in exact
+	const uint32_t *first; ///< Node i's elements are first[i] up to first[i+1]; nnodes+1 entries
+	const uint32_t *inner; ///< One bit per node, set if it has children, 32 nodes a word
+	const uint32_t *rank;  ///< Number of bits set in inner before each word
+	const qpbound *exact;  ///< Nodes with a bound of their own, by index
+	void **ptr;       ///< Element pointers; NULL if mapped from a file
+	const uint32_t *id; ///< Element ids, if mapped from a file
+	void **base;      ///< Array the ids index into; NULL to return the ids
+	const float *minx; ///< Element bound left edges
+	const float *miny; ///< Element bound top edges
+	const float *maxx; ///< Element bound right edges
+	const float *maxy; ///< Element bound bottom edges
+	void *map;        ///< File mapping, if mapped from a file
+	size_t maplen;    ///< Length of map
+} _qpack;
+
+/// Header of a saved packed tree
+/*!
+  Followed by the element ids, the four bound arrays, the element
+  offsets, the inner bits, the rank words and the exact bounds, in
+  that order, each as it is laid out in memory. Everything is at a
+  fixed position given the counts, and nodes refer to each other and to
+  elements by index, so the file can be searched straight from a
+  read-only mapping. Values are in the byte order of the machine that
+  wrote the file.
+*/
+typedef struct qpfile {
+	char magic[4];   ///< QTREE_FILEMAGIC
+	uint32_t version; ///< QTREE_FILEVERSION
+	aabb bound;      ///< Root node bound
+	float loose;     ///< Node bound scale
+	uint32_t nnodes; ///< Number of nodes
+	uint32_t nelems; ///< Number of elements
+	uint32_t nexact; ///< Number of nodes with a bound of their own
+} qpfile;
+
+typedef struct _qpack* qpack;
+
+/// Point tree node
+/*!
+  Only leaves hold points. A leaf's pointers and coordinates share one
+  allocation: cap pointers, then cap x,y pairs, stored as floats or, in
+  a quantized tree, as 16-bit offsets into the leaf's bound.
+*/
+typedef struct qptnode {
+	float x, y;              ///< Top-left corner
+	float w, h;              ///< Width and height
+	uint32_t cnt;            ///< Number of points
+	uint32_t cap;            ///< Number of points allocated
+	void **ptr;              ///< Points, followed by their coordinates
+	struct qptnode *child;   ///< Four children in QNW..QSE order; NULL for a leaf
+	struct qptnode *parent;  ///< Parent node; NULL for the root
+	uint16_t depth;          ///< Distance from the root
+} qptnode;
+
+/// Quadtree of points
+typedef struct _qptree {
+#if QTREE_THREADSAFE == 1 && QTREE_LOCK != QTREE_LOCK_HOOKS
+	qrwlock rw;    ///< Reader-writer lock for the whole tree
+#endif
+	int quant;     ///< Coordinates are stored as 16-bit offsets
+	qptnode root;  ///< Root node
+} _qptree;
+
+typedef struct _qptree* qptree;
+
+/// Records a found element; returns nonzero if the search should stop
+static int
+retlist_add(retlist *r, void *p) {
+	if(r->visit) {
+		r->cnt++;
+		return (r->visit)(p, r->ud);
+	}
+
+	if(r->cnt >= r->cap) {
+		if(r->fixed) {
+			r->cnt++;
+			return 0;
+		}
+		r->cap = r->cap ? r->cap*2 : 16;
+		r->list = realloc(r->list, sizeof(void*)*r->cap);
+	}
+	r->list[r->cnt] = p;
+	r->cnt++;
+	return 0;
+}
+
+static inline void
+qstack_init(qstack *st) {
+	st->s = st->fixed;
+	st->n = 0;
+	st->cap = QTREE_STACKFIXED;
+}
+
+static void
+qstack_grow(qstack *st) {
+	st->cap *= 2;
+	if(st->s == st->fixed) {
+		st->s = malloc(sizeof(qnode*)*st->cap);
+		memcpy(st->s, st->fixed, sizeof(st->fixed));
+	} else {
+		st->s = realloc(st->s, sizeof(qnode*)*st->cap);
+	}
+}
+
+static inline void
+qstack_push(qstack *st, qnode *n) {
+	if(st->n == st->cap)
+		qstack_grow(st);
+	st->s[st->n++] = n;
+}
+
+static inline void
+qstack_free(qstack *st) {
+	if(st->s != st->fixed)
+		free(st->s);
+}
+
+/// Visitor for qtree_anyInArea(); stops at the first element
+static int
+_visit_stop(void *ptr, void *userdata) {
+	(void)ptr;
+	(void)userdata;
+	return 1;
+}
+
+static void
+retlist_set_range(retlist *r, float x, float y, float w, float h) {
+	float hw = w/2;
+	float hh = h/2;
+
+	r->cnt = 0;
+	r->range.center.x = x+hw;
+	r->range.center.y = y+hh;
+	r->range.dims.w = hw;
+	r->range.dims.h = hh;
+
+	r->rect[0] = x;
+	r->rect[1] = y;
+	r->rect[2] = x+w;
+	r->rect[3] = y+h;
+
+	r->shape = NULL;
+}
+
+/// Checks if the box with the given min and max corners touches shape sh
+/*!
+  A polygon is tested by separating axes: the box misses it if it lies
+  entirely outside any edge. The box's own axes are covered by the
+  range search's bounding box.
+*/
+static int
+qshape_box(const qshape *sh, float x0, float y0, float x1, float y1) {
+	if(sh->kind == QSHAPE_CIRCLE) {
+		float dx = fmaxf(fmaxf(x0 - sh->cx, sh->cx - x1), 0);
+		float dy = fmaxf(fmaxf(y0 - sh->cy, sh->cy - y1), 0);
+		return dx*dx + dy*dy <= sh->r*sh->r;
+	}
+
+	for(uint32_t i=0; i<sh->n; i++) {
+		const float *a = sh->xy + 2*i;
+		const float *b = sh->xy + 2*((i+1) % sh->n);
+		float nx = (b[1] - a[1])*sh->wind;
+		float ny = (a[0] - b[0])*sh->wind;
+
+		// Box corner furthest along -n
+		float px = nx > 0 ? x0 : x1;
+		float py = ny > 0 ? y0 : y1;
+		if(nx*(px - a[0]) + ny*(py - a[1]) > 0)
+			return 0;
+	}
+	return 1;
+}
+
+/// Sets up r to search the circle of radius rad around x,y
+static void
+retlist_set_circle(retlist *r, qshape *sh, float x, float y, float rad) {
+	retlist_set_range(r, x-rad, y-rad, 2*rad, 2*rad);
+	sh->kind = QSHAPE_CIRCLE;
+	sh->cx = x;
+	sh->cy = y;
+	sh->r = rad;
+	r->shape = sh;
+}
+
+/// Sets up r to search the convex polygon with n vertices xy
+static void
+retlist_set_polygon(retlist *r, qshape *sh, const float *xy, uint32_t n) {
+	float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+	float area = 0;
+
+	for(uint32_t i=0; i<n; i++) {
+		const float *a = xy + 2*i;
+		const float *b = xy + 2*((i+1) % n);
+		x0 = fminf(x0, a[0]);
+		y0 = fminf(y0, a[1]);
+		x1 = fmaxf(x1, a[0]);
+		y1 = fmaxf(y1, a[1]);
+		area += a[0]*b[1] - b[0]*a[1];
+	}
+
+	retlist_set_range(r, x0, y0, x1-x0, y1-y0);
+	sh->kind = QSHAPE_POLYGON;
+	sh->xy = xy;
+	sh->n = n;
+	sh->wind = area < 0 ? -1 : 1;
+	r->shape = sh;
+}
+
+/// Hands out a block of four zero-count sibling nodes from the pool
+static qnode*
+qpool_alloc(qtree q) {
+	qpool *pl = &q->pool;
+	qnode *b;
+
+	QTPOOLLOCK(q);
+
+	if(pl->freelist) {
+		b = pl->freelist;
+		pl->freelist = b[0].child;
+	} else {
+		if(! pl->cur || pl->used == QTREE_POOLCHUNK) {
+			if(pl->cur && pl->cur->next) {
+				pl->cur = pl->cur->next;
+			} else {
+				qpool_chunk *c = calloc(1, sizeof(qpool_chunk));
+				QTSTAT(q, allocs, 1);
+				if(pl->cur)
+					pl->cur->next = c;
+				else
+					pl->head = c;
+				pl->cur = c;
+			}
+			pl->used = 0;
+		}
+		b = pl->cur->quad[pl->used++];
+	}
+
+	QTPOOLUNLOCK(q);
+
+	for(int i=0; i<4; i++) {
+		b[i].cnt = 0;
+		b[i].dirty = 0;
+		b[i].child = NULL;
+		if(b[i].el)
+			b[i].el->fill = 0;
+	}
+
+	return b;
+}
+
+/// Returns a single sibling block to the pool's free list
+static inline void
+qpool_release(qtree q, qnode *b) {
+	b[0].child = q->pool.freelist;
+	q->pool.freelist = b;
+}
+
+#if QTREE_THREADSAFE == 1
+/// Defers freeing ptr until no snapshot reader can still see it
+static void
+qepoch_retire(qtree q, void *ptr, int isblock) {
+	qepoch *ep = &q->ep;
+
+	QTPOOLLOCK(q);
+
+	if(ep->cnt == ep->cap) {
+		ep->cap = ep->cap ? ep->cap*2 : 64;
+		ep->list = realloc(ep->list, sizeof(qretired)*ep->cap);
+		QTSTAT(q, allocs, 1);
+	}
+
+	ep->list[ep->cnt].ptr = ptr;
+	ep->list[ep->cnt].epoch = atomic_load_explicit(&ep->global, memory_order_relaxed);
+	ep->list[ep->cnt].isblock = isblock;
+	ep->cnt++;
+	ep->pending++;
+
+	QTPOOLUNLOCK(q);
+}
+
+/// Ends a snapshot-mode write; frees whatever no reader can still see
+static void
+qepoch_reclaim(qtree q) {
+	qepoch *ep = &q->ep;
+
+	if(ep->pending) {
+		atomic_fetch_add(&ep->global, 1);
+		ep->pending = 0;
+	}
+
+	if(! ep->cnt)
+		return;
+
+	uint_fast64_t min = UINT64_MAX;
+	for(int i=0; i<QTREE_EPOCHSLOTS; i++) {
+		uint_fast64_t e = atomic_load(&ep->slot[i].e);
+		if(e && e < min)
+			min = e;
+	}
+
+	uint32_t i = 0;
+	for(; i<ep->cnt && ep->list[i].epoch < min; i++) {
+		if(ep->list[i].isblock)
+			qpool_release(q, ep->list[i].ptr);
+		else
+			free(ep->list[i].ptr);
+	}
+
+	if(i) {
+		ep->cnt -= i;
+		memmove(ep->list, ep->list+i, sizeof(qretired)*ep->cnt);
+	}
+}
+
+/// Retires every block of the subtree below and including block b
+static void
+qepoch_retire_tree(qtree q, qnode *b) {
+	qstack st;
+	qstack_init(&st);
+	qstack_push(&st, b);
+
+	while(st.n) {
+		b = st.s[--st.n];
+		for(int i=0; i<4; i++)
+			if(b[i].child)
+				qstack_push(&st, b[i].child);
+		qepoch_retire(q, b, 1);
+	}
+
+	qstack_free(&st);
+}
+
+#if QTREE_LOCK == QTREE_LOCK_HOOKS
+/*
+  With only the user's mutex to go on, queries take it too, so they are
+  serialized like writers unless the tree is in snapshot mode.
+*/
+static inline int
+qtree_rdlock(qtree q) {
+	if(q->snapshot)
+		return qepoch_enter(&q->ep);
+	QTLOCK(q);
+	return -1;
+}
+
+static inline void
+qtree_rdunlock(qtree q, int slot) {
+	if(slot >= 0)
+		qepoch_exit(&q->ep, slot);
+	else
+		QTUNLOCK(q);
+}
+
+static inline void
+qtree_wrlock(qtree q) {
+	QTLOCK(q);
+}
+
+static inline void
+qtree_wrunlock(qtree q) {
+	if(q->snapshot)
+		qepoch_reclaim(q);
+	QTUNLOCK(q);
+}
+#else
+static inline int
+qtree_rdlock(qtree q) {
+	if(q->snapshot)
+		return qepoch_enter(&q->ep);
+	QTSTAT(q, spins, qrw_rdlock(&q->rw));
+	return -1;
+}
+
+static inline void
+qtree_rdunlock(qtree q, int slot) {
+	if(slot >= 0)
+		qepoch_exit(&q->ep, slot);
+	else
+		qrw_rdunlock(&q->rw);
+}
+
+static inline void
+qtree_wrlock(qtree q) {
+	QTLOCK(q);
+	QTSTAT(q, spins, qrw_wrlock(q->snapshot ? &q->wr : &q->rw));
+}
+
+static inline void
+qtree_wrunlock(qtree q) {
+	if(q->snapshot) {
+		qepoch_reclaim(q);
+		qrw_wrunlock(&q->wr);
+	} else {
+		qrw_wrunlock(&q->rw);
+	}
+	QTUNLOCK(q);
+}
+#endif
+#endif
+
+/// Marks every block in the pool as unused, without touching the chunks
+static void
+qpool_reset(qtree q) {
+	q->pool.cur = q->pool.head;
+	q->pool.used = 0;
+	q->pool.freelist = NULL;
+}
+
+/// Frees all chunks, along with any element lists they hold
+static void
+qpool_free(qtree q) {
+	qpool_chunk *c = q->pool.head;
+
+	while(c) {
+		qpool_chunk *n = c->next;
+		for(uint32_t i=0; i<QTREE_POOLCHUNK; i++) {
+			for(int j=0; j<4; j++)
+				free(c->quad[i][j].el);
+		}
+		free(c);
+		c = n;
+	}
+
+	memset(&q->pool, 0, sizeof(qpool));
+}
+
+static void
+qnode_set_bound(qnode *q, float x, float y, float hW, float hH) {
+	q->bound.center.x = x;
+	q->bound.center.y = y;
+	q->bound.dims.w = hW;
+	q->bound.dims.h = hH;
+}
+
+/// Allocates a fresh root node covering the given bound
+static qnode*
+qnode_new_root(qtree p, float x, float y, float hW, float hH) {
+	qnode *q = qpool_alloc(p);
+	qnode_set_bound(q, x, y, hW, hH);
+	q->parent = NULL;
+	q->depth = 0;
+	return q;
+}
+
+/// Hands out an unused element handle
+static uint32_t
+qhandle_new(qtree q) {
+	qhandles *hs = &q->hs;
+	uint32_t h = hs->freelist;
+
+	if(h) {
+		hs->freelist = hs->slot[h-1].idx;
+		return h;
+	}
+
+	if(hs->cnt == hs->cap) {
+		hs->cap = hs->cap ? hs->cap*2 : 64;
+		hs->slot = realloc(hs->slot, sizeof(qhslot)*hs->cap);
+		QTSTAT(q, allocs, 1);
+	}
+	hs->slot[hs->cnt].node = NULL;
+	return ++hs->cnt;
+}
+
+/// Records that the element with handle h now sits in slot idx of n
+static inline void
+qhandle_set(qtree q, uint32_t h, qnode *n, uint32_t idx) {
+	q->hs.slot[h-1].node = n;
+	q->hs.slot[h-1].idx = idx;
+}
+
+/// Looks up the entry for handle h; NULL if h was never handed out or is free
+static inline qhslot*
+qhandle_get(qtree q, uint32_t h) {
+	if(! h || h > q->hs.cnt || ! q->hs.slot[h-1].node)
+		return NULL;
+	return &q->hs.slot[h-1];
+}
+
+/// Puts handle h back on the free list
+static void
+qhandle_release(qtree q, uint32_t h) {
+	qhslot *s = &q->hs.slot[h-1];
+	s->node = NULL;
+	s->idx = q->hs.freelist;
+	q->hs.freelist = h;
+}
+
+/// Frees element storage that has been unlinked from its node
+static void
+qelems_free(qtree t, qelems *el) {
+	if(! el)
+		return;
+#if QTREE_THREADSAFE == 1
+	if(QTSNAPSHOT(t)) {
+		qepoch_retire(t, el, 0);
+		return;
+	}
+#else
+	(void)t;
+#endif
+	free(el);
+}
+
+/// Makes room for one more element in a node and returns its storage
+/*!
+  Element storage is sized to cap on first use and kept with the
+  node's pool slot, so it is only replaced when the tree's maxnodecap
+  has been raised past what the slot last held, or when a node that
+  cannot pass an element down grows past the cap.
+
+  Storage that has to grow is copied, and the old block retired in
+  snapshot mode rather than freed under a concurrent reader. In
+  snapshot mode storage is also copied when the slot past the end was
+  once published, since a reader holding an older count may still be
+  looking at it.
+*/
+static qelems*
+grow(qtree t, qnode *q, uint32_t cap) {
+	qelems *el = q->el;
+
+	if(! el || el->cap <= q->cnt || el->cap < cap ||
+	   (QTSNAPSHOT(t) && el->fill > q->cnt)) {
+		uint32_t ncap = el ? el->cap*2 : cap;
+		if(ncap < cap)
+			ncap = cap;
+
+		qelems *n = qelems_new(ncap);
+		QTSTAT(t, allocs, 1);
+		if(q->cnt)
+			qelems_copy(n, el, q->cnt);
+
+		QTPUBLISH(q->el, n);
+		qelems_free(t, el);
+		el = n;
+	}
+
+	return el;
+}
+
+/// Publishes element p with handle h in the slot past the end of q
+/*!
+  The slot's bound must already be written, and el must come from
+  grow(), so the slot lies at or past el's fill. The slot is filled in
+  before fill and cnt are published, so a concurrent snapshot reader
+  never sees a half-written entry.
+*/
+static inline void
+publish(qtree t, qnode *q, qelems *el, void *p, uint32_t h) {
+	el->hid[q->cnt] = h;
+	if(h)
+		qhandle_set(t, h, q, q->cnt);
+	QTPUBLISH(el->ptr[q->cnt], p);
+	QTPUBLISH(el->fill, q->cnt+1);
+	QTPUBLISH(q->cnt, q->cnt+1);
+}
+
+/// Appends an element and its bound to a node
+/*!
+  h is the element's handle, or 0 if it has none.
+*/
+static void
+add(qtree t, qnode *q, void *p, const aabb *b, uint32_t h, uint32_t cap) {
+	qelems *el = grow(t, q, cap);
+	qelems_set_bound(el, q->cnt, b);
+	publish(t, q, el, p, h);
+}
+
+/// Removes the element at idx by moving the last element into its slot
+/*!
+  The moved element's handle is updated; the removed element's handle,
+  if any, is left for the caller to release.
+
+  In snapshot mode the storage is instead rebuilt without the element
+  and published whole. Its fill is the new count, so a reader that
+  pairs it with the old count still stops at the new end.
+*/
+static void
+drop(qtree t, qnode *q, uint32_t idx) {
+	qelems *el = q->el;
+	uint32_t last = q->cnt-1;
+
+	if(idx != last && el->hid[last])
+		qhandle_set(t, el->hid[last], q, idx);
+
+	if(QTSNAPSHOT(t)) {
+#if QTREE_THREADSAFE == 1
+		qelems *n = qelems_new(el->cap);
+		QTSTAT(t, allocs, 1);
+		qelems_copy(n, el, q->cnt);
+		qelems_move(n, idx, last);
+		n->fill = last;
+		QTPUBLISH(q->el, n);
+		qelems_free(t, el);
+#endif
+	} else {
+		qelems_move(el, idx, last);
+		el->fill = last;
+	}
+	QTPUBLISH(q->cnt, last);
+}
+
+/// Checks if qn is allowed to have children under the tree's limits
+static inline int
+qnode_can_split(qtree t, const qnode *qn) {
+	return (uint16_t)(qn->depth - t->root->depth) < t->maxdepth &&
+		   qn->bound.dims.w/2 >= t->minhalf &&
+		   qn->bound.dims.h/2 >= t->minhalf;
+}
+
+static void
+subdivide(qtree p, qnode *q) {
+	float cx = q->bound.center.x;
+	float cy = q->bound.center.y;
+	float hw = q->bound.dims.w/2;
+	float hh = q->bound.dims.h/2;
+
+	qnode *c = qpool_alloc(p);
+
+	qnode_set_bound(&c[QNW], cx-hw, cy-hh, hw, hh);
+	qnode_set_bound(&c[QNE], cx+hw, cy-hh, hw, hh);
+	qnode_set_bound(&c[QSW], cx-hw, cy+hh, hw, hh);
+	qnode_set_bound(&c[QSE], cx+hw, cy+hh, hw, hh);
+	for(int i=QNW; i<=QSE; i++) {
+		c[i].parent = q;
+		c[i].depth = q->depth+1;
+	}
+
+	QTPUBLISH(q->child, c);
+}
+
+/// Returns a sibling block that has been unlinked from its parent to the pool
+/*!
+  The nodes' dirty flags are cleared, so any entries for them left in
+  the maintenance queue are skipped.
+*/
+static void
+qblock_free(qtree t, qnode *b) {
+	for(int i=QNW; i<=QSE; i++)
+		b[i].dirty = 0;
+#if QTREE_THREADSAFE == 1
+	if(QTSNAPSHOT(t)) {
+		qepoch_retire(t, b, 1);
+		return;
+	}
+#endif
+	qpool_release(t, b);
+}
+
+/// Folds childless children back into their parent after a removal from qn
+/*!
+  Starting at qn and moving up, a node whose children have no children
+  of their own and whose subtree holds fewer than maxnodecap elements
+  takes its children's elements and gives the block back to the pool.
+  A subtree is only split once it holds more than maxnodecap elements,
+  so collapsing below it leaves some room before the next split.
+
+  The elements are added to the parent before the children are
+  unlinked, and the parent's seq is bumped in between, so that a
+  concurrent snapshot reader either finds them in the parent or reads
+  it again; see qnode_read(). It may see one twice but never misses it.
+*/
+static void
+qnode_collapse(qtree q, qnode *qn) {
+	for(; qn; qn = qn->parent) {
+		qnode *c = qn->child;
+		if(! c)
+			continue;
+
+		uint32_t total = qn->cnt;
+		for(int i=QNW; i<=QSE; i++) {
+			if(c[i].child)
+				return;
+			total += c[i].cnt;
+		}
+		if(total >= q->maxnodecap)
+			return;
+
+		for(int i=QNW; i<=QSE; i++) {
+			const qelems *from = c[i].el;
+			for(uint32_t j=0; j<c[i].cnt; j++) {
+				qelems *el = grow(q, qn, q->maxnodecap);
+				el->minx[qn->cnt] = from->minx[j];
+				el->miny[qn->cnt] = from->miny[j];
+				el->maxx[qn->cnt] = from->maxx[j];
+				el->maxy[qn->cnt] = from->maxy[j];
+				publish(q, qn, el, from->ptr[j], from->hid[j]);
+			}
+		}
+
+		QTPUBLISH(qn->seq, qn->seq+1);
+		QTPUBLISH(qn->child, NULL);
+		qblock_free(q, c);
+	}
+}
+
+/// Queues qn for qtree_maintain(), unless it already is
+static void
+qnode_mark(qtree q, qnode *qn) {
+	if(qn->dirty)
+		return;
+
+	if(q->ndirty == q->dirtycap) {
+		q->dirtycap = q->dirtycap ? q->dirtycap*2 : 64;
+		q->dirty = realloc(q->dirty, sizeof(qnode*)*q->dirtycap);
+		QTSTAT(q, allocs, 1);
+	}
+	q->dirty[q->ndirty++] = qn;
+	qn->dirty = 1;
+}
+
+/// Tidies up after an element was removed from qn
+static inline void
+qnode_removed(qtree q, qnode *qn) {
+	if(q->defer)
+		qnode_mark(q, qn);
+	else
+		qnode_collapse(q, qn);
+}
+
+/// Inserts an element placed by the compare function
+/*!
+  Walks down from qn, filling the first node on the way that has room,
+  into the first child that accepts the element at each level, the
+  same way qnode_insert_batch() assigns children. The compare function
+  is all that is known about the element, so children are tried in
+  QNW..QSE order rather than picked directly.
+
+  Returns 0 if qn, or every child at some level, rejects the element.
+*/
+static int
+qnode_insert(qtree q, qnode *qn, void *ptr) {
+	if(! QTCMP(q, ptr, &qn->bound))
+		return 0;
+
+	for(;;) {
+		if(qn->cnt < q->maxnodecap)
+			break;
+
+		if(! qn->child) {
+			if(! qnode_can_split(q, qn))
+				break;
+			if(q->defer) {
+				qnode_mark(q, qn);
+				break;
+			}
+			subdivide(q, qn);
+		}
+
+		int c = QNW;
+		while(c <= QSE && ! QTCMP(q, ptr, &qn->child[c].bound))
+			c++;
+		if(c > QSE)
+			return 0;
+
+		qn = &qn->child[c];
+	}
+
+	add(q, qn, ptr, &qbound_all, 0, q->maxnodecap);
+	return 1;
+}
+
+struct qbuild;
+
+static void qnode_push_down(qtree q, qnode *qn, uint32_t from);
+
+#if QTREE_THREADSAFE == 1
+/// A slice of a batch waiting to be built into the subtree at qn
+/*!
+  items and tmp are arrays of element pointers, or of uint32_t indices
+  into the build's ptrs and bounds if it has bounds.
+*/
+typedef struct qtask {
+	qnode *qn;     ///< Subtree root
+	void *items;   ///< Elements to insert
+	void *tmp;     ///< Scratch space, as long as items
+	uint8_t *bk;   ///< Scratch child indices, as long as items
+	uint32_t n;    ///< Number of elements
+} qtask;
+
+static int qbuild_push(struct qbuild *b, int id, qnode *qn, void *items,
+					   void *tmp, uint8_t *bk, uint32_t n);
+#endif
+
+/// Makes room for n more elements in q; returns its storage
+/*!
+  New storage is sized to exactly what q then holds, so a node built
+  from a batch is allocated once, and the many small leaves of a batch
+  take no more memory than they need.
+*/
+static qelems*
+reserve(qtree t, qnode *q, uint32_t n) {
+	return grow(t, q, q->cnt + n);
+}
+
+/// Publishes the n elements written past the end of q in one go
+/*!
+  The slots come from reserve(), as for publish(), and their pointers
+  and bounds must already be written. Batches carry no handles.
+*/
+static inline void
+publish_many(qnode *q, qelems *el, uint32_t n) {
+	for(uint32_t j=0; j<n; j++)
+		el->hid[q->cnt+j] = 0;
+	QTPUBLISH(el->fill, q->cnt+n);
+	QTPUBLISH(q->cnt, q->cnt+n);
+}
+
+/// Appends n elements placed by the compare function to q
+static void
+add_ptrs(qtree t, qnode *q, void **items, uint32_t n) {
+	qelems *el = reserve(t, q, n);
+
+	for(uint32_t j=0; j<n; j++) {
+		el->ptr[q->cnt+j] = items[j];
+		qelems_set_bound(el, q->cnt+j, &qbound_all);
+	}
+	publish_many(q, el, n);
+}
+
+/// Appends the n elements of ptrs and bounds that idx picks to q
+static void
+add_idx(qtree t, qnode *q, void **ptrs, const aabb *bounds,
+		const uint32_t *idx, uint32_t n) {
+	qelems *el = reserve(t, q, n);
+
+	for(uint32_t j=0; j<n; j++) {
+		el->ptr[q->cnt+j] = ptrs[idx[j]];
+		qelems_set_bound(el, q->cnt+j, &bounds[idx[j]]);
+	}
+	publish_many(q, el, n);
+}
+
+/// Inserts n elements, all accepted by qn, into the subtree at qn
+/*!
+  Builds top-down. A leaf takes the whole batch if it stays within the
+  cap, or if the leaf cannot split. Otherwise the leaf is split, and
+  the batch is partitioned in one pass among the children, each element
+  going to the first child that accepts it; each child is then built
+  from its own slice. Elements no child accepts are dropped, as
+  qnode_insert() drops them. A node that already has children passes
+  the whole batch down. The elements already in a node stay where they
+  are, except that a loose tree pushes them down on a split, as
+  qnode_place() does.
+
+  Built into an empty tree, the shape of the tree then depends only on
+  the elements, not on their order, and it need not be the shape that
+  inserting them one at a time would give.
+
+  items and tmp are both n long; their roles swap at every level, and
+  bk holds the child each element was sorted into.
+
+  If b is set, this runs as worker id of a parallel build, and large
+  child slices are queued for any worker to pick up instead of being
+  built here.
+*/
+static uint32_t
+qnode_insert_batch(qtree q, qnode *qn, void **items, void **tmp,
+				   uint8_t *bk, uint32_t n, struct qbuild *b, int id) {
+	uint32_t ins = 0;
+	uint32_t off[7] = {0};
+
+	if(! qn->child) {
+		if(qn->cnt + n <= q->maxnodecap || ! qnode_can_split(q, qn)) {
+			add_ptrs(q, qn, items, n);
+			return n;
+		}
+		subdivide(q, qn);
+		if(q->loose > 1)
+			qnode_push_down(q, qn, 0);
+	}
+
+	for(uint32_t i=0; i<n; i++) {
+		int c = QNW;
+		while(c <= QSE && ! QTCMP(q, items[i], &qn->child[c].bound))
+			c++;
+		bk[i] = c;
+		off[c+2]++;
+	}
+
+	// off[c+1] becomes the start of child c's slice; index 4 collects
+	// elements no child accepted, which are dropped
+	for(int c=2; c<7; c++)
+		off[c] += off[c-1];
+
+	for(uint32_t i=0; i<n; i++)
+		tmp[off[bk[i]+1]++] = items[i];
+
+	for(int c=QNW; c<=QSE; c++) {
+		uint32_t start = off[c];
+		uint32_t len = off[c+1] - start;
+		if(! len)
+			continue;
+#if QTREE_THREADSAFE == 1
+		if(b && len >= QTREE_PARGRAIN &&
+		   qbuild_push(b, id, &qn->child[c], tmp+start, items+start, bk+start, len))
+			continue;
+#endif
+		ins += qnode_insert_batch(q, &qn->child[c], tmp+start,
+								  items+start, bk+start, len, b, id);
+	}
+
+	return ins;
+}
+
+/// Inserts n elements with known bounds, all inside qn, into the subtree at qn
+/*!
+  Works as qnode_insert_batch() does, but sorts each element by its
+  bound alone, as qnode_place() does: into the child quadrant holding
+  its center if it fits that child, and otherwise into qn itself. The
+  compare function is never called.
+
+  Rather than the elements themselves, items holds their indices into
+  ptrs and bounds, so that the boxes are not copied at every level.
+
+  In a loose tree this is where inserting the elements one at a time
+  would put them, in the same order.
+*/
+static uint32_t
+qnode_insert_aabb_batch(qtree q, qnode *qn, void **ptrs, const aabb *bounds,
+						uint32_t *items, uint32_t *tmp, uint8_t *bk, uint32_t n,
+						struct qbuild *b, int id) {
+	uint32_t ins = 0;
+	uint32_t off[7] = {0};
+
+	if(! qn->child) {
+		if(qn->cnt + n <= q->maxnodecap || ! qnode_can_split(q, qn)) {
+			add_idx(q, qn, ptrs, bounds, items, n);
+			return n;
+		}
+		subdivide(q, qn);
+		if(q->loose > 1)
+			qnode_push_down(q, qn, 0);
+	}
+
+	// Read through locals: the stores to bk may alias anything
+	float cx = qn->bound.center.x, cy = qn->bound.center.y;
+	float k = q->loose;
+	aabb cb[4];
+	uint32_t cnt[5] = {0};
+	for(int c=QNW; c<=QSE; c++)
+		cb[c] = qn->child[c].bound;
+
+	for(uint32_t i=0; i<n; i++) {
+		aabb e = bounds[items[i]];
+		int c = (e.center.x >= cx) | ((e.center.y >= cy) << 1);
+		if(! qbox_inside(&e, &cb[c], k))
+			c = 4;
+		bk[i] = c;
+		cnt[c]++;
+	}
+	for(int c=0; c<5; c++)
+		off[c+2] = cnt[c];
+
+	// As in qnode_insert_batch(), but index 4 collects elements that
+	// straddle the children, which stay in qn
+	for(int c=2; c<7; c++)
+		off[c] += off[c-1];
+
+	for(uint32_t i=0; i<n; i++)
+		tmp[off[bk[i]+1]++] = items[i];
+
+	if(off[5] > off[4]) {
+		add_idx(q, qn, ptrs, bounds, tmp+off[4], off[5] - off[4]);
+		ins += off[5] - off[4];
+	}
+
+	for(int c=QNW; c<=QSE; c++) {
+		uint32_t start = off[c];
+		uint32_t len = off[c+1] - start;
+		if(! len)
+			continue;
+#if QTREE_THREADSAFE == 1
+		if(b && len >= QTREE_PARGRAIN &&
+		   qbuild_push(b, id, &qn->child[c], tmp+start, items+start, bk+start, len))
+			continue;
+#endif
+		ins += qnode_insert_aabb_batch(q, &qn->child[c], ptrs, bounds, tmp+start,
+									   items+start, bk+start, len, b, id);
+	}
+
+	return ins;
+}
+
+#if QTREE_THREADSAFE == 1
+/// Worker deque; the owner pushes and pops at bot, thieves take from top
+typedef struct qdeque {
+	atomic_flag lock;          ///< Guards top, bot and t
+	uint32_t top;              ///< Oldest queued task
+	uint32_t bot;              ///< One past the newest queued task
+	qtask t[QTREE_DEQUECAP];   ///< Ring of queued tasks
+} qdeque;
+
+/// Shared state of one parallel qtree_insert_batch() or qtree_insert_aabb_batch()
+/*!
+  Freed by whichever of the caller and the helpers lets go of it last,
+  since a helper the task hook starts late may only get to run after
+  the build itself has finished.
+*/
+typedef struct qbuild {
+	qtree q;               ///< Tree being built
+	void **ptrs;           ///< Elements tasks index into, if bounds is set
+	const aabb *bounds;    ///< Their bounds; NULL to place by the compare function
+	atomic_uint pending;   ///< Tasks queued or running
+	atomic_uint ins;       ///< Elements inserted by queued tasks
+	atomic_uint nextid;    ///< Next worker id to hand to a helper
+	atomic_uint refs;      ///< Caller plus helpers not yet finished
+	uint32_t nworkers;     ///< Number of deques, including the caller's
+	qdeque *dq;            ///< One deque per worker
+} qbuild;
+
+/// Queues a subtree build on worker id's deque; returns 0 if it is full
+static int
+qbuild_push(qbuild *b, int id, qnode *qn, void *items, void *tmp,
+			uint8_t *bk, uint32_t n) {
+	qdeque *d = &b->dq[id];
+	int ok = 0;
+
+	qspin_lock(&d->lock);
+	if(d->bot - d->top < QTREE_DEQUECAP) {
+		qtask *t = &d->t[d->bot % QTREE_DEQUECAP];
+		t->qn = qn;
+		t->items = items;
+		t->tmp = tmp;
+		t->bk = bk;
+		t->n = n;
+		d->bot++;
+		atomic_fetch_add(&b->pending, 1);
+		ok = 1;
+	}
+	qspin_unlock(&d->lock);
+
+	return ok;
+}
+
+/// Takes a task from the back of deque d if own is set, else from the front
+static int
+qbuild_take(qdeque *d, int own, qtask *out) {
+	int ok = 0;
+
+	qspin_lock(&d->lock);
+	if(d->bot != d->top) {
+		if(own)
+			*out = d->t[--d->bot % QTREE_DEQUECAP];
+		else
+			*out = d->t[d->top++ % QTREE_DEQUECAP];
+		ok = 1;
+	}
+	qspin_unlock(&d->lock);
+
+	return ok;
+}
+
+/// Runs tasks from its own deque, stealing from others, until none are left
+static void
+qbuild_work(qbuild *b, int id) {
+	unsigned spins = 0;
+	qtask t;
+
+	while(atomic_load(&b->pending)) {
+		int got = qbuild_take(&b->dq[id], 1, &t);
+
+		for(uint32_t i=1; ! got && i<b->nworkers; i++)
+			got = qbuild_take(&b->dq[(id+i) % b->nworkers], 0, &t);
+
+		if(! got) {
+			qrw_relax(&spins);
+			continue;
+		}
+
+		spins = 0;
+		uint32_t ins = b->bounds ?
+			qnode_insert_aabb_batch(b->q, t.qn, b->ptrs, b->bounds, t.items,
+									t.tmp, t.bk, t.n, b, id) :
+			qnode_insert_batch(b->q, t.qn, t.items, t.tmp, t.bk, t.n, b, id);
+		atomic_fetch_add(&b->ins, ins);
+		atomic_fetch_sub(&b->pending, 1);
+	}
+}
+
+static void
+qbuild_unref(qbuild *b) {
+	if(atomic_fetch_sub(&b->refs, 1) == 1) {
+		free(b->dq);
+		free(b);
+	}
+}
+
+/// Entry point for helpers started through the task hook
+static void
+qbuild_helper(void *arg) {
+	qbuild *b = arg;
+	uint32_t id = atomic_fetch_add(&b->nextid, 1);
+
+	if(id < b->nworkers)
+		qbuild_work(b, id);
+
+	qbuild_unref(b);
+}
+
+/// Builds the subtree at root from items in parallel; returns elements inserted
+/*!
+  items holds element pointers if bounds is NULL, and otherwise
+  indices into ptrs and bounds.
+*/
+static uint32_t
+qbuild_run(qtree q, void **ptrs, const aabb *bounds, void *items,
+		   void *tmp, uint8_t *bk, uint32_t n) {
+	qbuild *b = calloc(1, sizeof(qbuild));
+	uint32_t nh = q->nworkers;
+
+	b->q = q;
+	b->ptrs = ptrs;
+	b->bounds = bounds;
+	b->nworkers = nh+1;
+	b->dq = calloc(b->nworkers, sizeof(qdeque));
+	for(uint32_t i=0; i<b->nworkers; i++)
+		atomic_flag_clear(&b->dq[i].lock);
+	atomic_init(&b->pending, 0);
+	atomic_init(&b->ins, 0);
+	atomic_init(&b->nextid, 1);
+	atomic_init(&b->refs, nh+1);
+
+	q->par = 1;
+
+	qbuild_push(b, 0, q->root, items, tmp, bk, n);
+
+	for(uint32_t i=0; i<nh; i++)
+		(q->taskfn)(qbuild_helper, b, q->taskud);
+
+	qbuild_work(b, 0);
+
+	q->par = 0;
+
+	uint32_t ins = atomic_load(&b->ins);
+	qbuild_unref(b);
+	return ins;
+}
+
+/// A job split into pieces that the caller and helpers take in turn
+/*!
+  Once every piece has been handed out, helpers only touch this
+  struct, so the job's own data can go as soon as qjob_run() returns.
+  The struct itself is freed by whichever thread lets go of it last,
+  as with qbuild.
+*/
+typedef struct qjob {
+	void (*run)(void *arg, uint32_t i); ///< Runs piece i
+	void *arg;          ///< Job data passed to run
+	uint32_t n;         ///< Number of pieces
+	atomic_uint next;   ///< Next piece to hand out
+	atomic_uint done;   ///< Pieces finished
+	atomic_uint refs;   ///< Caller plus helpers not yet finished
+} qjob;
+
+/// Runs pieces of j until none are left to hand out
+static void
+qjob_work(qjob *j) {
+	uint32_t i;
+
+	while((i = atomic_fetch_add(&j->next, 1)) < j->n) {
+		(j->run)(j->arg, i);
+		atomic_fetch_add(&j->done, 1);
+	}
+}
+
+static void
+qjob_unref(qjob *j) {
+	if(atomic_fetch_sub(&j->refs, 1) == 1)
+		free(j);
+}
+
+/// Entry point for helpers started through the task hook
+static void
+qjob_helper(void *arg) {
+	qjob *j = arg;
+	qjob_work(j);
+	qjob_unref(j);
+}
+
+/// Runs pieces 0..n-1 of a job on the calling thread and the task hook's helpers
+/*!
+  Returns once every piece is done, so a caller holding the tree's
+  read lock keeps it for the helpers too.
+*/
+static void
+qjob_run(qtree q, void (*run)(void *arg, uint32_t i), void *arg, uint32_t n) {
+	qjob *j = malloc(sizeof(qjob));
+	uint32_t nh = q->nworkers;
+	unsigned spins = 0;
+
+	j->run = run;
+	j->arg = arg;
+	j->n = n;
+	atomic_init(&j->next, 0);
+	atomic_init(&j->done, 0);
+	atomic_init(&j->refs, nh+1);
+
+	for(uint32_t i=0; i<nh; i++)
+		(q->taskfn)(qjob_helper, j, q->taskud);
+
+	qjob_work(j);
+
+	while(atomic_load(&j->done) < n)
+		qrw_relax(&spins);
+
+	qjob_unref(j);
+}
+#endif
+
+/// Finds the node below qn where an element with bound b belongs
+/*!
+  Fills qn up to the cap first, like qnode_insert(). After that the
+  element goes down into the child quadrant holding its center, as long
+  as that child contains all of b; an element straddling the children
+  stays in the deepest node that contains it, even past the cap.
+
+  In loose mode a node is taken to contain everything within its bound
+  scaled by q->loose, and only leaves are filled: the element goes down
+  as far as the existing nodes and its size allow, whatever their
+  counts. The cap only decides when a full leaf splits, and a split
+  leaf passes down every element that fits a child. Where an element
+  ends up then depends on its center and size, not on when it came.
+
+  In deferred mode a full node without children is not split; the
+  element is added past the cap and the node queued for maintenance.
+  A node at the tree's depth or size limit is never split and takes
+  the element past the cap.
+*/
+static qnode*
+qnode_place(qtree q, qnode *qn, const aabb *b) {
+	int loose = q->loose > 1;
+
+	for(;;) {
+		if(qn->cnt < q->maxnodecap && (! loose || ! qn->child))
+			break;
+
+		if(! qn->child) {
+			if(! qnode_can_split(q, qn))
+				break;
+			if(q->defer) {
+				qnode_mark(q, qn);
+				break;
+			}
+			subdivide(q, qn);
+			if(loose)
+				qnode_push_down(q, qn, 0);
+		}
+
+		int c = (b->center.x >= qn->bound.center.x) |
+			((b->center.y >= qn->bound.center.y) << 1);
+
+		if(! qbox_inside(b, &qn->child[c].bound, q->loose))
+			break;
+
+		qn = &qn->child[c];
+	}
+
+	return qn;
+}
+
+/// Inserts an element with a known bound b and handle h, which qn must contain
+static inline void
+qnode_insert_aabb(qtree q, qnode *qn, void *ptr, const aabb *b, uint32_t h) {
+	add(q, qnode_place(q, qn, b), ptr, b, h, q->maxnodecap);
+}
+
+/// Finds the node holding ptr below and including qn; returns its slot in *idx
+static qnode*
+qnode_find(qnode *qn, void *ptr, uint32_t *idx) {
+	qnode *found = NULL;
+	qstack st;
+	qstack_init(&st);
+	qstack_push(&st, qn);
+
+	while(st.n && ! found) {
+		qn = st.s[--st.n];
+
+		for(uint32_t i=0; i<qn->cnt; i++) {
+			if(qn->el->ptr[i] == ptr) {
+				*idx = i;
+				found = qn;
+				break;
+			}
+		}
+
+		if(qn->child)
+			for(int c=QSE; c>=QNW; c--)
+				qstack_push(&st, &qn->child[c]);
+	}
+
+	qstack_free(&st);
+	return found;
+}
+
+static void* 
+qnode_remove(qtree q, qnode *qn, void *ptr) {
+	uint32_t i;
+
+	qn = qnode_find(qn, ptr, &i);
+	if(! qn)
+		return NULL;
+
+	uint32_t h = qn->el->hid[i];
+	drop(q, qn, i);
+	if(h)
+		qhandle_release(q, h);
+	qnode_removed(q, qn);
+	return ptr;
+}
+
+/// Moves the elements of qn from index from on into its children where they fit
+/*!
+  Each element goes where an insert into the split node would have
+  placed it; the rest stay in qn. Moved elements are added to the
+  children before qn's count drops, so a concurrent snapshot reader may
+  see one twice but never misses it. qn must have children.
+*/
+static void
+qnode_push_down(qtree q, qnode *qn, uint32_t from) {
+	uint32_t cap = q->maxnodecap;
+
+	if(qn->cnt <= from)
+		return;
+
+	// Elements that stay are packed into keep, which is a copy in
+	// snapshot mode so that readers of el are not disturbed
+	qelems *el = qn->el;
+	uint32_t cnt = qn->cnt, k = from;
+	qelems *keep = el;
+	if(QTSNAPSHOT(q)) {
+		keep = qelems_new(el->cap);
+		QTSTAT(q, allocs, 1);
+		qelems_copy(keep, el, from);
+	}
+
+	for(uint32_t i=from; i<cnt; i++) {
+		void *ptr = el->ptr[i];
+		float x0 = el->minx[i], y0 = el->miny[i];
+		float x1 = el->maxx[i], y1 = el->maxy[i];
+		uint32_t h = el->hid[i];
+		int c;
+
+		if(x1 == INFINITY) {
+			// Placed by the compare function
+			for(c=QNW; c<=QSE; c++)
+				if(QTCMP(q, ptr, &qn->child[c].bound))
+					break;
+			if(c <= QSE) {
+				qnode_insert(q, &qn->child[c], ptr);
+				continue;
+			}
+		} else {
+			aabb b = { { (x0+x1)/2, (y0+y1)/2 }, { (x1-x0)/2, (y1-y0)/2 } };
+			c = (b.center.x >= qn->bound.center.x) |
+				((b.center.y >= qn->bound.center.y) << 1);
+
+			if(qbox_inside(&b, &qn->child[c].bound, q->loose)) {
+				// Place by the rebuilt bound, but keep the stored one exactly
+				qnode *to = qnode_place(q, &qn->child[c], &b);
+				qelems *tel = grow(q, to, cap);
+				tel->minx[to->cnt] = x0;
+				tel->miny[to->cnt] = y0;
+				tel->maxx[to->cnt] = x1;
+				tel->maxy[to->cnt] = y1;
+				publish(q, to, tel, ptr, h);
+				continue;
+			}
+		}
+
+		// Stays here
+		keep->ptr[k] = ptr;
+		keep->minx[k] = x0;
+		keep->miny[k] = y0;
+		keep->maxx[k] = x1;
+		keep->maxy[k] = y1;
+		keep->hid[k] = h;
+		if(h)
+			qhandle_set(q, h, qn, k);
+		k++;
+	}
+
+	keep->fill = k;
+	if(keep != el) {
+		QTPUBLISH(qn->el, keep);
+		qelems_free(q, el);
+	}
+	QTPUBLISH(qn->cnt, k);
+}
+
+/// Does the split, compaction and merge work deferred for qn
+/*!
+  Elements past the cap are moved down where they fit, as an insert
+  into a split node would have placed them, and storage that grew well
+  past the cap is shrunk back before the subtree is considered for
+  merging. In loose mode every element that fits a child is moved, as
+  qnode_place() does on a split. Must be called with deferral off.
+*/
+static void
+qnode_maintain(qtree q, qnode *qn) {
+	uint32_t cap = q->maxnodecap;
+
+	if(qn->cnt > cap && (qn->child || qnode_can_split(q, qn))) {
+		if(! qn->child)
+			subdivide(q, qn);
+
+		qnode_push_down(q, qn, q->loose > 1 ? 0 : cap);
+	}
+
+	qelems *el = qn->el;
+	if(el && qn->cnt <= cap && el->cap > 2*cap) {
+		qelems *n = qelems_new(cap);
+		QTSTAT(q, allocs, 1);
+		qelems_copy(n, el, qn->cnt);
+		QTPUBLISH(qn->el, n);
+		qelems_free(q, el);
+	}
+
+	qnode_collapse(q, qn);
+}
+
+/// Checks if r's range and shape overlap qn's bound, loosened in loose mode
+static inline int
+qnode_overlaps(qtree q, const qnode *qn, const retlist *r) {
+	aabb lb = qn->bound;
+	lb.dims.w *= q->loose;
+	lb.dims.h *= q->loose;
+
+	if(! aabb_intersects(&lb, &r->range))
+		return 0;
+
+	return ! r->shape ||
+		qshape_box(r->shape, lb.center.x - lb.dims.w, lb.center.y - lb.dims.h,
+				   lb.center.x + lb.dims.w, lb.center.y + lb.dims.h);
+}
+
+/// Collects the elements of qn alone that are in r->range; returns nonzero to stop
+/*!
+  qn's children, as loaded by qnode_read(), are stored in child.
+*/
+static int
+qnode_scan(qtree q, qnode *qn, retlist *r, qnode **child) {
+	uint32_t cnt;
+	qelems *el = qnode_read(qn, &cnt, child);
+
+	QTSTAT(q, visits, 1);
+
+	for(uint32_t base=0; base<cnt; base+=64) {
+		uint32_t n = cnt-base < 64 ? cnt-base : 64;
+		uint64_t m = qelems_scan(el, base, n, r->rect);
+
+		while(m) {
+			uint32_t i = base + __builtin_ctzll(m);
+			void *e = QTACQUIRE(el->ptr[i]);
+			m &= m-1;
+			if(r->shape && ! qshape_box(r->shape, el->minx[i], el->miny[i],
+										el->maxx[i], el->maxy[i]))
+				continue;
+			if(q->cmpfnc && ! QTCMP(q, e, &r->range))
+				continue;
+			if(retlist_add(r, e))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/// Collects elements in r->range; returns nonzero if the search was stopped
+/*!
+  Walks the tree depth-first with the explicit stack st, visiting
+  children in QNW..QSE order. Children whose bound misses the range are
+  never pushed. st is left empty.
+*/
+static int
+qnode_getInRange(qtree q, qnode *qn, retlist *r, qstack *st) {
+	st->n = 0;
+	if(! qnode_overlaps(q, qn, r))
+		return 0;
+
+	qstack_push(st, qn);
+
+	while(st->n) {
+		qn = st->s[--st->n];
+
+		qnode *child;
+		if(qnode_scan(q, qn, r, &child)) {
+			st->n = 0;
+			return 1;
+		}
+
+		if(! child)
+			continue;
+
+		for(int c=QSE; c>=QNW; c--)
+			if(qnode_overlaps(q, &child[c], r))
+				qstack_push(st, &child[c]);
+	}
+
+	return 0;
+}
+
+/// Checks if a root with the given bound would take ptr, or its box b if given
+static int
+qtree_fits(qtree q, aabb bound, void *ptr, const aabb *b) {
+	if(b)
+		return qbox_inside(b, &bound, q->loose);
+	return QTCMP(q, ptr, &bound);
+}
+
+/// Puts a new root twice the size above the current one, which becomes child d
+/*!
+  The old root's elements and children move to the new child as they
+  are; nothing is reinserted. Rather than deepening every node, the new
+  root's depth is one less than the old one's, wrapping around, since
+  depths are only ever compared relative to the root's.
+*/
+static void
+qtree_wrap_root(qtree q, int d) {
+	qnode *old = q->root;
+	float hw = old->bound.dims.w;
+	float hh = old->bound.dims.h;
+	float x = old->bound.center.x + ((d & 1) ? -hw : hw);
+	float y = old->bound.center.y + ((d & 2) ? -hh : hh);
+
+	// The rounded center can leave the doubled bound just short of the
+	// old one on a side, and searches round at the new root's scale, so
+	// either can hide the elements along that edge. The bound is made a
+	// few units in the last place wider, and more if still short.
+	float w = hw*2, h = hh*2;
+	float sx = fabsf(x) + w, sy = fabsf(y) + h;
+	w += 4*(nextafterf(sx, INFINITY) - sx);
+	h += 4*(nextafterf(sy, INFINITY) - sy);
+
+	qnode *r = qnode_new_root(q, x, y, w, h);
+	r->depth = old->depth - 1;
+	while(! qbox_inside(&old->bound, &r->bound, 1)) {
+		r->bound.dims.w = nextafterf(r->bound.dims.w, INFINITY);
+		r->bound.dims.h = nextafterf(r->bound.dims.h, INFINITY);
+	}
+	subdivide(q, r);
+
+	qnode *n = &r->child[d];
+	n->bound = old->bound;
+
+	// Copied rather than moved, so snapshot readers still in the old
+	// root see it unchanged
+	if(old->cnt) {
+		qelems *el = grow(q, n, old->cnt);
+		qelems_copy(el, old->el, old->cnt);
+		for(uint32_t i=0; i<old->cnt; i++)
+			if(el->hid[i])
+				qhandle_set(q, el->hid[i], n, i);
+		n->cnt = old->cnt;
+	}
+
+	n->child = old->child;
+	if(n->child)
+		for(int c=QNW; c<=QSE; c++)
+			n->child[c].parent = n;
+
+	int dirty = old->dirty;
+	qblock_free(q, old);
+	if(dirty)
+		qnode_mark(q, n);
+
+	QTPUBLISH(q->root, r);
+}
+
+/// Grows the root until it takes ptr, or its box b if given
+/*!
+  Tries doubling the root up to QTREE_MAXGROW times, keeping the
+  current root in each of the four corners in turn, and takes the
+  smallest growth that fits. Leaves the tree unchanged and returns 0
+  if none does.
+*/
+static int
+qtree_grow(qtree q, void *ptr, const aabb *b) {
+	aabb o = q->root->bound;
+
+	for(int s=1; s<=QTREE_MAXGROW; s++) {
+		float k = (float)((1u << s) - 1);
+
+		for(int d=QNW; d<=QSE; d++) {
+			aabb nb = o;
+			nb.center.x += ((d & 1) ? -o.dims.w : o.dims.w) * k;
+			nb.center.y += ((d & 2) ? -o.dims.h : o.dims.h) * k;
+			nb.dims.w *= k+1;
+			nb.dims.h *= k+1;
+
+			if(! isfinite(nb.dims.w) || ! isfinite(nb.dims.h) ||
+			   ! qtree_fits(q, nb, ptr, b))
+				continue;
+
+			// Rounding may leave the last step just short
+			for(int i=0; i<=QTREE_MAXGROW &&
+					! qtree_fits(q, q->root->bound, ptr, b); i++)
+				qtree_wrap_root(q, d);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* exports */
+
+qtree
+qtree_new(float x, float y, float w, float h, qtree_fnc fnc) {
+	qtree q = malloc(sizeof(_qtree));
+	memset(q, 0, sizeof(_qtree));
+
+#if QTREE_THREADSAFE == 1
+ #if QTREE_LOCK != QTREE_LOCK_HOOKS
+	qrw_init(&q->rw);
+	qrw_init(&q->wr);
+ #endif
+	atomic_init(&q->ep.global, 1);
+	atomic_flag_clear(&q->poollock);
+	for(int i=0; i<QTREE_EPOCHSLOTS; i++)
+		atomic_init(&q->ep.slot[i].e, 0);
+#endif
+
+	q->maxnodecap = QTREE_STDCAP;
+	q->maxdepth = QTREE_MAXDEPTH;
+	q->loose = 1;
+	q->cmpfnc = fnc;
+	q->root = qnode_new_root(q, x+(w/2),y+(h/2),w/2,h/2);
+
+	return q;
+}
+
+void
+qtree_set_mutex(qtree q, new_mutex_fnc newfn, mutex_fnc lockfn,
+				mutex_fnc unlockfn, mutex_fnc freefn) {
+#if QTREE_THREADSAFE == 1
+	q->lockfn = lockfn;
+	q->unlockfn = unlockfn;
+	q->freefn = freefn;
+
+	q->lock = (newfn)();
+#else
+	(void)q;
+	(void)newfn;
+	(void)lockfn;
+	(void)unlockfn;
+	(void)freefn;
+#endif
+}
+
+void
+qtree_set_tasks(qtree q, qtree_task_fnc runfn, void *userdata, uint32_t nworkers) {
+#if QTREE_THREADSAFE == 1
+	q->taskfn = runfn;
+	q->taskud = userdata;
+	q->nworkers = runfn ? nworkers : 0;
+#else
+	(void)q;
+	(void)runfn;
+	(void)userdata;
+	(void)nworkers;
+#endif
+}
+
+void
+qtree_set_snapshot(qtree q, int enable) {
+#if QTREE_THREADSAFE == 1
+	if(q->snapshot && ! enable) {
+		// No readers may be active now, so everything can go
+		q->ep.pending = 0;
+		for(uint32_t i=0; i<q->ep.cnt; i++) {
+			if(q->ep.list[i].isblock)
+				qpool_release(q, q->ep.list[i].ptr);
+			else
+				free(q->ep.list[i].ptr);
+		}
+		q->ep.cnt = 0;
+	}
+	q->snapshot = enable != 0;
+#else
+	(void)q;
+	(void)enable;
+#endif
+}
+
+void
+qtree_free(qtree q) {
+#if QTREE_THREADSAFE == 1
+	for(uint32_t i=0; i<q->ep.cnt; i++)
+		if(! q->ep.list[i].isblock)
+			free(q->ep.list[i].ptr);
+	free(q->ep.list);
+#endif
+
+	qpool_free(q);
+	free(q->hs.slot);
+	free(q->dirty);
+
+#if QTREE_THREADSAFE == 1
+ #if QTREE_LOCK != QTREE_LOCK_HOOKS
+	qrw_destroy(&q->rw);
+	qrw_destroy(&q->wr);
+ #endif
+	if(q->lock)
+		(q->freefn)(q->lock);
+#endif
+
+	memset(q, 0, sizeof(_qtree));
+	free(q);
+}
+
+int
+qtree_insert(qtree q, void *ptr) {
+	int ret;
+
+	QTWRLOCK(q);
+	if(q->autogrow && ! QTCMP(q, ptr, &q->root->bound))
+		qtree_grow(q, ptr, NULL);
+	ret = qnode_insert(q, q->root, ptr);
+	QTWRUNLOCK(q);
+
+	return ret;
+}
+
+int
+qtree_insert_aabb(qtree q, void *ptr, aabb *bound) {
+	int ret = 0;
+
+	QTWRLOCK(q);
+	if(qbox_inside(bound, &q->root->bound, q->loose) ||
+	   (q->autogrow && qtree_grow(q, ptr, bound))) {
+		qnode_insert_aabb(q, q->root, ptr, bound, 0);
+		ret = 1;
+	}
+	QTWRUNLOCK(q);
+
+	return ret;
+}
+
+uint32_t
+qtree_insert_batch(qtree q, void **ptrs, uint32_t n) {
+	void **items = malloc(sizeof(void*)*n*2);
+	uint8_t *bk = malloc(n);
+	uint32_t m = 0, ins = 0;
+
+	QTWRLOCK(q);
+
+	for(uint32_t i=0; i<n; i++)
+		if(QTCMP(q, ptrs[i], &q->root->bound) ||
+		   (q->autogrow && qtree_grow(q, ptrs[i], NULL)))
+			items[m++] = ptrs[i];
+
+#if QTREE_THREADSAFE == 1
+	if(m >= QTREE_PARGRAIN && q->taskfn && q->nworkers)
+		ins = qbuild_run(q, NULL, NULL, items, items+n, bk, m);
+	else
+#endif
+	if(m)
+		ins = qnode_insert_batch(q, q->root, items, items+n, bk, m, NULL, 0);
+
+	QTWRUNLOCK(q);
+
+	free(items);
+	free(bk);
+	return ins;
+}
+
+uint32_t
+qtree_insert_aabb_batch(qtree q, void **ptrs, const aabb *bounds, uint32_t n) {
+	uint32_t *items = malloc(sizeof(uint32_t)*n*2);
+	uint8_t *bk = malloc(n);
+	uint32_t m = 0, ins = 0;
+
+	QTWRLOCK(q);
+
+	for(uint32_t i=0; i<n; i++)
+		if(qbox_inside(&bounds[i], &q->root->bound, q->loose) ||
+		   (q->autogrow && qtree_grow(q, ptrs[i], &bounds[i])))
+			items[m++] = i;
+
+#if QTREE_THREADSAFE == 1
+	if(m >= QTREE_PARGRAIN && q->taskfn && q->nworkers)
+		ins = qbuild_run(q, ptrs, bounds, items, items+n, bk, m);
+	else
+#endif
+	if(m)
+		ins = qnode_insert_aabb_batch(q, q->root, ptrs, bounds, items, items+n,
+									  bk, m, NULL, 0);
+
+	QTWRUNLOCK(q);
+
+	free(items);
+	free(bk);
+	return ins;
+}
+
+void
+qtree_remove(qtree q, void *ptr) {
+	QTWRLOCK(q);
+	qnode_remove(q, q->root, ptr);
+	QTWRUNLOCK(q);
+}
+
+qhandle
+qtree_insert_handle(qtree q, void *ptr, aabb *bound) {
+	qhandle h = 0;
+
+	QTWRLOCK(q);
+	if(qbox_inside(bound, &q->root->bound, q->loose) ||
+	   (q->autogrow && qtree_grow(q, ptr, bound))) {
+		h = qhandle_new(q);
+		qnode_insert_aabb(q, q->root, ptr, bound, h);
+	}
+	QTWRUNLOCK(q);
+
+	return h;
+}
+
+int
+qtree_remove_handle(qtree q, qhandle h) {
+	QTWRLOCK(q);
+
+	qhslot *s = qhandle_get(q, h);
+	if(! s) {
+		QTWRUNLOCK(q);
+		return 0;
+	}
+
+	qnode *n = s->node;
+	drop(q, n, s->idx);
+	qhandle_release(q, h);
+	qnode_removed(q, n);
+	QTWRUNLOCK(q);
+	return 1;
+}
+
+int
+qtree_update(qtree q, qhandle h, aabb *bound) {
+	QTWRLOCK(q);
+
+	if(! qhandle_get(q, h) ||
+	   (! qbox_inside(bound, &q->root->bound, q->loose) &&
+		! (q->autogrow && qtree_grow(q, NULL, bound)))) {
+		QTWRUNLOCK(q);
+		return 0;
+	}
+
+	// Read after any growth, which moves elements of the old root
+	qnode *n = q->hs.slot[h-1].node;
+	uint32_t idx = q->hs.slot[h-1].idx;
+
+	int stay = n == q->root || qbox_inside(bound, &n->bound, q->loose);
+	if(stay && q->loose > 1 && n->child) {
+		// A loose tree keeps it in n only if it fits no child
+		int c = (bound->center.x >= n->bound.center.x) |
+			((bound->center.y >= n->bound.center.y) << 1);
+		stay = ! qbox_inside(bound, &n->child[c].bound, q->loose);
+	}
+
+	if(stay) {
+		// Still fits where it is; only the stored bound changes
+		qelems *el = n->el;
+		if(QTSNAPSHOT(q)) {
+			qelems *c = qelems_new(el->cap);
+			QTSTAT(q, allocs, 1);
+			qelems_copy(c, el, n->cnt);
+			qelems_set_bound(c, idx, bound);
+			QTPUBLISH(n->el, c);
+			qelems_free(q, el);
+		} else {
+			qelems_set_bound(el, idx, bound);
+		}
+	} else {
+		// Walk up to the nearest node that still contains it
+		void *ptr = n->el->ptr[idx];
+		qnode *a = n;
+		while(a != q->root && ! qbox_inside(bound, &a->bound, q->loose))
+			a = a->parent;
+
+		drop(q, n, idx);
+		qnode_insert_aabb(q, a, ptr, bound, h);
+		qnode_removed(q, n);
+	}
+
+	QTWRUNLOCK(q);
+	return 1;
+}
+
+/// Does queued maintenance work as qtree_maintain() does; the write lock must be held
+static uint32_t
+qtree_drain(qtree q, uint32_t budget_us) {
+	struct timespec t0, t;
+
+	int defer = q->defer;
+	q->defer = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	while(q->ndirty) {
+		qnode *qn = q->dirty[--q->ndirty];
+		if(! qn->dirty)
+			continue;
+		qn->dirty = 0;
+		qnode_maintain(q, qn);
+
+		if(budget_us) {
+			clock_gettime(CLOCK_MONOTONIC, &t);
+			if((t.tv_sec - t0.tv_sec)*1000000 +
+			   (t.tv_nsec - t0.tv_nsec)/1000 >= budget_us)
+				break;
+		}
+	}
+
+	q->defer = defer;
+	return q->ndirty;
+}
+
+uint32_t
+qtree_maintain(qtree q, uint32_t budget_us) {
+	QTWRLOCK(q);
+	uint32_t left = qtree_drain(q, budget_us);
+	QTWRUNLOCK(q);
+
+	return left;
+}
+
+void
+qtree_set_deferred(qtree q, int enable) {
+	// Drained under the same lock, so no node queued in between is lost
+	QTWRLOCK(q);
+	qtree_drain(q, 0);
+	q->defer = enable;
+	QTWRUNLOCK(q);
+}
+
+int
+qtree_set_loose(qtree q, float looseness) {
+	int ret = 0;
+
+	QTWRLOCK(q);
+	if(looseness >= 1 && (looseness >= q->loose ||
+						  (! q->root->cnt && ! q->root->child))) {
+		q->loose = looseness;
+		ret = 1;
+	}
+	QTWRUNLOCK(q);
+
+	return ret;
+}
+
+void
+qtree_set_autogrow(qtree q, int enable) {
+	QTWRLOCK(q);
+	q->autogrow = enable;
+	QTWRUNLOCK(q);
+}
+
+void
+qtree_set_limits(qtree q, uint8_t maxdepth, float minhalf) {
+	QTWRLOCK(q);
+	q->maxdepth = maxdepth;
+	q->minhalf = minhalf;
+	QTWRUNLOCK(q);
+}
+
+void
+qtree_setMaxNodeCnt(qtree q, uint16_t cnt) {
+	QTWRLOCK(q);
+	q->maxnodecap = cnt ? cnt : 1;
+	QTWRUNLOCK(q);
+}
+
+void
+qtree_clear(qtree q) {
+	QTWRLOCK(q);
+
+	aabb b = q->root->bound;
+
+	q->hs.cnt = 0;
+	q->hs.freelist = 0;
+	q->ndirty = 0;
+
+	if(QTSNAPSHOT(q)) {
+#if QTREE_THREADSAFE == 1
+		// Readers may still be walking the old tree, so it cannot be
+		// reset in place; build a new root and retire the old blocks
+		qnode *old = q->root;
+		QTPUBLISH(q->root, qnode_new_root(q, b.center.x, b.center.y, b.dims.w, b.dims.h));
+		qepoch_retire_tree(q, old);
+#endif
+	} else {
+		qpool_reset(q);
+		q->root = qnode_new_root(q, b.center.x, b.center.y, b.dims.w, b.dims.h);
+	}
+
+	QTWRUNLOCK(q);
+}
+
+int
+qtree_get_stats(qtree q, qtree_stats *s) {
+	qstack st;
+
+	memset(s, 0, sizeof(qtree_stats));
+	qstack_init(&st);
+
+	QTRDLOCK(q);
+
+	qnode *root = QTACQUIRE(q->root);
+	qstack_push(&st, root);
+
+	while(st.n) {
+		qnode *qn = st.s[--st.n];
+		uint32_t cnt;
+		qnode *child;
+		qnode_read(qn, &cnt, &child);
+		uint32_t d = (uint16_t)(qn->depth - root->depth);
+
+		s->nodes++;
+		if(d > s->depth)
+			s->depth = d;
+		s->bydepth[d < QTREE_STATBINS ? d : QTREE_STATBINS-1]++;
+
+		// Bin 0 is empty nodes; bin k holds 2^(k-1) to 2^k - 1 elements
+		uint32_t bin = cnt ? 32 - __builtin_clz(cnt) : 0;
+		s->bycnt[bin < QTREE_STATBINS ? bin : QTREE_STATBINS-1]++;
+
+		if(child) {
+			s->innerelems += cnt;
+			for(int c=QSE; c>=QNW; c--)
+				qstack_push(&st, &child[c]);
+		} else {
+			s->leafelems += cnt;
+		}
+	}
+
+	QTRDUNLOCK(q);
+	qstack_free(&st);
+
+#ifdef QTREE_STATS
+	for(int i=0; i<QTREE_STATSLOTS; i++) {
+		s->allocs += qstat_get(&q->stats[i].allocs);
+		s->cmps += qstat_get(&q->stats[i].cmps);
+		s->queries += qstat_get(&q->stats[i].queries);
+		s->visits += qstat_get(&q->stats[i].visits);
+		s->spins += qstat_get(&q->stats[i].spins);
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void
+qtree_reset_stats(qtree q) {
+#ifdef QTREE_STATS
+	for(int i=0; i<QTREE_STATSLOTS; i++) {
+		qstat_clear(&q->stats[i].allocs);
+		qstat_clear(&q->stats[i].cmps);
+		qstat_clear(&q->stats[i].queries);
+		qstat_clear(&q->stats[i].visits);
+		qstat_clear(&q->stats[i].spins);
+	}
+#else
+	(void)q;
+#endif
+}
+
+/// Heap entry used by ordered searches
+typedef struct qhent {
+	float d;          ///< Key
+	uint32_t isnode;  ///< p is a node rather than an element
+	void *p;          ///< Node or element
+} qhent;
+
+/// Binary min-heap of qhent
+/*!
+  Like qstack, entries live in the fixed array until a search outgrows
+  it, so most searches never allocate.
+*/
+typedef struct qheap {
+	qhent *e;      ///< Entries, either fixed or heap allocated
+	uint32_t n;    ///< Number of entries
+	uint32_t cap;  ///< Number of entries e can hold
+	qhent fixed[QTREE_STACKFIXED]; ///< Initial entries
+} qheap;
+
+static inline void
+qheap_init(qheap *h) {
+	h->e = h->fixed;
+	h->n = 0;
+	h->cap = QTREE_STACKFIXED;
+}
+
+static inline void
+qheap_free(qheap *h) {
+	if(h->e != h->fixed)
+		free(h->e);
+}
+
+static void
+qheap_push(qheap *h, float d, void *p, uint32_t isnode) {
+	if(h->n == h->cap) {
+		h->cap *= 2;
+		if(h->e == h->fixed) {
+			h->e = malloc(sizeof(qhent)*h->cap);
+			memcpy(h->e, h->fixed, sizeof(h->fixed));
+		} else {
+			h->e = realloc(h->e, sizeof(qhent)*h->cap);
+		}
+	}
+
+	uint32_t i = h->n++;
+	while(i && h->e[(i-1)/2].d > d) {
+		h->e[i] = h->e[(i-1)/2];
+		i = (i-1)/2;
+	}
+	h->e[i].d = d;
+	h->e[i].isnode = isnode;
+	h->e[i].p = p;
+}
+
+/// Removes and returns the entry with the smallest key
+static qhent
+qheap_pop(qheap *h) {
+	qhent top = h->e[0];
+	qhent last = h->e[--h->n];
+	uint32_t i = 0;
+
+	for(;;) {
+		uint32_t c = 2*i+1;
+		if(c >= h->n)
+			break;
+		if(c+1 < h->n && h->e[c+1].d < h->e[c].d)
+			c++;
+		if(h->e[c].d >= last.d)
+			break;
+		h->e[i] = h->e[c];
+		i = c;
+	}
+	if(h->n)
+		h->e[i] = last;
+
+	return top;
+}
+
+/// Distance from x,y to the box with the given min and max corners; 0 inside
+static inline float
+qbox_dist(float x0, float y0, float x1, float y1, float x, float y) {
+	float dx = fmaxf(fmaxf(x0 - x, x - x1), 0);
+	float dy = fmaxf(fmaxf(y0 - y, y - y1), 0);
+	return sqrtf(dx*dx + dy*dy);
+}
+
+/// Distance from x,y to qn's bound, loosened in loose mode
+static inline float
+qnode_dist(qtree q, const qnode *qn, float x, float y) {
+	float w = qn->bound.dims.w*q->loose, h = qn->bound.dims.h*q->loose;
+	return qbox_dist(qn->bound.center.x - w, qn->bound.center.y - h,
+					 qn->bound.center.x + w, qn->bound.center.y + h, x, y);
+}
+
+/// Where segment o + t*d, 0 <= t <= 1, enters a box; returns 0 if it misses
+static int
+qbox_segment(float x0, float y0, float x1, float y1,
+			 float ox, float oy, float dx, float dy, float *t) {
+	float t0 = 0, t1 = 1;
+
+	if(dx != 0) {
+		float a = (x0 - ox)/dx, b = (x1 - ox)/dx;
+		t0 = fmaxf(t0, fminf(a, b));
+		t1 = fminf(t1, fmaxf(a, b));
+	} else if(ox < x0 || ox > x1) {
+		return 0;
+	}
+
+	if(dy != 0) {
+		float a = (y0 - oy)/dy, b = (y1 - oy)/dy;
+		t0 = fmaxf(t0, fminf(a, b));
+		t1 = fminf(t1, fmaxf(a, b));
+	} else if(oy < y0 || oy > y1) {
+		return 0;
+	}
+
+	*t = t0;
+	return t0 <= t1;
+}
+
+/// Where a segment enters qn's bound, loosened in loose mode
+static inline int
+qnode_segment(qtree q, const qnode *qn, float ox, float oy, float dx, float dy,
+			  float *t) {
+	float w = qn->bound.dims.w*q->loose, h = qn->bound.dims.h*q->loose;
+	return qbox_segment(qn->bound.center.x - w, qn->bound.center.y - h,
+						qn->bound.center.x + w, qn->bound.center.y + h,
+						ox, oy, dx, dy, t);
+}
+
+/// Runs a range search into r, whose range must already be set
+/*!
+  Uses the traversal stack st if given, or one on the C stack.
+*/
+static void
+qtree_getInRange(qtree q, retlist *r, qstack *st) {
+	qstack local;
+	if(! st) {
+		qstack_init(&local);
+		st = &local;
+	}
+
+	QTRDLOCK(q);
+	QTSTAT(q, queries, 1);
+	qnode_getInRange(q, QTACQUIRE(q->root), r, st);
+	QTRDUNLOCK(q);
+
+	if(st == &local)
+		qstack_free(&local);
+}
+
+void**
+qtree_findInArea(qtree q, float x, float y, float w, float h, uint32_t *cnt) {
+	retlist ret;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_range(&ret, x, y, w, h);
+
+	qtree_getInRange(q, &ret, NULL);
+
+	*cnt = ret.cnt;
+	return ret.list;
+}
+
+int
+qtree_findInAreaBuf(qtree q, float x, float y, float w, float h,
+					void **buf, uint32_t cap, uint32_t *cnt) {
+	retlist ret;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_range(&ret, x, y, w, h);
+	ret.list = buf;
+	ret.cap = cap;
+	ret.fixed = 1;
+
+	qtree_getInRange(q, &ret, NULL);
+
+	*cnt = ret.cnt;
+	return ret.cnt > cap;
+}
+
+uint32_t
+qtree_visitInArea(qtree q, float x, float y, float w, float h,
+				  qtree_visit_fnc fn, void *userdata) {
+	retlist ret;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_range(&ret, x, y, w, h);
+	ret.visit = fn;
+	ret.ud = userdata;
+
+	qtree_getInRange(q, &ret, NULL);
+
+	return ret.cnt;
+}
+
+uint32_t
+qtree_countInArea(qtree q, float x, float y, float w, float h) {
+	retlist ret;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_range(&ret, x, y, w, h);
+	ret.fixed = 1;
+
+	qtree_getInRange(q, &ret, NULL);
+
+	return ret.cnt;
+}
+
+int
+qtree_anyInArea(qtree q, float x, float y, float w, float h) {
+	return qtree_visitInArea(q, x, y, w, h, _visit_stop, NULL) != 0;
+}
+
+#if QTREE_THREADSAFE == 1
+/// Piece of a parallel range search
+typedef struct qrangepiece {
+	qnode *qn;  ///< Node the piece starts at
+	int sub;    ///< Search the whole subtree at qn; else qn's own elements are done
+	retlist r;  ///< The piece's own results
+} qrangepiece;
+
+/// Shared state of one parallel range search
+typedef struct qrangepar {
+	qtree q;           ///< Tree being searched
+	qrangepiece *p;    ///< Pieces, in the order a serial search visits them
+} qrangepar;
+
+/// Runs piece i of a parallel range search
+static void
+qrangepar_run(void *arg, uint32_t i) {
+	qrangepar *rp = arg;
+	qrangepiece *p = &rp->p[i];
+
+	if(p->sub) {
+		qstack st;
+		qstack_init(&st);
+		qnode_getInRange(rp->q, p->qn, &p->r, &st);
+		qstack_free(&st);
+	}
+}
+#endif
+
+void**
+qtree_findInAreaPar(qtree q, float x, float y, float w, float h, uint32_t *cnt) {
+	retlist ret;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_range(&ret, x, y, w, h);
+
+#if QTREE_THREADSAFE == 1
+	if(q->taskfn && q->nworkers) {
+		qrangepiece *p = NULL;
+		uint32_t np = 0, pcap = 0;
+		uint8_t split = 0;
+		qstack st;
+
+		// Enough levels to give each thread a few subtrees
+		for(uint32_t n=1; n < (q->nworkers+1) * QTREE_PARSPLIT; n *= 4)
+			split++;
+
+		qstack_init(&st);
+
+		QTRDLOCK(q);
+		QTSTAT(q, queries, 1);
+
+		// Above the split, each node's own elements are a piece,
+		// searched right away; below it, a whole subtree is. Pieces are listed depth-first,
+		// so their results join up in the order a serial search gives.
+		qnode *root = QTACQUIRE(q->root);
+		if(qnode_overlaps(q, root, &ret))
+			qstack_push(&st, root);
+
+		while(st.n) {
+			qnode *qn = st.s[--st.n];
+
+			if(np == pcap) {
+				pcap = pcap ? pcap*2 : 64;
+				p = realloc(p, sizeof(qrangepiece)*pcap);
+			}
+			p[np].qn = qn;
+			p[np].r = ret;
+			p[np].sub = (uint16_t)(qn->depth - root->depth) >= split;
+
+			if(p[np++].sub)
+				continue;
+
+			// Small enough to do here
+			qnode *child;
+			qnode_scan(q, qn, &p[np-1].r, &child);
+			if(! child)
+				continue;
+
+			for(int c=QSE; c>=QNW; c--)
+				if(qnode_overlaps(q, &child[c], &ret))
+					qstack_push(&st, &child[c]);
+		}
+
+		qrangepar rp = { q, p };
+		if(np)
+			qjob_run(q, qrangepar_run, &rp, np);
+
+		QTRDUNLOCK(q);
+
+		qstack_free(&st);
+
+		for(uint32_t i=0; i<np; i++)
+			ret.cnt += p[i].r.cnt;
+
+		ret.list = ret.cnt ? malloc(sizeof(void*)*ret.cnt) : NULL;
+		for(uint32_t i=0, off=0; i<np; i++) {
+			if(p[i].r.cnt)
+				memcpy(ret.list + off, p[i].r.list, sizeof(void*)*p[i].r.cnt);
+			off += p[i].r.cnt;
+			free(p[i].r.list);
+		}
+
+		free(p);
+
+		*cnt = ret.cnt;
+		return ret.list;
+	}
+#endif
+
+	qtree_getInRange(q, &ret, NULL);
+
+	*cnt = ret.cnt;
+	return ret.list;
+}
+
+uint32_t
+qtree_findNearest(qtree q, float x, float y, uint32_t k, float maxdist,
+				  void **out, qtree_dist_fnc dist_fn) {
+	qheap nodes, best; // best is keyed by -distance, so the worst is on top
+
+	if(! k)
+		return 0;
+
+	qheap_init(&nodes);
+	qheap_init(&best);
+
+	QTRDLOCK(q);
+	QTSTAT(q, queries, 1);
+
+	qnode *root = QTACQUIRE(q->root);
+	float d = qnode_dist(q, root, x, y);
+	if(d <= maxdist)
+		qheap_push(&nodes, d, root, 1);
+
+	while(nodes.n) {
+		qhent ne = qheap_pop(&nodes);
+		float limit = best.n == k ? -best.e[0].d : maxdist;
+
+		// Nothing left can be closer than the worst of a full result
+		if(ne.d > limit)
+			break;
+
+		qnode *qn = ne.p;
+		uint32_t cnt;
+		qnode *child;
+		qelems *el = qnode_read(qn, &cnt, &child);
+		QTSTAT(q, visits, 1);
+
+		for(uint32_t i=0; i<cnt; i++) {
+			void *e = QTACQUIRE(el->ptr[i]);
+
+			// The bound distance never exceeds the element's own
+			d = qbox_dist(el->minx[i], el->miny[i], el->maxx[i], el->maxy[i], x, y);
+			if(d > limit)
+				continue;
+			if(dist_fn) {
+				d = dist_fn(e, x, y);
+				if(d > limit)
+					continue;
+			}
+
+			if(best.n == k)
+				qheap_pop(&best);
+			qheap_push(&best, -d, e, 0);
+			limit = best.n == k ? -best.e[0].d : maxdist;
+		}
+
+		if(! child)
+			continue;
+
+		for(int c=QNW; c<=QSE; c++) {
+			d = qnode_dist(q, &child[c], x, y);
+			if(d <= limit)
+				qheap_push(&nodes, d, &child[c], 1);
+		}
+	}
+
+	QTRDUNLOCK(q);
+
+	uint32_t n = best.n;
+	while(best.n) {
+		uint32_t i = best.n - 1;
+		out[i] = qheap_pop(&best).p;
+	}
+
+	qheap_free(&nodes);
+	qheap_free(&best);
+	return n;
+}
+
+void**
+qtree_findInRadius(qtree q, float x, float y, float radius, uint32_t *cnt) {
+	retlist ret;
+	qshape sh;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_circle(&ret, &sh, x, y, radius);
+
+	qtree_getInRange(q, &ret, NULL);
+
+	*cnt = ret.cnt;
+	return ret.list;
+}
+
+int
+qtree_findInRadiusBuf(qtree q, float x, float y, float radius,
+					  void **buf, uint32_t cap, uint32_t *cnt) {
+	retlist ret;
+	qshape sh;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_circle(&ret, &sh, x, y, radius);
+	ret.list = buf;
+	ret.cap = cap;
+	ret.fixed = 1;
+
+	qtree_getInRange(q, &ret, NULL);
+
+	*cnt = ret.cnt;
+	return ret.cnt > cap;
+}
+
+uint32_t
+qtree_visitInRadius(qtree q, float x, float y, float radius,
+					qtree_visit_fnc fn, void *userdata) {
+	retlist ret;
+	qshape sh;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_circle(&ret, &sh, x, y, radius);
+	ret.visit = fn;
+	ret.ud = userdata;
+
+	qtree_getInRange(q, &ret, NULL);
+
+	return ret.cnt;
+}
+
+void**
+qtree_findInPolygon(qtree q, const float *xy, uint32_t n, uint32_t *cnt) {
+	retlist ret;
+	qshape sh;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_polygon(&ret, &sh, xy, n);
+
+	qtree_getInRange(q, &ret, NULL);
+
+	*cnt = ret.cnt;
+	return ret.list;
+}
+
+int
+qtree_findInPolygonBuf(qtree q, const float *xy, uint32_t n,
+					   void **buf, uint32_t cap, uint32_t *cnt) {
+	retlist ret;
+	qshape sh;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_polygon(&ret, &sh, xy, n);
+	ret.list = buf;
+	ret.cap = cap;
+	ret.fixed = 1;
+
+	qtree_getInRange(q, &ret, NULL);
+
+	*cnt = ret.cnt;
+	return ret.cnt > cap;
+}
+
+uint32_t
+qtree_visitInPolygon(qtree q, const float *xy, uint32_t n,
+					 qtree_visit_fnc fn, void *userdata) {
+	retlist ret;
+	qshape sh;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_polygon(&ret, &sh, xy, n);
+	ret.visit = fn;
+	ret.ud = userdata;
+
+	qtree_getInRange(q, &ret, NULL);
+
+	return ret.cnt;
+}
+
+uint32_t
+qtree_visitOnSegment(qtree q, float x0, float y0, float x1, float y1,
+					 qtree_visit_fnc fn, void *userdata) {
+	qheap h;
+	uint32_t found = 0;
+	float dx = x1 - x0, dy = y1 - y0, t;
+
+	qheap_init(&h);
+
+	// Bounding box of the segment, for the compare function
+	aabb range = { { x0 + dx/2, y0 + dy/2 }, { fabsf(dx)/2, fabsf(dy)/2 } };
+
+	QTRDLOCK(q);
+	QTSTAT(q, queries, 1);
+
+	qnode *root = QTACQUIRE(q->root);
+	if(qnode_segment(q, root, x0, y0, dx, dy, &t))
+		qheap_push(&h, t, root, 1);
+
+	// Nodes and elements share one queue ordered by entry point, so
+	// elements come out in order along the segment
+	while(h.n) {
+		qhent e = qheap_pop(&h);
+
+		if(! e.isnode) {
+			found++;
+			if(fn(e.p, userdata))
+				break;
+			continue;
+		}
+
+		qnode *qn = e.p;
+		uint32_t cnt;
+		qnode *child;
+		qelems *el = qnode_read(qn, &cnt, &child);
+		QTSTAT(q, visits, 1);
+
+		for(uint32_t i=0; i<cnt; i++) {
+			void *p = QTACQUIRE(el->ptr[i]);
+			if(! qbox_segment(el->minx[i], el->miny[i], el->maxx[i], el->maxy[i],
+							  x0, y0, dx, dy, &t))
+				continue;
+			if(q->cmpfnc && ! QTCMP(q, p, &range))
+				continue;
+			qheap_push(&h, t, p, 0);
+		}
+
+		if(! child)
+			continue;
+
+		for(int c=QNW; c<=QSE; c++)
+			if(qnode_segment(q, &child[c], x0, y0, dx, dy, &t))
+				qheap_push(&h, t, &child[c], 1);
+	}
+
+	QTRDUNLOCK(q);
+
+	qheap_free(&h);
+	return found;
+}
+
+/// Visitor for qtree_findOnSegmentBuf(); stores what fits and counts the rest
+static int
+_visit_store(void *ptr, void *userdata) {
+	retlist *r = userdata;
+	if(r->cnt < r->cap)
+		r->list[r->cnt] = ptr;
+	r->cnt++;
+	return 0;
+}
+
+int
+qtree_findOnSegmentBuf(qtree q, float x0, float y0, float x1, float y1,
+					   void **buf, uint32_t cap, uint32_t *cnt) {
+	retlist ret;
+	memset(&ret, 0, sizeof(retlist));
+	ret.list = buf;
+	ret.cap = cap;
+	ret.fixed = 1;
+
+	qtree_visitOnSegment(q, x0, y0, x1, y1, _visit_store, &ret);
+
+	*cnt = ret.cnt;
+	return ret.cnt > cap;
+}
+
+enum { QPAIR_SELF, QPAIR_DOWN, QPAIR_CROSS };
+
+/// Pending step of qtree_findAllPairs()
+/*!
+  QPAIR_SELF covers all pairs within the subtree at a. QPAIR_DOWN pairs
+  the elements of a with the subtree at b, which box, the extent of
+  a's elements, touches. QPAIR_CROSS pairs the subtree at a with the
+  unrelated subtree at b. Each pair belongs to exactly one step, so no
+  pair is reported twice.
+*/
+typedef struct qpairop {
+	int kind;     ///< QPAIR_SELF, QPAIR_DOWN or QPAIR_CROSS
+	qnode *a;     ///< First node
+	qnode *b;     ///< Second node; unused for QPAIR_SELF
+	float box[4]; ///< Extent of a's elements, for QPAIR_DOWN
+} qpairop;
+
+/// Stack, or for a parallel run queue, of pending pair steps
+typedef struct qpairs {
+	qpairop *s;    ///< Entries, either fixed or heap allocated
+	uint32_t n;    ///< Number of entries in use
+	uint32_t cap;  ///< Number of entries s can hold
+	qpairop fixed[QTREE_STACKFIXED]; ///< Initial entries
+} qpairs;
+
+static void
+qpairs_push(qpairs *ps, int kind, qnode *a, qnode *b, const float box[4]) {
+	if(ps->n == ps->cap) {
+		ps->cap *= 2;
+		if(ps->s == ps->fixed) {
+			ps->s = malloc(sizeof(qpairop)*ps->cap);
+			memcpy(ps->s, ps->fixed, sizeof(ps->fixed));
+		} else {
+			ps->s = realloc(ps->s, sizeof(qpairop)*ps->cap);
+		}
+	}
+
+	qpairop *op = &ps->s[ps->n++];
+	op->kind = kind;
+	op->a = a;
+	op->b = b;
+	if(box)
+		memcpy(op->box, box, sizeof(op->box));
+}
+
+/// Stores qn's bound, loosened in loose mode, as min x, min y, max x, max y
+static inline void
+qnode_rect(qtree q, const qnode *qn, float r[4]) {
+	float hw = qn->bound.dims.w * q->loose;
+	float hh = qn->bound.dims.h * q->loose;
+
+	r[0] = qn->bound.center.x - hw;
+	r[1] = qn->bound.center.y - hh;
+	r[2] = qn->bound.center.x + hw;
+	r[3] = qn->bound.center.y + hh;
+}
+
+static inline int
+qrect_overlap(const float a[4], const float b[4]) {
+	return a[0] <= b[2] && a[1] <= b[3] && a[2] >= b[0] && a[3] >= b[1];
+}
+
+/// Checks if the subtrees at a and b can hold overlapping elements
+static inline int
+qnode_near(qtree q, const qnode *a, const qnode *b) {
+	float ra[4], rb[4];
+	qnode_rect(q, a, ra);
+	qnode_rect(q, b, rb);
+	return qrect_overlap(ra, rb);
+}
+
+/// Stores the extent of the first cnt bounded elements of el in box; returns 0 if there are none
+static int
+qnode_extent(const qelems *el, uint32_t cnt, float box[4]) {
+	int any = 0;
+
+	box[0] = box[1] = INFINITY;
+	box[2] = box[3] = -INFINITY;
+
+	for(uint32_t i=0; i<cnt; i++) {
+		if(el->maxx[i] == INFINITY)
+			continue;
+		box[0] = fminf(box[0], el->minx[i]);
+		box[1] = fminf(box[1], el->miny[i]);
+		box[2] = fmaxf(box[2], el->maxx[i]);
+		box[3] = fmaxf(box[3], el->maxy[i]);
+		any = 1;
+	}
+
+	return any;
+}
+
+/// Reports each pair of overlapping bounded elements of a and b
+/*!
+  a and b are the first acnt and bcnt elements of both nodes, as
+  loaded by qnode_read(). If self is set they are the same node, and
+  each element is only paired with the ones after it. Elements without
+  a bound are skipped on both sides. Returns the number of pairs
+  reported.
+*/
+static uint32_t
+qpairs_scan(const qelems *ael, uint32_t acnt, const qelems *bel, uint32_t bcnt,
+			int self, qtree_pair_fnc fn, void *userdata) {
+	uint32_t found = 0;
+
+	for(uint32_t i=0; i<acnt; i++) {
+		void *p = QTACQUIRE(ael->ptr[i]);
+		if(ael->maxx[i] == INFINITY)
+			continue;
+
+		float rect[4] = { ael->minx[i], ael->miny[i], ael->maxx[i], ael->maxy[i] };
+
+		for(uint32_t base = self ? i+1 : 0; base<bcnt; base+=64) {
+			uint32_t n = bcnt-base < 64 ? bcnt-base : 64;
+			uint64_t m = qelems_scan(bel, base, n, rect);
+
+			while(m) {
+				uint32_t j = base + __builtin_ctzll(m);
+				void *e = QTACQUIRE(bel->ptr[j]);
+				m &= m-1;
+				if(bel->maxx[j] == INFINITY)
+					continue;
+				fn(p, e, userdata);
+				found++;
+			}
+		}
+	}
+
+	return found;
+}
+
+/// Runs one pair step, pushing the steps it splits into onto ps
+static uint32_t
+qpairs_step(qtree q, const qpairop *op, qpairs *ps,
+			qtree_pair_fnc fn, void *userdata) {
+	qnode *a = op->a, *b = op->b;
+	qnode *ac, *bc;
+	uint32_t acnt, bcnt;
+	qelems *ael = qnode_read(a, &acnt, &ac), *bel;
+	uint32_t found = 0;
+	float box[4], r[4];
+
+	switch(op->kind) {
+	case QPAIR_SELF:
+		found = qpairs_scan(ael, acnt, ael, acnt, 1, fn, userdata);
+		if(! ac)
+			break;
+
+		if(qnode_extent(ael, acnt, box))
+			for(int c=QNW; c<=QSE; c++) {
+				qnode_rect(q, &ac[c], r);
+				if(qrect_overlap(r, box))
+					qpairs_push(ps, QPAIR_DOWN, a, &ac[c], box);
+			}
+
+		for(int c=QNW; c<=QSE; c++) {
+			qpairs_push(ps, QPAIR_SELF, &ac[c], NULL, NULL);
+			for(int d=c+1; d<=QSE; d++)
+				if(qnode_near(q, &ac[c], &ac[d]))
+					qpairs_push(ps, QPAIR_CROSS, &ac[c], &ac[d], NULL);
+		}
+		break;
+
+	case QPAIR_DOWN:
+		bel = qnode_read(b, &bcnt, &bc);
+		found = qpairs_scan(ael, acnt, bel, bcnt, 0, fn, userdata);
+		if(! bc)
+			break;
+
+		for(int c=QNW; c<=QSE; c++) {
+			qnode_rect(q, &bc[c], r);
+			if(qrect_overlap(r, op->box))
+				qpairs_push(ps, QPAIR_DOWN, a, &bc[c], op->box);
+		}
+		break;
+
+	case QPAIR_CROSS:
+		// a's elements with b's subtree, b's elements with the
+		// subtrees below a, and then the children with each other
+		bel = qnode_read(b, &bcnt, &bc);
+		if(qnode_extent(ael, acnt, box)) {
+			qnode_rect(q, b, r);
+			if(qrect_overlap(r, box))
+				qpairs_push(ps, QPAIR_DOWN, a, b, box);
+		}
+
+		if(! ac)
+			break;
+
+		if(qnode_extent(bel, bcnt, box))
+			for(int c=QNW; c<=QSE; c++) {
+				qnode_rect(q, &ac[c], r);
+				if(qrect_overlap(r, box))
+					qpairs_push(ps, QPAIR_DOWN, b, &ac[c], box);
+			}
+
+		if(! bc)
+			break;
+
+		for(int c=QNW; c<=QSE; c++)
+			for(int d=QNW; d<=QSE; d++)
+				if(qnode_near(q, &ac[c], &bc[d]))
+					qpairs_push(ps, QPAIR_CROSS, &ac[c], &bc[d], NULL);
+		break;
+	}
+
+	return found;
+}
+
+/// Runs the step op and everything it splits into; returns pairs reported
+static uint32_t
+qpairs_run(qtree q, const qpairop *op, qtree_pair_fnc fn, void *userdata) {
+	qpairs ps;
+	uint32_t found = 0;
+
+	ps.s = ps.fixed;
+	ps.n = 0;
+	ps.cap = QTREE_STACKFIXED;
+	ps.s[ps.n++] = *op;
+
+	while(ps.n) {
+		qpairop cur = ps.s[--ps.n];
+		found += qpairs_step(q, &cur, &ps, fn, userdata);
+	}
+
+	if(ps.s != ps.fixed)
+		free(ps.s);
+
+	return found;
+}
+
+#if QTREE_THREADSAFE == 1
+/// Shared state of one parallel qtree_findAllPairs()
+typedef struct qpairpar {
+	qtree q;           ///< Tree being searched
+	qtree_pair_fnc fn; ///< Pair callback
+	void *ud;          ///< User data passed to fn
+	qpairop *ops;      ///< Independent steps to share out
+	atomic_uint found; ///< Pairs reported so far
+} qpairpar;
+
+/// Runs step i of a parallel pair search, and everything it splits into
+static void
+qpairpar_run(void *arg, uint32_t i) {
+	qpairpar *pp = arg;
+	atomic_fetch_add(&pp->found, qpairs_run(pp->q, &pp->ops[i], pp->fn, pp->ud));
+}
+#endif
+
+uint32_t
+qtree_findAllPairs(qtree q, qtree_pair_fnc fn, void *userdata) {
+	qpairop top = { QPAIR_SELF, NULL, NULL, { 0, 0, 0, 0 } };
+	uint32_t found = 0;
+
+	QTRDLOCK(q);
+	QTSTAT(q, queries, 1);
+	top.a = QTACQUIRE(q->root);
+
+#if QTREE_THREADSAFE == 1
+	if(q->taskfn && q->nworkers) {
+		// Split the top of the tree breadth-first until there are a
+		// few independent steps per thread, then share those out
+		qpairs ps;
+		uint32_t head = 0;
+
+		ps.s = ps.fixed;
+		ps.n = 0;
+		ps.cap = QTREE_STACKFIXED;
+		ps.s[ps.n++] = top;
+
+		while(head < ps.n && ps.n - head < (q->nworkers+1) * QTREE_PARSPLIT) {
+			qpairop cur = ps.s[head++];
+			found += qpairs_step(q, &cur, &ps, fn, userdata);
+		}
+
+		if(head < ps.n) {
+			qpairpar pp = { q, fn, userdata, ps.s + head, 0 };
+			atomic_init(&pp.found, 0);
+			qjob_run(q, qpairpar_run, &pp, ps.n - head);
+			found += atomic_load(&pp.found);
+		}
+
+		if(ps.s != ps.fixed)
+			free(ps.s);
+	} else
+#endif
+	found = qpairs_run(q, &top, fn, userdata);
+
+	QTRDUNLOCK(q);
+
+	return found;
+}
+
+/// Node waiting in a batched search, with the queries still active at it
+typedef struct qbatchframe {
+	qnode *qn;      ///< Node to visit
+	uint32_t start; ///< First of its active query ids in the id stack
+	uint32_t len;   ///< Number of active queries
+} qbatchframe;
+
+void**
+qtree_findInAreaBatch(qtree q, const aabb *boxes, uint32_t n, uint32_t *offsets) {
+	float *rect = malloc(sizeof(float)*4*n + 1);
+	uint32_t *ids = malloc(sizeof(uint32_t)*n + 1);
+	uint32_t nids = 0, idcap = n;
+	qbatchframe *fr = malloc(sizeof(qbatchframe)*QTREE_STACKFIXED);
+	uint32_t nfr = 0, frcap = QTREE_STACKFIXED;
+	uint32_t *hq = NULL;
+	void **hp = NULL;
+	uint32_t nhits = 0, hitcap = 0;
+	float r[4];
+
+	for(uint32_t i=0; i<n; i++) {
+		rect[i*4+0] = boxes[i].center.x - boxes[i].dims.w;
+		rect[i*4+1] = boxes[i].center.y - boxes[i].dims.h;
+		rect[i*4+2] = boxes[i].center.x + boxes[i].dims.w;
+		rect[i*4+3] = boxes[i].center.y + boxes[i].dims.h;
+	}
+
+	QTRDLOCK(q);
+	QTSTAT(q, queries, n);
+
+	qnode *root = QTACQUIRE(q->root);
+	qnode_rect(q, root, r);
+	for(uint32_t i=0; i<n; i++)
+		if(qrect_overlap(r, &rect[i*4]))
+			ids[nids++] = i;
+
+	if(nids) {
+		fr[nfr].qn = root;
+		fr[nfr].start = 0;
+		fr[nfr++].len = nids;
+	}
+
+	// Depth-first, like qnode_getInRange(), so each query's hits come
+	// out in the same order a single search would give. A frame's ids
+	// sit at the top of the id stack when it is popped; everything
+	// above them belongs to frames already finished.
+	while(nfr) {
+		qbatchframe f = fr[--nfr];
+		qnode *qn = f.qn;
+		nids = f.start + f.len;
+
+		uint32_t cnt;
+		qnode *child;
+		qelems *el = qnode_read(qn, &cnt, &child);
+		QTSTAT(q, visits, 1);
+
+		for(uint32_t k=0; k<f.len; k++) {
+			uint32_t id = ids[f.start+k];
+
+			for(uint32_t base=0; base<cnt; base+=64) {
+				uint32_t bn = cnt-base < 64 ? cnt-base : 64;
+				uint64_t m = qelems_scan(el, base, bn, &rect[id*4]);
+
+				while(m) {
+					uint32_t i = base + __builtin_ctzll(m);
+					void *e = QTACQUIRE(el->ptr[i]);
+					m &= m-1;
+					if(q->cmpfnc && ! QTCMP(q, e, (aabb*)&boxes[id]))
+						continue;
+					if(nhits == hitcap) {
+						hitcap = hitcap ? hitcap*2 : 64;
+						hq = realloc(hq, sizeof(uint32_t)*hitcap);
+						hp = realloc(hp, sizeof(void*)*hitcap);
+					}
+					hq[nhits] = id;
+					hp[nhits++] = e;
+				}
+			}
+		}
+
+		if(! child)
+			continue;
+
+		for(int c=QSE; c>=QNW; c--) {
+			uint32_t start = nids;
+
+			qnode_rect(q, &child[c], r);
+			for(uint32_t k=0; k<f.len; k++) {
+				uint32_t id = ids[f.start+k];
+				if(! qrect_overlap(r, &rect[id*4]))
+					continue;
+				if(nids == idcap) {
+					idcap *= 2;
+					ids = realloc(ids, sizeof(uint32_t)*idcap);
+				}
+				ids[nids++] = id;
+			}
+
+			if(nids == start)
+				continue;
+
+			if(nfr == frcap) {
+				frcap *= 2;
+				fr = realloc(fr, sizeof(qbatchframe)*frcap);
+			}
+			fr[nfr].qn = &child[c];
+			fr[nfr].start = start;
+			fr[nfr++].len = nids - start;
+		}
+	}
+
+	QTRDUNLOCK(q);
+
+	// Group the hits by query, keeping their order within each
+	memset(offsets, 0, sizeof(uint32_t)*(n+1));
+	for(uint32_t i=0; i<nhits; i++)
+		offsets[hq[i]+1]++;
+	for(uint32_t i=0; i<n; i++)
+		offsets[i+1] += offsets[i];
+
+	void **ret = NULL;
+	if(nhits) {
+		ret = malloc(sizeof(void*)*nhits);
+		for(uint32_t i=0; i<nhits; i++)
+			ret[offsets[hq[i]]++] = hp[i];
+		for(uint32_t i=n; i>0; i--)
+			offsets[i] = offsets[i-1];
+		offsets[0] = 0;
+	}
+
+	free(rect);
+	free(ids);
+	free(fr);
+	free(hq);
+	free(hp);
+	return ret;
+}
+
+qquery
+qquery_new() {
+	qquery c = malloc(sizeof(_qquery));
+	memset(c, 0, sizeof(_qquery));
+	qstack_init(&c->st);
+	return c;
+}
+
+void
+qquery_free(qquery c) {
+	free(c->r.list);
+	qstack_free(&c->st);
+	free(c);
+}
+
+void**
+qtree_findInAreaCtx(qtree q, qquery c, float x, float y, float w, float h,
+					uint32_t *cnt) {
+	retlist_set_range(&c->r, x, y, w, h);
+
+	qtree_getInRange(q, &c->r, &c->st);
+
+	*cnt = c->r.cnt;
+	return c->r.list;
+}
+
+/* packed trees */
+
+/// Node captured while packing a tree
+typedef struct qpsrc {
+	const qnode *qn; ///< Node captured
+	qelems *el;      ///< Element storage at capture time
+	uint32_t cnt;    ///< Element count at capture time
+	qnode *child;    ///< Children at capture time
+} qpsrc;
+
+/// Returns element i of packed tree p, looking it up by id if p is mapped
+static inline void*
+qpack_elem(qpack p, uint32_t i) {
+	if(p->ptr)
+		return p->ptr[i];
+	if(p->base)
+		return p->base[p->id[i]];
+	return (void*)(uintptr_t)p->id[i];
+}
+
+/// Returns the index of packed node i's first child, or 0 if it has none
+static inline uint32_t
+qpack_child(qpack p, uint32_t i) {
+	uint32_t w = p->inner[i >> 5], bit = 1u << (i & 31);
+	if(! (w & bit))
+		return 0;
+	return 1 + 4*(p->rank[i >> 5] + (uint32_t)__builtin_popcount(w & (bit-1)));
+}
+
+/// Replaces b with node i's own bound if it is listed in p->exact
+static inline void
+qpack_exact(qpack p, uint32_t i, aabb *b) {
+	uint32_t lo = 0, hi = p->nexact;
+	while(lo < hi) {
+		uint32_t mid = (lo + hi)/2;
+		if(p->exact[mid].node < i) {
+			lo = mid+1;
+		} else {
+			if(p->exact[mid].node == i)
+				*b = p->exact[mid].bound;
+			hi = mid;
+		}
+	}
+}
+
+/// Returns the bound subdivide() gives child c of a node with bound b
+static inline aabb
+qbound_child(const aabb *b, int c) {
+	float hw = b->dims.w/2, hh = b->dims.h/2;
+	aabb k = { { c & 1 ? b->center.x+hw : b->center.x-hw,
+				 c & 2 ? b->center.y+hh : b->center.y-hh }, { hw, hh } };
+	return k;
+}
+
+/// Checks if bound b, grown by packed tree p's looseness, overlaps r->range
+static inline int
+qpack_overlaps(qpack p, const aabb *b, const retlist *r) {
+	aabb g = { b->center, { b->dims.w*p->loose, b->dims.h*p->loose } };
+	return aabb_intersects(&g, &r->range);
+}
+
+/// Packed tree traversal stack entry
+typedef struct qpframe {
+	uint32_t i; ///< Node index
+	aabb b;     ///< Node bound, before looseness is applied
+} qpframe;
+
+/// Collects elements of packed tree p in r->range; returns nonzero if stopped
+/*!
+  Walks the nodes depth-first like qnode_getInRange(), deriving each
+  child's bound from its parent's as it is pushed.
+*/
+static int
+qpack_getInRange(qpack p, retlist *r) {
+	qpframe fixed[QTREE_STACKFIXED];
+	qpframe *st = fixed;
+	uint32_t sn = 0, scap = QTREE_STACKFIXED;
+	int stop = 0;
+
+	if(! qpack_overlaps(p, &p->bound, r))
+		return 0;
+
+	st[sn++] = (qpframe){ 0, p->bound };
+
+	while(sn && ! stop) {
+		qpframe f = st[--sn];
+		uint32_t first = p->first[f.i], cnt = p->first[f.i+1] - first;
+
+		for(uint32_t base=0; base<cnt && ! stop; base+=64) {
+			uint32_t k = first + base;
+			uint32_t c = cnt-base < 64 ? cnt-base : 64;
+			uint64_t m = qbounds_scan(p->minx + k, p->miny + k,
+									  p->maxx + k, p->maxy + k, c, r->rect);
+
+			while(m) {
+				void *e = qpack_elem(p, k + __builtin_ctzll(m));
+				m &= m-1;
+				if(p->cmpfnc && ! (p->cmpfnc)(e, &r->range))
+					continue;
+				if(retlist_add(r, e)) {
+					stop = 1;
+					break;
+				}
+			}
+		}
+
+		uint32_t child = qpack_child(p, f.i);
+		if(! child || stop)
+			continue;
+
+		if(sn + 4 > scap) {
+			scap *= 2;
+			if(st == fixed) {
+				st = malloc(sizeof(qpframe)*scap);
+				memcpy(st, fixed, sizeof(fixed));
+			} else {
+				st = realloc(st, sizeof(qpframe)*scap);
+			}
+		}
+
+		for(int c=QSE; c>=QNW; c--) {
+			qpframe cf = { child+c, qbound_child(&f.b, c) };
+			if(p->nexact)
+				qpack_exact(p, cf.i, &cf.b);
+			if(qpack_overlaps(p, &cf.b, r))
+				st[sn++] = cf;
+		}
+	}
+
+	if(st != fixed)
+		free(st);
+	return stop;
+}
+
+/// Returns the number of bytes a packed tree's node table takes
+static size_t
+qpack_tablesize(uint64_t nn, uint64_t nexact) {
+	uint64_t nw = (nn + 31)/32;
+	return (nn+1)*sizeof(uint32_t) + 2*nw*sizeof(uint32_t) + nexact*sizeof(qpbound);
+}
+
+qpack
+qtree_pack(qtree q) {
+	qpsrc *src = NULL;
+	qpbound *ex = NULL;
+	uint32_t nn = 0, cap = 0, ne = 0, nexact = 0, excap = 0;
+
+	QTRDLOCK(q);
+
+	qnode *root = QTACQUIRE(q->root);
+	aabb bound = root->bound;
+
+	// Breadth-first walk; src doubles as the queue and the final node order
+	cap = 64;
+	src = malloc(sizeof(qpsrc)*cap);
+	src[nn].qn = root;
+	src[nn].el = qnode_read(root, &src[nn].cnt, &src[nn].child);
+	ne += src[nn++].cnt;
+
+	for(uint32_t i=0; i<nn; i++) {
+		qnode *c = src[i].child;
+		if(! c)
+			continue;
+		if(nn+4 > cap) {
+			cap *= 2;
+			src = realloc(src, sizeof(qpsrc)*cap);
+		}
+		for(int j=QNW; j<=QSE; j++) {
+			aabb d = qbound_child(&src[i].qn->bound, j);
+			if(memcmp(&d, &c[j].bound, sizeof(aabb))) {
+				if(nexact == excap) {
+					excap = excap ? excap*2 : 4;
+					ex = realloc(ex, sizeof(qpbound)*excap);
+				}
+				ex[nexact].node = nn;
+				ex[nexact++].bound = c[j].bound;
+			}
+
+			src[nn].qn = &c[j];
+			src[nn].el = qnode_read(&c[j], &src[nn].cnt, &src[nn].child);
+			ne += src[nn++].cnt;
+		}
+	}
+
+	uint32_t nw = (nn+31)/32;
+	qpack p = malloc(sizeof(_qpack) + ne*(sizeof(void*) + 4*sizeof(float)) +
+					 qpack_tablesize(nn, nexact));
+	memset(p, 0, sizeof(_qpack));
+	p->bound = bound;
+	p->loose = q->loose;
+	p->cmpfnc = q->cmpfnc;
+	p->nnodes = nn;
+	p->nexact = nexact;
+	p->ptr = (void**)(p+1);
+
+	float *minx = (float*)(p->ptr + ne);
+	float *miny = minx + ne;
+	float *maxx = miny + ne;
+	float *maxy = maxx + ne;
+	uint32_t *first = (uint32_t*)(maxy + ne);
+	uint32_t *inner = first + nn+1;
+	uint32_t *rank = inner + nw;
+	qpbound *exact = (qpbound*)(rank + nw);
+
+	p->minx = minx;
+	p->miny = miny;
+	p->maxx = maxx;
+	p->maxy = maxy;
+	p->first = first;
+	p->inner = inner;
+	p->rank = rank;
+	p->exact = exact;
+	memset(inner, 0, sizeof(uint32_t)*nw);
+	if(nexact)
+		memcpy(exact, ex, sizeof(qpbound)*nexact);
+
+	uint32_t k = 0, ninner = 0;
+	for(uint32_t i=0; i<nn; i++) {
+		qelems *el = src[i].el;
+
+		if(i % 32 == 0)
+			rank[i/32] = ninner;
+		if(src[i].child) {
+			inner[i/32] |= 1u << (i % 32);
+			ninner++;
+		}
+
+		first[i] = k;
+		for(uint32_t j=0; j<src[i].cnt; j++) {
+			p->ptr[k] = QTACQUIRE(el->ptr[j]);
+			minx[k] = el->minx[j];
+			miny[k] = el->miny[j];
+			maxx[k] = el->maxx[j];
+			maxy[k] = el->maxy[j];
+			k++;
+		}
+	}
+	first[nn] = k;
+	p->nelems = k;
+
+	QTRDUNLOCK(q);
+
+	free(ex);
+	free(src);
+	return p;
+}
+
+qpack
+qpack_new(float x, float y, float w, float h, qtree_fnc fnc, uint16_t nodecap,
+		  void **ptrs, uint32_t n) {
+	qtree q = qtree_new(x, y, w, h, fnc);
+	qtree_setMaxNodeCnt(q, nodecap);
+	qtree_insert_batch(q, ptrs, n);
+
+	qpack p = qtree_pack(q);
+	qtree_free(q);
+	return p;
+}
+
+void
+qpack_free(qpack p) {
+	if(p->map)
+		munmap(p->map, p->maplen);
+	free(p);
+}
+
+int
+qtree_save(qtree q, const char *path, qtree_id_fnc id_fn, void *userdata) {
+	FILE *f = fopen(path, "wb");
+	if(! f)
+		return 0;
+
+	qpack p = qtree_pack(q);
+	uint32_t ne = p->nelems;
+	qpfile h;
+
+	memset(&h, 0, sizeof(qpfile));
+	memcpy(h.magic, QTREE_FILEMAGIC, 4);
+	h.version = QTREE_FILEVERSION;
+	h.bound = p->bound;
+	h.loose = p->loose;
+	h.nnodes = p->nnodes;
+	h.nelems = ne;
+	h.nexact = p->nexact;
+
+	uint32_t *ids = malloc(sizeof(uint32_t)*ne + 1);
+	for(uint32_t i=0; i<ne; i++)
+		ids[i] = (id_fn)(p->ptr[i], userdata);
+
+	int ok = fwrite(&h, sizeof(qpfile), 1, f) == 1 &&
+		fwrite(ids, sizeof(uint32_t), ne, f) == ne &&
+		fwrite(p->minx, sizeof(float), ne, f) == ne &&
+		fwrite(p->miny, sizeof(float), ne, f) == ne &&
+		fwrite(p->maxx, sizeof(float), ne, f) == ne &&
+		fwrite(p->maxy, sizeof(float), ne, f) == ne &&
+		fwrite(p->first, qpack_tablesize(p->nnodes, p->nexact), 1, f) == 1;
+
+	free(ids);
+	qpack_free(p);
+
+	if(fclose(f) || ! ok) {
+		remove(path);
+		return 0;
+	}
+
+	return 1;
+}
+
+qpack
+qtree_mmap(const char *path, void **elems, qtree_fnc fnc) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	if(fstat(fd, &st) || (size_t)st.st_size < sizeof(qpfile)) {
+		close(fd);
+		return NULL;
+	}
+
+	size_t len = st.st_size;
+	void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return NULL;
+
+	const qpfile *h = map;
+	uint64_t ne = h->nelems, nn = h->nnodes, nx = h->nexact, nw = (nn+31)/32;
+
+	if(memcmp(h->magic, QTREE_FILEMAGIC, 4) || h->version != QTREE_FILEVERSION ||
+	   ! nn || len != sizeof(qpfile) + ne*5*sizeof(float) + qpack_tablesize(nn, nx)) {
+		munmap(map, len);
+		return NULL;
+	}
+
+	qpack p = malloc(sizeof(_qpack));
+	memset(p, 0, sizeof(_qpack));
+	p->bound = h->bound;
+	p->loose = h->loose;
+	p->cmpfnc = fnc;
+	p->nnodes = nn;
+	p->nelems = ne;
+	p->nexact = nx;
+	p->id = (const uint32_t*)(h+1);
+	p->base = elems;
+	p->minx = (const float*)(p->id + ne);
+	p->miny = p->minx + ne;
+	p->maxx = p->miny + ne;
+	p->maxy = p->maxx + ne;
+	p->first = (const uint32_t*)(p->maxy + ne);
+	p->inner = p->first + nn+1;
+	p->rank = p->inner + nw;
+	p->exact = (const qpbound*)(p->rank + nw);
+	p->map = map;
+	p->maplen = len;
+
+	// Searches trust the node table, so make sure it stays in bounds:
+	// element runs in order and within the arrays, ranks that match the
+	// inner bits, children always after their parent, and exactly as
+	// many nodes as the inner nodes have children
+	int ok = p->first[0] == 0 && p->first[nn] == ne &&
+		! (nn % 32 && p->inner[nw-1] >> (nn % 32));
+	uint32_t ninner = 0;
+
+	for(uint32_t i=0; i<nn && ok; i++) {
+		if(i % 32 == 0 && p->rank[i/32] != ninner)
+			ok = 0;
+		if(p->first[i] > p->first[i+1])
+			ok = 0;
+		if(p->inner[i/32] >> (i % 32) & 1) {
+			if(1 + 4*(uint64_t)ninner <= i)
+				ok = 0;
+			ninner++;
+		}
+	}
+	if(1 + 4*(uint64_t)ninner != nn)
+		ok = 0;
+	for(uint32_t i=0; i<nx && ok; i++)
+		if(! p->exact[i].node || p->exact[i].node >= nn ||
+		   (i && p->exact[i].node <= p->exact[i-1].node))
+			ok = 0;
+
+	if(! ok) {
+		qpack_free(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+void**
+qpack_findInArea(qpack p, float x, float y, float w, float h, uint32_t *cnt) {
+	retlist ret;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_range(&ret, x, y, w, h);
+
+	qpack_getInRange(p, &ret);
+
+	*cnt = ret.cnt;
+	return ret.list;
+}
+
+uint32_t
+qpack_visitInArea(qpack p, float x, float y, float w, float h,
+				  qtree_visit_fnc fn, void *userdata) {
+	retlist ret;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_range(&ret, x, y, w, h);
+	ret.visit = fn;
+	ret.ud = userdata;
+
+	qpack_getInRange(p, &ret);
+
+	return ret.cnt;
+}
+
+/* point trees */
+
+static inline float*
+qpt_xy(qptnode *n) {
+	return (float*)(n->ptr + n->cap);
+}
+
+static inline uint16_t*
+qpt_qxy(qptnode *n) {
+	return (uint16_t*)(n->ptr + n->cap);
+}
+
+/// Returns the child quadrant of n holding x,y; two comparisons
+static inline int
+qpt_quad(const qptnode *n, float x, float y) {
+	return (x >= n->x + n->w/2) | ((y >= n->y + n->h/2) << 1);
+}
+
+/// Encodes v as an offset into [lo, lo+span), in 1/65536 steps
+static inline uint16_t
+qpt_enc(float v, float lo, float span) {
+	float t = (v - lo) / span * 65536;
+	if(! (t > 0))
+		return 0;
+	if(t >= 65535)
+		return 65535;
+	return (uint16_t)t;
+}
+
+static inline float
+qpt_dec(uint16_t q, float lo, float span) {
+	return lo + (q + 0.5f) * (span / 65536);
+}
+
+/// Lowest offset whose decoded value is at least v
+static inline uint32_t
+qpt_enc_lo(float v, float lo, float span) {
+	float t = ceilf((v - lo) / span * 65536 - 0.5f);
+	if(! (t > 0))
+		return 0;
+	return t > 65536 ? 65536 : (uint32_t)t;
+}
+
+/// One past the highest offset whose decoded value is at most v
+static inline uint32_t
+qpt_enc_hi(float v, float lo, float span) {
+	float t = floorf((v - lo) / span * 65536 - 0.5f) + 1;
+	if(! (t > 0))
+		return 0;
+	return t > 65536 ? 65536 : (uint32_t)t;
+}
+
+/// Makes room in n for want points
+static void
+qpt_reserve(qptree p, qptnode *n, uint32_t want) {
+	if(want <= n->cap)
+		return;
+
+	uint32_t cap = n->cap ? n->cap : 4;
+	while(cap < want)
+		cap *= 2;
+
+	size_t csz = p->quant ? 2*sizeof(uint16_t) : 2*sizeof(float);
+	void **ptr = malloc(cap*(sizeof(void*) + csz));
+
+	if(n->cnt) {
+		memcpy(ptr, n->ptr, sizeof(void*)*n->cnt);
+		memcpy(ptr + cap, n->ptr + n->cap, csz*n->cnt);
+	}
+
+	free(n->ptr);
+	n->ptr = ptr;
+	n->cap = cap;
+}
+
+/// Appends a point to leaf n; coordinates are already in n's encoding
+static inline void
+qpt_push(qptree p, qptnode *n, void *ptr, float x, float y, uint16_t qx, uint16_t qy) {
+	qpt_reserve(p, n, n->cnt+1);
+	n->ptr[n->cnt] = ptr;
+	if(p->quant) {
+		qpt_qxy(n)[n->cnt*2] = qx;
+		qpt_qxy(n)[n->cnt*2+1] = qy;
+	} else {
+		qpt_xy(n)[n->cnt*2] = x;
+		qpt_xy(n)[n->cnt*2+1] = y;
+	}
+	n->cnt++;
+}
+
+/// Gives leaf n four children and moves its points into them
+/*!
+  A quantized offset's top bit says which half of the node it is in,
+  and the remaining bits are already the offset into that half, so
+  points move down without being decoded.
+*/
+static void
+qpt_split(qptree p, qptnode *n) {
+	qptnode *c = calloc(4, sizeof(qptnode));
+	float hw = n->w/2, hh = n->h/2;
+
+	for(int i=0; i<4; i++) {
+		c[i].x = i & 1 ? n->x + hw : n->x;
+		c[i].y = i & 2 ? n->y + hh : n->y;
+		c[i].w = hw;
+		c[i].h = hh;
+		c[i].parent = n;
+		c[i].depth = n->depth+1;
+	}
+
+	for(uint32_t i=0; i<n->cnt; i++) {
+		if(p->quant) {
+			uint16_t qx = qpt_qxy(n)[i*2], qy = qpt_qxy(n)[i*2+1];
+			int k = (qx >> 15) | ((qy >> 15) << 1);
+			qpt_push(p, &c[k], n->ptr[i], 0, 0, (uint16_t)(qx << 1), (uint16_t)(qy << 1));
+		} else {
+			float x = qpt_xy(n)[i*2], y = qpt_xy(n)[i*2+1];
+			qpt_push(p, &c[qpt_quad(n, x, y)], n->ptr[i], x, y, 0, 0);
+		}
+	}
+
+	free(n->ptr);
+	n->ptr = NULL;
+	n->cnt = 0;
+	n->cap = 0;
+	n->child = c;
+}
+
+/// Merges leaf children back into their parent while they fit, from n upwards
+static void
+qpt_collapse(qptree p, qptnode *n) {
+	for(; n; n = n->parent) {
+		qptnode *c = n->child;
+		uint32_t total = 0;
+
+		for(int i=0; i<4; i++) {
+			if(c[i].child)
+				return;
+			total += c[i].cnt;
+		}
+		if(total >= QTREE_POINTCAP)
+			return;
+
+		qpt_reserve(p, n, total);
+		for(int k=0; k<4; k++) {
+			for(uint32_t i=0; i<c[k].cnt; i++) {
+				if(p->quant) {
+					// The reverse of qpt_split(); the lowest bit is lost
+					uint16_t qx = qpt_qxy(&c[k])[i*2], qy = qpt_qxy(&c[k])[i*2+1];
+					qpt_push(p, n, c[k].ptr[i], 0, 0,
+							 (uint16_t)(((k & 1) << 15) | (qx >> 1)),
+							 (uint16_t)(((k >> 1) << 15) | (qy >> 1)));
+				} else {
+					qpt_push(p, n, c[k].ptr[i], qpt_xy(&c[k])[i*2], qpt_xy(&c[k])[i*2+1], 0, 0);
+				}
+			}
+			free(c[k].ptr);
+		}
+
+		free(c);
+		n->child = NULL;
+	}
+}
+
+/// Frees every node below n, leaving n an empty leaf
+/*!
+  Point trees never go deeper than QTREE_MAXDEPTH, so a fixed stack of
+  sibling blocks is enough.
+*/
+static void
+qpt_free_nodes(qptnode *n) {
+	qptnode *st[QTREE_STACKFIXED];
+	uint32_t sn = 0;
+
+	free(n->ptr);
+	if(n->child)
+		st[sn++] = n->child;
+
+	while(sn) {
+		qptnode *c = st[--sn];
+		for(int i=0; i<4; i++) {
+			free(c[i].ptr);
+			if(c[i].child)
+				st[sn++] = c[i].child;
+		}
+		free(c);
+	}
+
+	n->ptr = NULL;
+	n->cnt = 0;
+	n->cap = 0;
+	n->child = NULL;
+}
+
+/// Removes ptr from leaf n; returns 1 if it was there
+static int
+qpt_take(qptree p, qptnode *n, void *ptr) {
+	for(uint32_t i=0; i<n->cnt; i++) {
+		if(n->ptr[i] != ptr)
+			continue;
+
+		uint32_t last = --n->cnt;
+		n->ptr[i] = n->ptr[last];
+		if(p->quant) {
+			qpt_qxy(n)[i*2] = qpt_qxy(n)[last*2];
+			qpt_qxy(n)[i*2+1] = qpt_qxy(n)[last*2+1];
+		} else {
+			qpt_xy(n)[i*2] = qpt_xy(n)[last*2];
+			qpt_xy(n)[i*2+1] = qpt_xy(n)[last*2+1];
+		}
+
+		if(n->parent)
+			qpt_collapse(p, n->parent);
+		return 1;
+	}
+
+	return 0;
+}
+
+/// Collects the points in r->rect; returns nonzero if the search was stopped
+static int
+qpt_getInRange(qptree p, retlist *r) {
+	const float *rc = r->rect;
+	qptnode *st[QTREE_STACKFIXED];
+	uint32_t sn = 0;
+	qptnode *n = &p->root;
+
+	if(n->x > rc[2] || n->y > rc[3] || n->x + n->w < rc[0] || n->y + n->h < rc[1])
+		return 0;
+	st[sn++] = n;
+
+	while(sn) {
+		n = st[--sn];
+
+		if(n->child) {
+			for(int c=QSE; c>=QNW; c--) {
+				qptnode *k = &n->child[c];
+				if(k->x <= rc[2] && k->y <= rc[3] &&
+				   k->x + k->w >= rc[0] && k->y + k->h >= rc[1])
+					st[sn++] = k;
+			}
+			continue;
+		}
+
+		// A leaf inside the range needs no per-point tests
+		if(n->x >= rc[0] && n->y >= rc[1] &&
+		   n->x + n->w <= rc[2] && n->y + n->h <= rc[3]) {
+			if(r->fixed && ! r->visit && ! r->cap) {
+				r->cnt += n->cnt;
+				continue;
+			}
+			for(uint32_t i=0; i<n->cnt; i++)
+				if(retlist_add(r, n->ptr[i]))
+					return 1;
+			continue;
+		}
+
+		if(p->quant) {
+			// Turn the range into offsets once, and compare those
+			uint32_t x0 = qpt_enc_lo(rc[0], n->x, n->w), x1 = qpt_enc_hi(rc[2], n->x, n->w);
+			uint32_t y0 = qpt_enc_lo(rc[1], n->y, n->h), y1 = qpt_enc_hi(rc[3], n->y, n->h);
+			const uint16_t *xy = qpt_qxy(n);
+
+			for(uint32_t i=0; i<n->cnt; i++)
+				if(xy[i*2] >= x0 && xy[i*2] < x1 && xy[i*2+1] >= y0 && xy[i*2+1] < y1 &&
+				   retlist_add(r, n->ptr[i]))
+					return 1;
+		} else {
+			const float *xy = qpt_xy(n);
+
+			// aabb_contains() against the range, edges included
+			for(uint32_t i=0; i<n->cnt; i++)
+				if(xy[i*2] >= rc[0] && xy[i*2] <= rc[2] &&
+				   xy[i*2+1] >= rc[1] && xy[i*2+1] <= rc[3] &&
+				   retlist_add(r, n->ptr[i]))
+					return 1;
+		}
+	}
+
+	return 0;
+}
+
+qptree
+qptree_new(float x, float y, float w, float h, int quantize) {
+	qptree p = calloc(1, sizeof(_qptree));
+
+#if QTREE_THREADSAFE == 1 && QTREE_LOCK != QTREE_LOCK_HOOKS
+	qrw_init(&p->rw);
+#endif
+
+	p->quant = quantize != 0;
+	p->root.x = x;
+	p->root.y = y;
+	p->root.w = w;
+	p->root.h = h;
+
+	return p;
+}
+
+void
+qptree_free(qptree p) {
+	qpt_free_nodes(&p->root);
+
+#if QTREE_THREADSAFE == 1 && QTREE_LOCK != QTREE_LOCK_HOOKS
+	qrw_destroy(&p->rw);
+#endif
+
+	free(p);
+}
+
+int
+qptree_insert(qptree p, float x, float y, void *ptr) {
+	qptnode *n = &p->root;
+
+	if(! (x >= n->x && x <= n->x + n->w && y >= n->y && y <= n->y + n->h))
+		return 0;
+
+	QPWRLOCK(p);
+
+	while(n->child || (n->cnt == QTREE_POINTCAP && n->depth < QTREE_MAXDEPTH)) {
+		if(! n->child)
+			qpt_split(p, n);
+		n = &n->child[qpt_quad(n, x, y)];
+	}
+
+	if(p->quant)
+		qpt_push(p, n, ptr, 0, 0, qpt_enc(x, n->x, n->w), qpt_enc(y, n->y, n->h));
+	else
+		qpt_push(p, n, ptr, x, y, 0, 0);
+
+	QPWRUNLOCK(p);
+	return 1;
+}
+
+int
+qptree_remove(qptree p, float x, float y, void *ptr) {
+	qptnode *n = &p->root;
+	int ret;
+
+	QPWRLOCK(p);
+
+	while(n->child)
+		n = &n->child[qpt_quad(n, x, y)];
+
+	ret = qpt_take(p, n, ptr);
+
+	if(! ret && p->quant) {
+		// Rounding can put a point right on a split line into the
+		// neighbouring leaf; search every leaf before giving up
+		qptnode *st[QTREE_STACKFIXED];
+		uint32_t sn = 0;
+		st[sn++] = &p->root;
+
+		while(! ret && sn) {
+			n = st[--sn];
+			if(! n->child) {
+				ret = qpt_take(p, n, ptr);
+				continue;
+			}
+			for(int c=QSE; c>=QNW; c--)
+				st[sn++] = &n->child[c];
+		}
+	}
+
+	QPWRUNLOCK(p);
+	return ret;
+}
+
+void
+qptree_clear(qptree p) {
+	QPWRLOCK(p);
+	qpt_free_nodes(&p->root);
+	QPWRUNLOCK(p);
+}
+
+void**
+qptree_findInArea(qptree p, float x, float y, float w, float h, uint32_t *cnt) {
+	retlist ret;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_range(&ret, x, y, w, h);
+
+	QPRDLOCK(p);
+	qpt_getInRange(p, &ret);
+	QPRDUNLOCK(p);
+
+	*cnt = ret.cnt;
+	return ret.list;
+}
+
+uint32_t
+qptree_visitInArea(qptree p, float x, float y, float w, float h,
+				   qtree_visit_fnc fn, void *userdata) {
+	retlist ret;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_range(&ret, x, y, w, h);
+	ret.visit = fn;
+	ret.ud = userdata;
+
+	QPRDLOCK(p);
+	qpt_getInRange(p, &ret);
+	QPRDUNLOCK(p);
+
+	return ret.cnt;
+}
+
+uint32_t
+qptree_countInArea(qptree p, float x, float y, float w, float h) {
+	retlist ret;
+	memset(&ret, 0, sizeof(retlist));
+	retlist_set_range(&ret, x, y, w, h);
+	ret.fixed = 1;
+
+	QPRDLOCK(p);
+	qpt_getInRange(p, &ret);
+	QPRDUNLOCK(p);
+
+	return ret.cnt;
 }
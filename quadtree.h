@@ -9,22 +9,101 @@
 #ifndef _QUADTREE_H
  #define _QUADTREE_H
 
+#include <stdint.h>
+
 #ifndef _AABB_H
  #include "aabb.h"
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /// Opaque pointer to a quadtree data structure
 typedef struct _qtree* qtree;
 
+/// Opaque pointer to a reusable query context
+typedef struct _qquery* qquery;
+
+/// Opaque pointer to a read-only packed quadtree
+typedef struct _qpack* qpack;
+
+/// Opaque pointer to a quadtree of points
+typedef struct _qptree* qptree;
+
+/// Handle to an element inserted with qtree_insert_handle(); 0 is never valid
+typedef uint32_t qhandle;
+
 /// A function pointer def for determining if an element exists in a range
 typedef int (*qtree_fnc)(void *ptr, aabb *range);
 
+/// A function pointer def for visiting found elements
+/*!
+  Called with each element found and the userdata given to the query.
+  Returning nonzero stops the query.
+*/
+typedef int (*qtree_visit_fnc)(void *ptr, void *userdata);
+
+/// A function pointer def for measuring an element's distance to a point
+/*!
+  Should return the distance from x,y to the element. It must never be
+  less than the distance from x,y to the element's bound, if it was
+  inserted with one, nor to the node it was placed in, if not.
+*/
+typedef float (*qtree_dist_fnc)(void *ptr, float x, float y);
+
+/// A function pointer def for receiving overlapping pairs
+/*!
+  Called by qtree_findAllPairs() with two elements whose stored bounds
+  overlap, and the user data pointer given to it.
+*/
+typedef void (*qtree_pair_fnc)(void *a, void *b, void *userdata);
+
+/// A function pointer def for naming elements in saved trees
+/*!
+  Should return the id that qtree_save() stores in place of the
+  element's pointer.
+*/
+typedef uint32_t (*qtree_id_fnc)(void *ptr, void *userdata);
+
+/// A function pointer def for handing a task to another thread
+/*!
+  Should arrange for fn(arg) to be called once, on some other thread,
+  and return without waiting for it. userdata is the pointer given to
+  qtree_set_tasks().
+*/
+typedef void (*qtree_task_fnc)(void (*fn)(void *arg), void *arg, void *userdata);
+
+/// Number of bins in qtree_stats histograms
+#define QTREE_STATBINS 32
+
+/// Tree shape and counters, filled by qtree_get_stats()
+/*!
+  The shape fields are computed when qtree_get_stats() is called. The
+  counters below them are totals since the tree was created or last
+  reset, and are only kept if quadtree.c is built with QTREE_STATS.
+*/
+typedef struct qtree_stats {
+	uint32_t nodes;                   ///< Nodes, including the root
+	uint32_t depth;                   ///< Depth of the deepest node; the root is 0
+	uint32_t bydepth[QTREE_STATBINS]; ///< Nodes per depth; the last bin takes deeper ones
+	uint32_t bycnt[QTREE_STATBINS];   ///< Nodes by element count, in powers of two
+	uint32_t leafelems;               ///< Elements held by leaves
+	uint32_t innerelems;              ///< Elements held by nodes with children
+	uint64_t allocs;                  ///< Heap allocations for tree storage
+	uint64_t cmps;                    ///< Compare function calls
+	uint64_t queries;                 ///< Searches run
+	uint64_t visits;                  ///< Nodes searches visited
+	uint64_t spins;                   ///< Iterations spent waiting for the tree lock
+} qtree_stats;
+
 /// Create a new qtree
 /*!
   Creates a new qtree with a bound of w,h size, centered at x,y.
   
   Uses the passed function pointer fnc to test elements against nodes
-  for insertion, and finding.
+  for insertion, and finding. fnc may be NULL if elements are only
+  ever inserted with qtree_insert_aabb().
 
   Returns a new qtree pointer.
 */
@@ -32,21 +111,65 @@ qtree qtree_new(float x, float y, float w, float h, qtree_fnc fnc);
 
 /// Set mutex usage information
 /*!
-  Sets the mutex-handling functions for the given quadtree
-  to enable thread safety.
+  Sets the mutex-handling functions for the given quadtree.
 
-  If quadtree.c is built with QTREE_THREADSAFE == 0, this function
-  is a no-op.
+  Every quadtree is already protected by a built-in reader-writer lock,
+  so queries run concurrently with each other and inserts, removes and
+  clears are exclusive. When a mutex is set here, writers also take it
+  before waiting for the tree, so contending writers sleep on the mutex
+  rather than spinning against each other.
+
+  If quadtree.c is built with QTREE_LOCK_HOOKS, this mutex is the only
+  lock: queries and writers both take it, and a tree without one is not
+  locked at all. Set it before the tree is shared.
+
+  If quadtree.c is built without thread safety, this function is a
+  no-op.
 */
 void qtree_set_mutex(qtree q, void *newfn, void *lockfn, void *unlockfn, void *freefn);
 
+/// Set task-handling information for parallel batch builds and pair searches
+/*!
+  Lets qtree_insert_batch() and qtree_insert_aabb_batch() spread large
+  batches over nworkers extra threads, with the calling thread joining
+  in. runfn is called nworkers times per large batch to start helpers;
+  they share the four subtrees below each node, and idle helpers steal
+  queued subtrees from busy ones. A helper that is started late simply
+  finds nothing left to do. The tree's compare function must be safe
+  to call from several threads at once. qtree_findAllPairs() and
+  qtree_findInAreaPar() use the same helpers.
+
+  Passing a NULL runfn or 0 nworkers goes back to building on the
+  calling thread only. If quadtree.c is built with QTREE_THREADSAFE ==
+  0, this function is a no-op.
+*/
+void qtree_set_tasks(qtree q, qtree_task_fnc runfn, void *userdata, uint32_t nworkers);
+
+/// Enable or disable snapshot reads
+/*!
+  In snapshot mode, queries never wait for writers. Each query sees
+  every node either as it was before or after any concurrent insert,
+  remove or clear, and memory unlinked by a writer is only reused once
+  no query that might still see it is running. Writers are still
+  serialized against each other.
+
+  Snapshot mode makes removes and clears slower, since node element
+  lists are copied rather than changed in place, and a clear has to
+  retire the old tree node by node instead of resetting it.
+
+  Must not be called while other threads are using the tree. If
+  quadtree.c is built with QTREE_THREADSAFE == 0, this function is a
+  no-op.
+*/
+void qtree_set_snapshot(qtree q, int enable);
+
 /// Frees the passed qtree
 /*!
   Frees a quadtree and all its nodes, but does not touch the data held
   by them.
 
-  If qtree_set_mutex() was used and freefn was not null, will also
-  destroy the quadtree's mutex.
+  If qtree_set_mutex() was used, will also destroy the quadtree's
+  mutex.
 */
 void qtree_free(qtree q);
 
@@ -56,8 +179,67 @@ void qtree_free(qtree q);
 
   Uses the function passed to qtree_new() to determine where the
   element should go.
+
+  Returns 1 if the element was inserted, or 0 if it was dropped
+  because no node would take it.
+*/
+int qtree_insert(qtree q, void *ptr);
+
+/// Insert an element with a known bounding box
+/*!
+  Inserts the passed element into quadtree q, storing a copy of bound
+  next to the pointer. Placement uses the bound instead of the compare
+  function: the element goes into the deepest node that fully contains
+  bound, once the nodes above it are full.
+
+  Range searches test the stored bound inline, without touching the
+  element. If the tree has a compare function, it is still called for
+  elements whose bound overlaps the search range, as an exact check.
+  ptr may be NULL; it is stored and found like any other element.
+
+  Returns 0 if bound is not inside the tree's bound (nor, with
+  qtree_set_autogrow(), could the tree grow to fit it), in which case
+  nothing is inserted, and 1 otherwise.
 */
-void qtree_insert(qtree q, void *ptr);
+int qtree_insert_aabb(qtree q, void *ptr, aabb *bound);
+
+/// Insert a batch of elements
+/*!
+  Inserts the n elements in ptrs into quadtree q. The tree is built
+  top-down: a leaf that the batch would take over the cap is split, and
+  its share of the batch is partitioned among its children, each element
+  going to the first child that accepts it. This is faster than
+  inserting one at a time, especially into an empty tree. ptrs itself
+  is not modified.
+
+  Elements end up in the leaves, so the shape of the tree is not the one
+  n calls to qtree_insert() would give, though searches find the same
+  elements. Built into an empty tree, the shape does not depend on the
+  order of ptrs.
+
+  Returns the number of elements inserted; elements outside the tree's
+  bound are dropped, unless qtree_set_autogrow() is on and the tree can
+  grow to take them. The tree then grows before any of the batch goes
+  in.
+*/
+uint32_t qtree_insert_batch(qtree q, void **ptrs, uint32_t n);
+
+/// Insert a batch of elements with known bounds
+/*!
+  Inserts the n elements in ptrs, with bounds[i] the bound of ptrs[i],
+  into quadtree q. As with qtree_insert_batch(), the tree is built
+  top-down, but each node's share of the batch is partitioned on the
+  bounds alone; the compare function is never called. An element that
+  fits no child stays in the node. Neither array is modified.
+
+  In a loose tree (see qtree_set_loose()) the elements go where n calls
+  to qtree_insert_aabb() would put them; otherwise the shape differs as
+  described for qtree_insert_batch().
+
+  Returns the number of elements inserted; the same rules as for
+  qtree_insert_batch() apply to elements outside the tree's bound.
+*/
+uint32_t qtree_insert_aabb_batch(qtree q, void **ptrs, const aabb *bounds, uint32_t n);
 
 /// Removes an element from the quadtree
 /*!
@@ -65,9 +247,121 @@ void qtree_insert(qtree q, void *ptr);
 
   Performs a naive pointer comparison and a depth-first search of the
   tree, so this isn't very fast.
+
+  Once the subtree around the removed element holds fewer elements
+  than the maximum per node, its nodes are merged back into one and
+  the spare nodes are reused. qtree_remove_handle() and qtree_update()
+  do the same.
 */
 void qtree_remove(qtree q, void *ptr);
 
+/// Insert an element with a known bound, returning a handle to it
+/*!
+  Works as qtree_insert_aabb() does, and also returns a handle that
+  qtree_remove_handle() and qtree_update() can use to find the element
+  directly instead of searching for it.
+
+  The handle stays valid until the element is removed, by
+  qtree_remove_handle() or qtree_remove(), or the tree is cleared; it
+  may then be handed out again for another element.
+
+  Returns 0 if bound is not inside the tree's bound.
+*/
+qhandle qtree_insert_handle(qtree q, void *ptr, aabb *bound);
+
+/// Remove the element with handle h
+/*!
+  Takes constant time, unlike qtree_remove().
+
+  Returns 1 if the element was removed, or 0, doing nothing, if h is 0,
+  was never handed out by q, or its element was already removed.
+*/
+int qtree_remove_handle(qtree q, qhandle h);
+
+/// Change the bound of the element with handle h
+/*!
+  If the element still fits in the node it is in, only its stored bound
+  changes. Otherwise it is moved, starting from the nearest enclosing
+  node that contains the new bound, rather than from the root.
+
+  Returns 0, leaving the element as it was, if bound is not inside the
+  tree's bound and the tree cannot grow to fit it; 1 otherwise. Also
+  returns 0, doing nothing, for a handle qtree_remove_handle() would
+  reject.
+*/
+int qtree_update(qtree q, qhandle h, aabb *bound);
+
+/// Enable or disable deferred maintenance
+/*!
+  In deferred mode, inserts never split a node and removals never merge
+  one. A full node without children takes new elements past its cap
+  instead, and nodes that need splitting, shrinking or merging are
+  queued until qtree_maintain() is called. Searches give the same
+  results either way; they only get slower the more work is pending.
+  qtree_insert_batch() and qtree_insert_aabb_batch() are not affected.
+
+  Disabling deferred mode does all pending maintenance first.
+*/
+void qtree_set_deferred(qtree q, int enable);
+
+/// Do pending maintenance work
+/*!
+  Splits, shrinks and merges the nodes queued in deferred mode, until
+  none are left or about budget_us microseconds have passed. A
+  budget_us of 0 means no limit. The tree is locked for writing while
+  this runs.
+
+  Returns the number of queued nodes left.
+*/
+uint32_t qtree_maintain(qtree q, uint32_t budget_us);
+
+/// Set the looseness factor for elements inserted with a bound
+/*!
+  With a looseness above 1, each node is treated as covering its area
+  with the half-width and half-height scaled by looseness. An element
+  inserted with qtree_insert_aabb() moves down into the child holding
+  its center whenever it fits that child's loosened area, so only
+  elements that are large compared to a child stay in its parent, no
+  matter where they sit relative to the quadrant boundaries or when
+  they were inserted. Only leaves are filled up to the cap; a full
+  leaf splits and moves down every element that fits a child. Searches
+  test the loosened areas. 2 is a common choice; 1, the default, turns
+  loose placement off.
+
+  The looseness can be raised at any time, but only lowered while the
+  tree is empty. Returns 1 if it was changed, 0 otherwise.
+*/
+int qtree_set_loose(qtree q, float looseness);
+
+/// Enable or disable growing the tree to take in outside elements
+/*!
+  With autogrow on, an insert or update that falls outside the tree's
+  bound doubles the root's size instead, as often as needed up to a
+  limit: a new root goes above the current one, which becomes one of
+  its four children with all its elements and subtrees untouched.
+  Only elements too far out to fit after that are dropped. Growth
+  never reverses; qtree_clear() keeps the grown bound.
+
+  The current root is kept in whichever corner gives the smallest new
+  root, so for elements inserted without a bound, the compare function
+  is tried against a few candidate bounds. Off by default.
+*/
+void qtree_set_autogrow(qtree q, int enable);
+
+/// Set limits on how far nodes are split
+/*!
+  Nodes at depth maxdepth (the root being depth 0, even after the tree
+  has grown) are never split, nor
+  are nodes whose children would have a half-width or half-height
+  smaller than minhalf. Such a node takes any number of elements past
+  the maximum per node instead, which bounds the depth of the tree
+  when many elements share the same spot.
+
+  The defaults are a depth of 24 and no size limit. Nodes that are
+  already split are not affected.
+*/
+void qtree_set_limits(qtree q, uint8_t maxdepth, float minhalf);
+
 /// Set the maximum number of elements per node
 /*!
   Sets the maximum elements per quadtree node.
@@ -83,6 +377,25 @@ void qtree_setMaxNodeCnt(qtree q, uint16_t cnt);
 */
 void qtree_clear(qtree q);
 
+/// Fills s with the shape of the tree and its counters
+/*!
+  bycnt[0] counts empty nodes, and bycnt[k] nodes holding 2^(k-1) to
+  2^k - 1 elements. The tree is walked under a read lock, so this costs
+  about as much as a search covering the whole tree.
+
+  Counters are kept per thread and summed here; searches count once
+  per call, or once per box for qtree_findInAreaBatch(). Returns 1, or
+  0 if quadtree.c was built without QTREE_STATS, in which case the
+  counters are left at 0.
+*/
+int qtree_get_stats(qtree q, qtree_stats *s);
+
+/// Sets the counters reported by qtree_get_stats() back to 0
+/*!
+  Counts made by other threads while this runs may survive it.
+*/
+void qtree_reset_stats(qtree q);
+
 /// Find all elements within a rectangular bound
 /*!
   Performs a search for any elements within the given x,y + w,h
@@ -91,4 +404,341 @@ void qtree_clear(qtree q);
 */
 void** qtree_findInArea(qtree q, float x, float y, float w, float h, uint32_t *cnt);
 
+/// Find all elements within a rectangular bound into a caller-owned buffer
+/*!
+  As qtree_findInArea(), but writes at most cap element pointers into
+  buf instead of allocating. cnt receives the total number of elements
+  found, which may exceed cap.
+
+  Returns 1 if the buffer overflowed (and only the first cap elements
+  were stored), 0 otherwise.
+*/
+int qtree_findInAreaBuf(qtree q, float x, float y, float w, float h,
+						void **buf, uint32_t cap, uint32_t *cnt);
+
+/// Visit all elements within a rectangular bound
+/*!
+  Calls fn for each element found within the given x,y + w,h bound,
+  without building a result array. If fn returns nonzero, the search
+  stops immediately.
+
+  Returns the number of elements passed to fn.
+*/
+uint32_t qtree_visitInArea(qtree q, float x, float y, float w, float h,
+						   qtree_visit_fnc fn, void *userdata);
+
+/// Count the elements within a rectangular bound
+uint32_t qtree_countInArea(qtree q, float x, float y, float w, float h);
+
+/// Test for any element within a rectangular bound
+/*!
+  Returns 1 as soon as one element is found in the given x,y + w,h
+  bound, or 0 if there are none.
+*/
+int qtree_anyInArea(qtree q, float x, float y, float w, float h);
+
+/// Find all elements within a rectangular bound using several threads
+/*!
+  As qtree_findInArea(), for searches large enough to be worth
+  spreading over the helpers set with qtree_set_tasks(). The first few
+  levels below the root are searched on the calling thread, and the
+  subtrees below them are shared out as independent pieces. Each piece
+  collects into its own array, and the arrays are joined at the end,
+  in the same order a single-threaded search gives.
+
+  The tree's compare function must be safe to call from several
+  threads at once. Without a task hook, or if quadtree.c is built with
+  QTREE_THREADSAFE == 0, this is the same as qtree_findInArea().
+*/
+void** qtree_findInAreaPar(qtree q, float x, float y, float w, float h, uint32_t *cnt);
+
+/// Find all elements within each of several rectangular bounds
+/*!
+  Runs n range searches, one per box in boxes, in a single walk of the
+  tree: each node is visited once for all the boxes that reach it,
+  rather than once per box. Each search finds the same elements, in
+  the same order, as qtree_findInArea() would.
+
+  Results come back in one array, grouped by box: the elements found
+  in boxes[i] are ret[offsets[i]] up to but not including
+  ret[offsets[i+1]]. offsets must have room for n+1 entries, and
+  offsets[n] receives the total. The returned array should be freed by
+  the user; it is NULL if nothing was found.
+*/
+void** qtree_findInAreaBatch(qtree q, const aabb *boxes, uint32_t n, uint32_t *offsets);
+
+/// Find all elements within a circle
+/*!
+  Works as qtree_findInArea() does, for the circle of the given radius
+  around x,y. Nodes and stored element bounds are tested against the
+  circle itself. Elements inserted without a bound are passed to the
+  compare function with the circle's bounding box, so they are only
+  filtered that far.
+*/
+void** qtree_findInRadius(qtree q, float x, float y, float radius, uint32_t *cnt);
+
+/// Find all elements within a circle into a caller-owned array
+/*!
+  Works as qtree_findInAreaBuf() does, for the circle of the given
+  radius around x,y; see qtree_findInRadius().
+*/
+int qtree_findInRadiusBuf(qtree q, float x, float y, float radius,
+						  void **buf, uint32_t cap, uint32_t *cnt);
+
+/// Call fn for each element within a circle
+/*!
+  Works as qtree_visitInArea() does, for the circle of the given radius
+  around x,y; see qtree_findInRadius().
+*/
+uint32_t qtree_visitInRadius(qtree q, float x, float y, float radius,
+							 qtree_visit_fnc fn, void *userdata);
+
+/// Find all elements within a convex polygon
+/*!
+  Works as qtree_findInArea() does, for the convex polygon whose n
+  vertices are given as x,y pairs in xy, in either winding order. A
+  view frustum cut down to 2D is such a polygon. Nodes and stored
+  element bounds are tested against the polygon itself; elements
+  inserted without a bound are only filtered by the compare function
+  against the polygon's bounding box.
+*/
+void** qtree_findInPolygon(qtree q, const float *xy, uint32_t n, uint32_t *cnt);
+
+/// Find all elements within a convex polygon into a caller-owned array
+/*!
+  Works as qtree_findInAreaBuf() does; see qtree_findInPolygon().
+*/
+int qtree_findInPolygonBuf(qtree q, const float *xy, uint32_t n,
+						   void **buf, uint32_t cap, uint32_t *cnt);
+
+/// Call fn for each element within a convex polygon
+/*!
+  Works as qtree_visitInArea() does; see qtree_findInPolygon().
+*/
+uint32_t qtree_visitInPolygon(qtree q, const float *xy, uint32_t n,
+							  qtree_visit_fnc fn, void *userdata);
+
+/// Call fn for each element along a line segment, in order
+/*!
+  Calls fn for each element whose stored bound the segment from x0,y0
+  to x1,y1 passes through, ordered by where the segment enters the
+  bound, nearest to x0,y0 first. For a ray, pass an end point beyond
+  the tree's bound.
+
+  To find the first element a ray really hits, test the element
+  exactly in fn and return nonzero on a hit; the search stops there.
+  Elements inserted without a bound are only filtered by the compare
+  function against the segment's bounding box, and are visited as soon
+  as the segment enters the node holding them.
+
+  Returns the number of elements fn was called for.
+*/
+uint32_t qtree_visitOnSegment(qtree q, float x0, float y0, float x1, float y1,
+							  qtree_visit_fnc fn, void *userdata);
+
+/// Find the elements along a line segment, in order, into a caller-owned array
+/*!
+  Works as qtree_findInAreaBuf() does, storing the elements
+  qtree_visitOnSegment() would visit, in the same order. Nothing is
+  allocated unless the search queue outgrows its fixed first block.
+*/
+int qtree_findOnSegmentBuf(qtree q, float x0, float y0, float x1, float y1,
+						   void **buf, uint32_t cap, uint32_t *cnt);
+
+/// Call fn for each pair of elements whose bounds overlap
+/*!
+  A broad phase for collision detection in a single pass over the
+  tree: each node's elements are tested against each other, against
+  the subtrees below the node, and against the neighbouring subtrees
+  that elements can reach across a quadrant boundary. Every
+  overlapping pair is reported exactly once, in no particular order.
+  Touching edges count as overlapping. Elements inserted without a
+  bound are never paired. The compare function is not called; test
+  pairs exactly in fn if needed.
+
+  If a task hook is set with qtree_set_tasks(), the top of the tree is
+  split into independent pieces that the helpers and the calling
+  thread work through together, so fn must then be safe to call from
+  several threads at once. Either way, the call returns once every
+  pair has been reported.
+
+  Returns the number of pairs reported.
+*/
+uint32_t qtree_findAllPairs(qtree q, qtree_pair_fnc fn, void *userdata);
+
+/// Find the elements nearest to a point
+/*!
+  Finds up to k elements whose distance from x,y is at most maxdist,
+  and stores them in out, nearest first; out must have room for k
+  pointers. Pass INFINITY as maxdist for no limit.
+
+  Distances come from dist_fn if given. If dist_fn is NULL, an element
+  is as far away as the nearest point of its stored bound; elements
+  inserted without a bound are then all at distance 0, so trees with
+  such elements need a dist_fn.
+
+  Nodes are visited nearest first, and the search stops as soon as no
+  remaining node can be nearer than the k-th element found so far.
+
+  Returns the number of elements stored in out.
+*/
+uint32_t qtree_findNearest(qtree q, float x, float y, uint32_t k, float maxdist,
+						   void **out, qtree_dist_fnc dist_fn);
+
+/// Create a new query context
+/*!
+  A query context owns a result list that keeps its capacity between
+  queries. A context must only be used by one thread at a time.
+*/
+qquery qquery_new();
+
+/// Frees a query context and its result list
+void qquery_free(qquery c);
+
+/// Find all elements within a rectangular bound using a query context
+/*!
+  As qtree_findInArea(), but stores results in the context c. The
+  returned array is owned by c and stays valid until the next query
+  made with c, or until qquery_free(); do not free it.
+*/
+void** qtree_findInAreaCtx(qtree q, qquery c, float x, float y, float w, float h,
+						   uint32_t *cnt);
+
+/// Pack a qtree into a read-only linear tree
+/*!
+  Copies the tree's nodes and elements into a single array-based
+  layout: nodes are stored breadth-first and find their children by
+  index arithmetic rather than pointer, and each node's elements and
+  their bounds are one contiguous run. Node bounds are derived from
+  the Z order rather than stored, so a node takes four bytes and a bit.
+  The packed tree uses a fraction of the memory of the qtree and is
+  faster to search.
+
+  The packed tree does not change when q does, is searched with the
+  same results q would give at the time of packing, and keeps using
+  q's compare function. q may be freed afterwards.
+
+  Returns a new qpack pointer.
+*/
+qpack qtree_pack(qtree q);
+
+/// Build a packed tree directly from a batch of elements
+/*!
+  Builds the same tree qtree_new(x, y, w, h, fnc), then
+  qtree_setMaxNodeCnt(nodecap) and qtree_insert_batch(ptrs, n) would,
+  and packs it as qtree_pack() does.
+
+  Returns a new qpack pointer.
+*/
+qpack qpack_new(float x, float y, float w, float h, qtree_fnc fnc, uint16_t nodecap,
+				void **ptrs, uint32_t n);
+
+/// Save a qtree to a file that qtree_mmap() can search in place
+/*!
+  Packs q as qtree_pack() does and writes the packed tree to path. The
+  file holds no pointers: nodes refer to each other and to their
+  elements by index, and each element is saved as the id id_fn returns
+  for it, such as its index in an array of all elements. The file is
+  in the writing machine's byte order.
+
+  Returns 1 on success, or 0 if the file could not be written.
+*/
+int qtree_save(qtree q, const char *path, qtree_id_fnc id_fn, void *userdata);
+
+/// Open a file written by qtree_save() as a packed tree
+/*!
+  Maps the file read-only and returns a packed tree that is searched
+  straight from the mapping; nothing is loaded or rebuilt, so opening
+  takes the same time however large the tree is, and pages are only
+  read in as searches touch them. Processes mapping the same file
+  share its memory.
+
+  Searches return elems[id] for each element found, so elems must have
+  an entry for every id saved. If elems is NULL, they return the ids
+  themselves, cast to void*. fnc is the compare function for exact
+  checks, as for qtree_new(); it may be NULL if every element was
+  saved with a bound.
+
+  The file must not change while it is mapped. Free the packed tree
+  with qpack_free(), which unmaps the file. Returns NULL if the file
+  cannot be opened or is not a saved tree.
+*/
+qpack qtree_mmap(const char *path, void **elems, qtree_fnc fnc);
+
+/// Frees a packed tree
+void qpack_free(qpack p);
+
+/// Find all elements of a packed tree within a rectangular bound
+/*!
+  Works as qtree_findInArea() does. Packed trees never change, so any
+  number of threads may search one at the same time without locking.
+*/
+void** qpack_findInArea(qpack p, float x, float y, float w, float h, uint32_t *cnt);
+
+/// Call fn for each element of a packed tree within a rectangular bound
+/*!
+  Works as qtree_visitInArea() does.
+*/
+uint32_t qpack_visitInArea(qpack p, float x, float y, float w, float h,
+						   qtree_visit_fnc fn, void *userdata);
+
+/// Create a new quadtree of points
+/*!
+  A point tree holds elements that are bare x,y positions, stored next
+  to their pointers in the leaves, so no compare function is involved
+  and each point takes 16 bytes. Leaves split once they hold more than
+  16 points.
+
+  If quantize is nonzero, coordinates are kept as 16-bit offsets into
+  the bound of the leaf holding them, which brings a point down to 12
+  bytes. Positions are then only known to 1/65536 of the tree's width
+  and height, or finer, so points that close to a search edge may or
+  may not be found.
+
+  Point trees take the same lock as a quadtree, except with
+  QTREE_LOCK_HOOKS, when they are not locked at all.
+*/
+qptree qptree_new(float x, float y, float w, float h, int quantize);
+
+/// Frees a point tree
+void qptree_free(qptree p);
+
+/// Inserts a point
+/*!
+  Returns 0, inserting nothing, if x,y lies outside the tree's bound;
+  1 otherwise.
+*/
+int qptree_insert(qptree p, float x, float y, void *ptr);
+
+/// Removes a point
+/*!
+  x,y must be the position ptr was inserted at; it is used to find the
+  leaf holding it. Returns 1 if ptr was found and removed.
+*/
+int qptree_remove(qptree p, float x, float y, void *ptr);
+
+/// Removes all points
+void qptree_clear(qptree p);
+
+/// Find all points within a rectangular bound
+/*!
+  Works as qtree_findInArea() does; points on an edge of the bound are
+  found.
+*/
+void** qptree_findInArea(qptree p, float x, float y, float w, float h, uint32_t *cnt);
+
+/// Call fn for each point within a rectangular bound
+/*!
+  Works as qtree_visitInArea() does.
+*/
+uint32_t qptree_visitInArea(qptree p, float x, float y, float w, float h,
+							qtree_visit_fnc fn, void *userdata);
+
+/// Count the points within a rectangular bound
+uint32_t qptree_countInArea(qptree p, float x, float y, float w, float h);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,613 @@
+/*
+  quadtree.hpp
+  2014 JSK (kutani@projectkutani.com)
+
+  Header-only C++ front end to the quadtree. Part of the Panic Panic
+  project.
+
+  Released to the public domain. See LICENSE for details.
+*/
+#ifndef _QUADTREE_HPP
+ #define _QUADTREE_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifndef _AABB_H
+ #include "aabb.h"
+#endif
+
+namespace qt {
+
+/// Typed quadtree storing elements by value
+/*!
+  Places and searches elements the same way qtree_insert_aabb() and
+  qtree_findInArea() do, but everything is known at compile time: the
+  element type T is stored by value inside the nodes, BoundsFn is
+  called directly (and so can be inlined) to get an element's bound,
+  and NodeCap, the number of elements a node holds before it is split,
+  sizes each node's inline element storage. No linking against
+  quadtree.c is needed.
+
+  BoundsFn is a function object; bounds(el) must return the aabb of
+  element el. An element's bound is taken once, when it is inserted,
+  and kept next to it, so an element must not be changed in a way that
+  moves its bound while it is in the tree.
+
+  T only has to be move-constructible and move-assignable, so move-only
+  types such as std::unique_ptr work. To store elements elsewhere, make T an index
+  into your own array.
+
+  A node takes elements up to NodeCap before splitting; an element
+  then goes down into the child quadrant holding its center, as long
+  as that child contains all of its bound. Elements that straddle the
+  children, or that reach a node at depth MaxDepth, stay in the node
+  past the cap, in storage that grows on the heap. Removals merge
+  children back into their parent once they would fit.
+
+  Searches never allocate: results are visited through a callback,
+  copied into a caller-owned array, or walked with an iterator that
+  keeps its traversal stack inline. All of them work on a const tree,
+  which hands out const elements.
+
+  A quadtree is not thread-safe; searches from several threads at once
+  are fine as long as no thread changes the tree meanwhile.
+*/
+template<typename T, typename BoundsFn, unsigned NodeCap = 4, unsigned MaxDepth = 24>
+class quadtree {
+	static_assert(NodeCap > 0, "NodeCap must be at least 1");
+	static_assert(MaxDepth < 65536, "MaxDepth must fit in 16 bits");
+
+	enum : uint32_t { none = UINT32_MAX }; ///< No node
+
+	/// Element kept past a node's cap, with its bound
+	struct extra {
+		T el;           ///< The element
+		float rect[4];  ///< Bound as min x, min y, max x, max y
+	};
+
+	/// Tree node
+	/*!
+	  Elements below NodeCap live in the node itself, with their bounds
+	  as separate min/max arrays so scans can test several at a time;
+	  any past the cap are in more.
+	*/
+	struct node {
+		aabb bound;          ///< Area this node covers
+		uint32_t cnt;        ///< Number of elements
+		uint32_t child;      ///< First of four consecutive children; 0 if none
+		uint32_t parent;     ///< Parent node; none for the root
+		uint16_t depth;      ///< Distance from the root
+		bool freed;          ///< On the free list
+		float minx[NodeCap]; ///< Inline element bound left edges
+		float miny[NodeCap]; ///< Inline element bound top edges
+		float maxx[NodeCap]; ///< Inline element bound right edges
+		float maxy[NodeCap]; ///< Inline element bound bottom edges
+		alignas(T) unsigned char buf[sizeof(T)*NodeCap]; ///< Inline elements
+		std::vector<extra> more; ///< Elements past NodeCap
+
+		node(float x, float y, float hw, float hh, uint32_t p, uint16_t d)
+			: cnt(0), child(0), parent(p), depth(d), freed(false) {
+			bound.center.x = x;
+			bound.center.y = y;
+			bound.dims.w = hw;
+			bound.dims.h = hh;
+		}
+
+		~node() {
+			clear();
+		}
+
+		node(const node&) = delete;
+		node& operator=(const node&) = delete;
+
+		T& at(uint32_t i) {
+			if(i < NodeCap)
+				return reinterpret_cast<T*>(buf)[i];
+			return more[i-NodeCap].el;
+		}
+
+		const T& at(uint32_t i) const {
+			if(i < NodeCap)
+				return reinterpret_cast<const T*>(buf)[i];
+			return more[i-NodeCap].el;
+		}
+
+		/// Checks if element i's bound overlaps r, edges included
+		bool hits(uint32_t i, const float r[4]) const {
+			if(i < NodeCap)
+				return minx[i] <= r[2] && miny[i] <= r[3] &&
+					   maxx[i] >= r[0] && maxy[i] >= r[1];
+			const float *b = more[i-NodeCap].rect;
+			return b[0] <= r[2] && b[1] <= r[3] && b[2] >= r[0] && b[3] >= r[1];
+		}
+
+		void push(T &&el, const float r[4]) {
+			if(cnt < NodeCap) {
+				new (&reinterpret_cast<T*>(buf)[cnt]) T(std::move(el));
+				minx[cnt] = r[0];
+				miny[cnt] = r[1];
+				maxx[cnt] = r[2];
+				maxy[cnt] = r[3];
+			} else {
+				more.push_back(extra{ std::move(el), { r[0], r[1], r[2], r[3] } });
+			}
+			cnt++;
+		}
+
+		/// Moves element i out to dst, keeping its bound
+		void take(uint32_t i, node &dst) {
+			float r[4];
+			if(i < NodeCap) {
+				r[0] = minx[i]; r[1] = miny[i]; r[2] = maxx[i]; r[3] = maxy[i];
+			} else {
+				const float *b = more[i-NodeCap].rect;
+				r[0] = b[0]; r[1] = b[1]; r[2] = b[2]; r[3] = b[3];
+			}
+			dst.push(std::move(at(i)), r);
+		}
+
+		/// Removes element i, moving the last element into its slot
+		void erase(uint32_t i) {
+			uint32_t last = cnt-1;
+
+			if(i != last) {
+				at(i) = std::move(at(last));
+				if(i < NodeCap) {
+					if(last < NodeCap) {
+						minx[i] = minx[last]; miny[i] = miny[last];
+						maxx[i] = maxx[last]; maxy[i] = maxy[last];
+					} else {
+						const float *b = more[last-NodeCap].rect;
+						minx[i] = b[0]; miny[i] = b[1]; maxx[i] = b[2]; maxy[i] = b[3];
+					}
+				} else {
+					more[i-NodeCap].rect[0] = more[last-NodeCap].rect[0];
+					more[i-NodeCap].rect[1] = more[last-NodeCap].rect[1];
+					more[i-NodeCap].rect[2] = more[last-NodeCap].rect[2];
+					more[i-NodeCap].rect[3] = more[last-NodeCap].rect[3];
+				}
+			}
+
+			if(last < NodeCap)
+				reinterpret_cast<T*>(buf)[last].~T();
+			else
+				more.pop_back();
+			cnt--;
+		}
+
+		void clear() {
+			uint32_t n = cnt < NodeCap ? cnt : NodeCap;
+			for(uint32_t i=0; i<n; i++)
+				reinterpret_cast<T*>(buf)[i].~T();
+			more.clear();
+			cnt = 0;
+		}
+	};
+
+public:
+	/// Creates a tree covering the w,h area with its top-left corner at x,y
+	quadtree(float x, float y, float w, float h, BoundsFn fn = BoundsFn())
+		: bounds_(std::move(fn)), size_(0) {
+		nodes_.emplace_back(x + w/2, y + h/2, w/2, h/2, none, 0);
+	}
+
+	quadtree(const quadtree&) = delete;
+	quadtree& operator=(const quadtree&) = delete;
+
+	/// Takes over o's elements; o is left an empty tree of the same bound
+	quadtree(quadtree &&o)
+		: bounds_(std::move(o.bounds_)), nodes_(std::move(o.nodes_)),
+		  free_(std::move(o.free_)), size_(o.size_) {
+		o.reset(nodes_[0].bound);
+	}
+
+	/// Takes over o's elements; o is left an empty tree of the same bound
+	quadtree& operator=(quadtree &&o) {
+		if(this != &o) {
+			bounds_ = std::move(o.bounds_);
+			nodes_ = std::move(o.nodes_);
+			free_ = std::move(o.free_);
+			size_ = o.size_;
+			o.reset(nodes_[0].bound);
+		}
+		return *this;
+	}
+
+	/// Number of elements in the tree
+	size_t size() const {
+		return size_;
+	}
+
+	/// Inserts el; returns false, dropping it, if its bound is outside the tree
+	bool insert(T el) {
+		aabb b = bounds_(static_cast<const T&>(el));
+
+		if(! inside(b, nodes_[0].bound))
+			return false;
+
+		uint32_t n = 0;
+		for(;;) {
+			if(nodes_[n].cnt < NodeCap)
+				break;
+
+			if(! nodes_[n].child) {
+				if(nodes_[n].depth >= MaxDepth)
+					break;
+				subdivide(n);
+			}
+
+			const node &nd = nodes_[n];
+			uint32_t c = nd.child + ((b.center.x >= nd.bound.center.x) |
+									 ((b.center.y >= nd.bound.center.y) << 1));
+			if(! inside(b, nodes_[c].bound))
+				break;
+
+			n = c;
+		}
+
+		const float r[4] = { b.center.x - b.dims.w, b.center.y - b.dims.h,
+							 b.center.x + b.dims.w, b.center.y + b.dims.h };
+		nodes_[n].push(std::move(el), r);
+		size_++;
+		return true;
+	}
+
+	/// Constructs an element from args in place and inserts it
+	template<typename... A>
+	bool emplace(A&&... args) {
+		return insert(T(std::forward<A>(args)...));
+	}
+
+	/// Removes every element in the x,y + w,h bound for which pred(el) is true
+	/*!
+	  Returns the number of elements removed.
+	*/
+	template<typename Pred>
+	size_t remove_if(float x, float y, float w, float h, Pred pred) {
+		const float r[4] = { x, y, x+w, y+h };
+		uint32_t st[3*MaxDepth+1];
+		unsigned sn = 0;
+		size_t removed = 0;
+		std::vector<uint32_t> touched;
+
+		if(overlaps(nodes_[0], r))
+			st[sn++] = 0;
+
+		while(sn) {
+			uint32_t n = st[--sn];
+			node &nd = nodes_[n];
+			size_t before = removed;
+
+			for(uint32_t i=0; i<nd.cnt; ) {
+				if(nd.hits(i, r) && pred(static_cast<const T&>(nd.at(i)))) {
+					nd.erase(i);
+					removed++;
+				} else {
+					i++;
+				}
+			}
+
+			if(removed != before)
+				touched.push_back(n);
+
+			if(nd.child)
+				push_children(nd, r, st, sn);
+		}
+
+		// Merging frees children, so it waits until the walk is done;
+		// nodes deeper down come later in the walk, so go backwards
+		for(size_t i=touched.size(); i>0; i--)
+			if(! nodes_[touched[i-1]].freed)
+				collapse(touched[i-1]);
+
+		size_ -= removed;
+		return removed;
+	}
+
+	/// Removes all elements, leaving an empty root of the same bound
+	void clear() {
+		reset(nodes_[0].bound);
+	}
+
+	/// Iterator over the elements in a rectangular bound
+	/*!
+	  Walks the tree depth-first as it is advanced, in the same order
+	  the C search visits nodes. It holds its stack of pending nodes
+	  inline, so it never allocates. Changing the tree invalidates it.
+	  Const is set for the iterator of a const tree, which gives const
+	  elements.
+	*/
+	template<bool Const>
+	class basic_iterator {
+		typedef typename std::conditional<Const, const quadtree, quadtree>::type tree;
+		typedef typename std::conditional<Const, const node, node>::type tnode;
+
+	public:
+		typedef T value_type;
+		typedef typename std::conditional<Const, const T&, T&>::type reference;
+		typedef typename std::conditional<Const, const T*, T*>::type pointer;
+		typedef std::ptrdiff_t difference_type;
+		typedef std::forward_iterator_tag iterator_category;
+
+		/// The end iterator
+		basic_iterator() : t_(nullptr), sn_(0), n_(none), i_(0) {}
+
+		/// Converts an iterator to a const_iterator at the same position
+		template<bool C, typename = typename std::enable_if<Const && ! C>::type>
+		basic_iterator(const basic_iterator<C> &o)
+			: t_(o.t_), sn_(o.sn_), n_(o.n_), i_(o.i_) {
+			for(int k=0; k<4; k++)
+				r_[k] = o.r_[k];
+			for(unsigned k=0; k<sn_; k++)
+				st_[k] = o.st_[k];
+		}
+
+		reference operator*() const { return t_->nodes_[n_].at(i_); }
+		pointer operator->() const { return &t_->nodes_[n_].at(i_); }
+
+		basic_iterator& operator++() {
+			i_++;
+			advance();
+			return *this;
+		}
+
+		basic_iterator operator++(int) {
+			basic_iterator it = *this;
+			++*this;
+			return it;
+		}
+
+		bool operator==(const basic_iterator &o) const {
+			return t_ == o.t_ && (! t_ || (n_ == o.n_ && i_ == o.i_));
+		}
+
+		bool operator!=(const basic_iterator &o) const { return ! (*this == o); }
+
+	private:
+		friend class quadtree;
+		template<bool> friend class basic_iterator;
+
+		basic_iterator(tree *t, const float r[4]) : t_(t), sn_(0), n_(none), i_(0) {
+			for(int k=0; k<4; k++)
+				r_[k] = r[k];
+			if(overlaps(t->nodes_[0], r_))
+				st_[sn_++] = 0;
+			advance();
+		}
+
+		/// Moves to the first match at or after the current position
+		void advance() {
+			for(;;) {
+				if(n_ != none) {
+					tnode &nd = t_->nodes_[n_];
+					for(; i_ < nd.cnt; i_++)
+						if(nd.hits(i_, r_))
+							return;
+					if(nd.child)
+						t_->push_children(nd, r_, st_, sn_);
+				}
+
+				if(! sn_) {
+					t_ = nullptr;
+					return;
+				}
+
+				n_ = st_[--sn_];
+				i_ = 0;
+			}
+		}
+
+		tree *t_;
+		float r_[4];
+		uint32_t st_[3*MaxDepth+1];
+		unsigned sn_;
+		uint32_t n_;
+		uint32_t i_;
+	};
+
+	typedef basic_iterator<false> iterator;
+	typedef basic_iterator<true> const_iterator;
+
+	/// Range of the elements in a rectangular bound, for range-based for
+	template<typename It>
+	class basic_area {
+	public:
+		It begin() const { return b_; }
+		It end() const { return It(); }
+
+	private:
+		friend class quadtree;
+		explicit basic_area(It b) : b_(b) {}
+		It b_;
+	};
+
+	typedef basic_area<iterator> area;
+	typedef basic_area<const_iterator> const_area;
+
+	/// Returns the elements within the x,y + w,h bound as an iterator range
+	area findInArea(float x, float y, float w, float h) {
+		const float r[4] = { x, y, x+w, y+h };
+		return area(iterator(this, r));
+	}
+
+	/// Returns the elements within the x,y + w,h bound as a const iterator range
+	const_area findInArea(float x, float y, float w, float h) const {
+		const float r[4] = { x, y, x+w, y+h };
+		return const_area(const_iterator(this, r));
+	}
+
+	/// Stores pointers to the elements in the x,y + w,h bound in buf
+	/*!
+	  As qtree_findInAreaBuf(): stores at most cap pointers, and returns
+	  the total number of elements found, which may exceed cap.
+	*/
+	size_t findInArea(float x, float y, float w, float h, T **buf, size_t cap) {
+		return find_buf(*this, x, y, w, h, buf, cap);
+	}
+
+	/// Stores const pointers to the elements in the x,y + w,h bound in buf
+	size_t findInArea(float x, float y, float w, float h, const T **buf, size_t cap) const {
+		return find_buf(*this, x, y, w, h, buf, cap);
+	}
+
+	/// Calls fn(el) for each element in the x,y + w,h bound
+	/*!
+	  If fn returns true, the search stops there. Returns the number of
+	  elements fn was called for. On a const tree, fn gets const elements.
+	*/
+	template<typename F>
+	size_t visitInArea(float x, float y, float w, float h, F fn) {
+		return visit(*this, x, y, w, h, fn);
+	}
+
+	template<typename F>
+	size_t visitInArea(float x, float y, float w, float h, F fn) const {
+		return visit(*this, x, y, w, h, fn);
+	}
+
+	/// Counts the elements in the x,y + w,h bound
+	size_t countInArea(float x, float y, float w, float h) const {
+		size_t n = 0;
+		for(auto it = findInArea(x, y, w, h).begin(); it != const_iterator(); ++it)
+			n++;
+		return n;
+	}
+
+private:
+	/// Shared body of both findInArea() buffer forms; Tree may be const
+	template<typename Tree, typename P>
+	static size_t find_buf(Tree &t, float x, float y, float w, float h, P *buf, size_t cap) {
+		size_t n = 0;
+		for(auto &el : t.findInArea(x, y, w, h)) {
+			if(n < cap)
+				buf[n] = &el;
+			n++;
+		}
+		return n;
+	}
+
+	/// Shared body of both visitInArea() forms; Tree may be const
+	template<typename Tree, typename F>
+	static size_t visit(Tree &t, float x, float y, float w, float h, F &fn) {
+		size_t n = 0;
+		for(auto &el : t.findInArea(x, y, w, h)) {
+			n++;
+			if(fn(el))
+				break;
+		}
+		return n;
+	}
+
+	/// Empties the tree down to a root of bound b
+	void reset(aabb b) {
+		nodes_.clear();
+		free_.clear();
+		nodes_.emplace_back(b.center.x, b.center.y, b.dims.w, b.dims.h, none, 0);
+		size_ = 0;
+	}
+
+	/// Checks if box a lies entirely within box o
+	static bool inside(const aabb &a, const aabb &o) {
+		return std::fabs(a.center.x - o.center.x) + a.dims.w <= o.dims.w &&
+			   std::fabs(a.center.y - o.center.y) + a.dims.h <= o.dims.h;
+	}
+
+	/// Checks if node n's bound overlaps r, edges included
+	static bool overlaps(const node &n, const float r[4]) {
+		return n.bound.center.x - n.bound.dims.w <= r[2] &&
+			   n.bound.center.y - n.bound.dims.h <= r[3] &&
+			   n.bound.center.x + n.bound.dims.w >= r[0] &&
+			   n.bound.center.y + n.bound.dims.h >= r[1];
+	}
+
+	/// Pushes the children of n that overlap r, so they pop in QNW..QSE order
+	void push_children(const node &n, const float r[4], uint32_t *st, unsigned &sn) const {
+		for(int c=3; c>=0; c--)
+			if(overlaps(nodes_[n.child+c], r))
+				st[sn++] = n.child+c;
+	}
+
+	/// Gives node n four children, reusing a freed block if there is one
+	void subdivide(uint32_t n) {
+		float cx = nodes_[n].bound.center.x;
+		float cy = nodes_[n].bound.center.y;
+		float hw = nodes_[n].bound.dims.w/2;
+		float hh = nodes_[n].bound.dims.h/2;
+		uint16_t d = nodes_[n].depth+1;
+		uint32_t c;
+
+		if(! free_.empty()) {
+			c = free_.back();
+			free_.pop_back();
+		} else {
+			c = nodes_.size();
+			for(int i=0; i<4; i++)
+				nodes_.emplace_back(0, 0, 0, 0, n, d);
+		}
+
+		for(int i=0; i<4; i++) {
+			node &k = nodes_[c+i];
+			k.bound.center.x = i & 1 ? cx+hw : cx-hw;
+			k.bound.center.y = i & 2 ? cy+hh : cy-hh;
+			k.bound.dims.w = hw;
+			k.bound.dims.h = hh;
+			k.child = 0;
+			k.parent = n;
+			k.depth = d;
+			k.freed = false;
+		}
+
+		nodes_[n].child = c;
+	}
+
+	/// Merges leaf children into their parent while they fit, from n upwards
+	/*!
+	  As qnode_collapse(): a node takes its children's elements back once
+	  they would fit with a slot to spare, and the children's block goes
+	  on the free list.
+	*/
+	void collapse(uint32_t n) {
+		for(; n != none; n = nodes_[n].parent) {
+			node &p = nodes_[n];
+			if(! p.child)
+				continue;
+
+			uint32_t total = p.cnt;
+			for(int i=0; i<4; i++) {
+				if(nodes_[p.child+i].child)
+					return;
+				total += nodes_[p.child+i].cnt;
+			}
+			if(total >= NodeCap)
+				return;
+
+			for(int i=0; i<4; i++) {
+				node &k = nodes_[p.child+i];
+				for(uint32_t j=0; j<k.cnt; j++)
+					k.take(j, p);
+				k.clear();
+				k.freed = true;
+			}
+
+			free_.push_back(p.child);
+			p.child = 0;
+		}
+	}
+
+	BoundsFn bounds_;
+	std::deque<node> nodes_;      ///< Root first, then blocks of four siblings
+	std::vector<uint32_t> free_;  ///< First nodes of freed sibling blocks
+	size_t size_;
+};
+
+}
+
+#endif